@@ -0,0 +1,843 @@
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "bytecode.h"
+#include "compiler.h"
+#include "memory.h"
+#include "vm.h"
+
+typedef struct {
+	char *bytes;
+	size_t length;
+	size_t capacity;
+} Buffer;
+
+typedef struct {
+	Object **objects;
+	size_t count;
+	size_t capacity;
+	// Objects before this one have had what they reference collected.
+	size_t scanned;
+} ObjectTable;
+
+typedef struct {
+	Buffer out;
+	// Objects collected so far, to their index in their kind's table.
+	ObjectMap ids;
+	ObjectTable tables[BYTECODE_KINDS];
+	// Set on reaching something that can't be written.
+	bool failed;
+} Writer;
+
+// Makes room for `size` zeroed bytes at the next multiple of `alignment`,
+// and returns their offset.
+static size_t buffer_reserve(Buffer *buffer, size_t size, size_t alignment) {
+	size_t offset = (buffer->length + alignment - 1) & ~(alignment - 1);
+	size_t end = offset + size;
+	if (end > buffer->capacity) {
+		size_t capacity = buffer->capacity < 4096 ? 4096 : buffer->capacity;
+		while (capacity < end) {
+			capacity *= 2;
+		}
+		buffer->bytes = (char *)realloc(buffer->bytes, capacity);
+		if (buffer->bytes == NULL) {
+			exit(1);
+		}
+		buffer->capacity = capacity;
+	}
+	memset(buffer->bytes + buffer->length, 0, end - buffer->length);
+	buffer->length = end;
+	return offset;
+}
+
+static size_t buffer_append(Buffer *buffer, const void *bytes, size_t size, size_t alignment) {
+	size_t offset = buffer_reserve(buffer, size, alignment);
+	if (size > 0) {
+		memcpy(buffer->bytes + offset, bytes, size);
+	}
+	return offset;
+}
+
+static void *grow(void *array, size_t element_size, size_t *capacity) {
+	*capacity = GROW_CAPACITY(*capacity);
+	array = realloc(array, element_size * *capacity);
+	if (array == NULL) {
+		exit(1);
+	}
+	return array;
+}
+
+static BytecodeKind kind_of(Object *obj) {
+	switch (object_type(obj)) {
+	case OBJ_STRING:
+		return BYTECODE_STRING;
+	case OBJ_NATIVE:
+		return BYTECODE_NATIVE;
+	case OBJ_FUNCTION:
+		return BYTECODE_FUNCTION;
+	case OBJ_LIST:
+		return BYTECODE_LIST;
+	case OBJ_DICT:
+		return BYTECODE_DICT;
+	case OBJ_UPVALUE:
+		return BYTECODE_UPVALUE;
+	case OBJ_CLOSURE:
+		return BYTECODE_CLOSURE;
+	default:
+		return BYTECODE_NIL;
+	}
+}
+
+// Gives `obj` an index in its kind's table, the first time it's reached.
+static uint32_t collect(Writer *writer, Object *obj) {
+	Value *id = object_map_get(&writer->ids, obj);
+	if (id != NULL) {
+		return (uint32_t)AS_NUMBER(*id);
+	}
+	BytecodeKind kind = kind_of(obj);
+	// Frozen objects would come back mutable.
+	if (kind == BYTECODE_NIL || heap_is_shared(obj)) {
+		writer->failed = true;
+		return 0;
+	}
+	ObjectTable *table = &writer->tables[kind];
+	if (table->count == table->capacity) {
+		table->objects = (Object **)grow(table->objects, sizeof(Object *), &table->capacity);
+	}
+	uint32_t index = (uint32_t)table->count;
+	table->objects[table->count++] = obj;
+	object_map_set(&writer->ids, obj, NUMBER_VAL(index));
+	return index;
+}
+
+static BytecodeValue encode(Writer *writer, Value value) {
+	BytecodeValue encoded = { BYTECODE_NIL, 0, 0 };
+	if (IS_BOOL(value)) {
+		encoded.kind = AS_BOOL(value) ? BYTECODE_TRUE : BYTECODE_FALSE;
+	} else if (IS_NUMBER(value)) {
+		double number = AS_NUMBER(value);
+		encoded.kind = BYTECODE_NUMBER;
+		memcpy(&encoded.number, &number, sizeof(number));
+	} else if (IS_OBJ(value)) {
+		encoded.kind = kind_of(AS_OBJ(value));
+		encoded.index = collect(writer, AS_OBJ(value));
+	}
+	return encoded;
+}
+
+// The name of the global `native` was defined as, if any.
+static String *native_name(NativeFunction *native) {
+	for (size_t i = 0; i < vm.globals.capacity; i++) {
+		Entry *entry = &vm.globals.entries[i];
+		if (entry->key != NULL && IS_OBJ(entry->value) && AS_OBJ(entry->value) == (Object *)native) {
+			return entry->key;
+		}
+	}
+	return NULL;
+}
+
+// Collects what `obj` references.
+static void scan(Writer *writer, BytecodeKind kind, Object *obj) {
+	switch (kind) {
+	case BYTECODE_NATIVE: {
+		String *name = native_name((NativeFunction *)obj);
+		if (name == NULL) {
+			writer->failed = true;
+			return;
+		}
+		collect(writer, (Object *)name);
+		return;
+	}
+	case BYTECODE_FUNCTION: {
+		Function *function = (Function *)obj;
+		// Whatever the body allocates is reachable from the function, as
+		// is everything collected so far from `root`.
+		if (!compile_body(function)) {
+			writer->failed = true;
+			return;
+		}
+		if (function->name != NULL) {
+			collect(writer, (Object *)function->name);
+		}
+		ValueArray *constants = &function->chunk.constants;
+		for (size_t i = 0; i < constants->count; i++) {
+			encode(writer, constants->values[i]);
+		}
+		return;
+	}
+	case BYTECODE_LIST: {
+		ValueArray *values = &((List *)obj)->values;
+		for (size_t i = 0; i < values->count; i++) {
+			encode(writer, values->values[i]);
+		}
+		return;
+	}
+	case BYTECODE_DICT: {
+		Table *table = &((Dictionary *)obj)->table;
+		for (size_t i = 0; i < table->capacity; i++) {
+			if (table->entries[i].key != NULL) {
+				collect(writer, (Object *)table->entries[i].key);
+				encode(writer, table->entries[i].value);
+			}
+		}
+		return;
+	}
+	case BYTECODE_UPVALUE:
+		encode(writer, *((Upvalue *)obj)->location);
+		return;
+	case BYTECODE_CLOSURE: {
+		Closure *closure = (Closure *)obj;
+		collect(writer, (Object *)closure->function);
+		for (size_t i = 0; i < closure->upvalue_count; i++) {
+			collect(writer, (Object *)closure->upvalues[i]);
+		}
+		return;
+	}
+	default:
+		return;
+	}
+}
+
+static uint32_t index_of(Writer *writer, Object *obj) {
+	return (uint32_t)AS_NUMBER(*object_map_get(&writer->ids, obj));
+}
+
+static size_t write_values(Writer *writer, Value *values, size_t count) {
+	Buffer *out = &writer->out;
+	size_t offset = buffer_reserve(out, sizeof(BytecodeValue) * count, 8);
+	for (size_t i = 0; i < count; i++) {
+		BytecodeValue value = encode(writer, values[i]);
+		memcpy(out->bytes + offset + sizeof(BytecodeValue) * i, &value, sizeof(value));
+	}
+	return offset;
+}
+
+static void write_function(Writer *writer, Function *function, BytecodeFunction *record) {
+	Buffer *out = &writer->out;
+	Chunk *chunk = &function->chunk;
+	record->name = function->name != NULL ? index_of(writer, (Object *)function->name) : BYTECODE_NONE;
+	record->arity = function->arity;
+	record->upvalue_count = function->upvalue_count;
+	record->stackless = function->stackless;
+
+	record->code = buffer_append(out, chunk->code, chunk->count, 1);
+	record->code_count = chunk->count;
+	LineInfo *lines = &chunk->lines;
+	record->line_runs = buffer_append(out, lines->runs, lines->length, 1);
+	record->line_runs_length = lines->length;
+	record->line_checkpoints = buffer_append(out, lines->checkpoints,
+	                                         sizeof(LineCheckpoint) * lines->checkpoint_count, 8);
+	record->line_checkpoint_count = lines->checkpoint_count;
+	record->line = lines->line;
+	record->line_start = lines->start;
+	record->constants = write_values(writer, chunk->constants.values, chunk->constants.count);
+	record->constant_count = chunk->constants.count;
+
+	// Without liveness, frames are scanned in full, so the safepoints are
+	// no use either.
+	StackMaps *maps = &chunk->stack_maps;
+	if (maps->live != NULL && maps->count > 0) {
+		size_t count = maps->count;
+		record->stack_maps = buffer_append(out, maps->offsets, sizeof(uint32_t) * count, 8);
+		buffer_append(out, maps->local_counts, sizeof(uint32_t) * count, 4);
+		buffer_append(out, maps->live, sizeof(uint64_t) * count * maps->words, 8);
+		record->stack_map_count = count;
+		record->stack_map_words = maps->words;
+	}
+}
+
+static size_t record_size(BytecodeKind kind) {
+	switch (kind) {
+	case BYTECODE_STRING:
+		return sizeof(BytecodeString);
+	case BYTECODE_NATIVE:
+		return sizeof(BytecodeNative);
+	case BYTECODE_FUNCTION:
+		return sizeof(BytecodeFunction);
+	case BYTECODE_LIST:
+		return sizeof(BytecodeList);
+	case BYTECODE_DICT:
+		return sizeof(BytecodeDict);
+	case BYTECODE_UPVALUE:
+		return sizeof(BytecodeValue);
+	case BYTECODE_CLOSURE:
+		return sizeof(BytecodeClosure);
+	default:
+		return 0;
+	}
+}
+
+// Writes the data of `obj` and fills in its record.
+static void write_object(Writer *writer, BytecodeKind kind, Object *obj, void *record) {
+	Buffer *out = &writer->out;
+	switch (kind) {
+	case BYTECODE_STRING: {
+		String *str = (String *)obj;
+		BytecodeString *string = (BytecodeString *)record;
+		string->chars = buffer_reserve(out, str->length + 1, 1);
+		string->length = str->length;
+		memcpy(out->bytes + string->chars, str->chars, str->length);
+		return;
+	}
+	case BYTECODE_NATIVE:
+		((BytecodeNative *)record)->name = index_of(writer, (Object *)native_name((NativeFunction *)obj));
+		return;
+	case BYTECODE_FUNCTION:
+		write_function(writer, (Function *)obj, (BytecodeFunction *)record);
+		return;
+	case BYTECODE_LIST: {
+		ValueArray *values = &((List *)obj)->values;
+		BytecodeList *list = (BytecodeList *)record;
+		list->values = write_values(writer, values->values, values->count);
+		list->count = values->count;
+		return;
+	}
+	case BYTECODE_DICT: {
+		Table *table = &((Dictionary *)obj)->table;
+		BytecodeDict *dict = (BytecodeDict *)record;
+		dict->entries = buffer_reserve(out, sizeof(BytecodeEntry) * table->capacity, 8);
+		dict->capacity = table->capacity;
+		for (size_t i = 0; i < table->capacity; i++) {
+			Entry *from = &table->entries[i];
+			BytecodeEntry entry = { BYTECODE_NONE, 0, encode(writer, from->value) };
+			if (from->key != NULL) {
+				entry.key = index_of(writer, (Object *)from->key);
+			}
+			memcpy(out->bytes + dict->entries + sizeof(entry) * i, &entry, sizeof(entry));
+		}
+		return;
+	}
+	case BYTECODE_UPVALUE: {
+		BytecodeValue value = encode(writer, *((Upvalue *)obj)->location);
+		memcpy(record, &value, sizeof(value));
+		return;
+	}
+	case BYTECODE_CLOSURE: {
+		Closure *from = (Closure *)obj;
+		BytecodeClosure *closure = (BytecodeClosure *)record;
+		closure->function = index_of(writer, (Object *)from->function);
+		closure->upvalue_count = from->upvalue_count;
+		closure->upvalues = buffer_reserve(out, sizeof(uint32_t) * from->upvalue_count, 4);
+		for (size_t i = 0; i < from->upvalue_count; i++) {
+			uint32_t index = index_of(writer, (Object *)from->upvalues[i]);
+			memcpy(out->bytes + closure->upvalues + sizeof(index) * i, &index, sizeof(index));
+		}
+		return;
+	}
+	default:
+		return;
+	}
+}
+
+// Lays out everything reachable from `root` in `writer->out`.
+static bool write_image(Writer *writer, Value root) {
+	BytecodeHeader header = { 0 };
+	header.root = encode(writer, root);
+	bool scanning = true;
+	while (scanning && !writer->failed) {
+		scanning = false;
+		for (int kind = BYTECODE_STRING; kind < BYTECODE_KINDS; kind++) {
+			ObjectTable *table = &writer->tables[kind];
+			while (table->scanned < table->count && !writer->failed) {
+				scan(writer, (BytecodeKind)kind, table->objects[table->scanned++]);
+				scanning = true;
+			}
+		}
+	}
+	if (writer->failed) {
+		return false;
+	}
+
+	Buffer *out = &writer->out;
+	buffer_reserve(out, sizeof(BytecodeHeader), 8);
+	for (int kind = BYTECODE_STRING; kind < BYTECODE_KINDS; kind++) {
+		size_t count = writer->tables[kind].count;
+		header.tables[kind].offset = buffer_reserve(out, record_size((BytecodeKind)kind) * count, 8);
+		header.tables[kind].count = count;
+	}
+	for (int kind = BYTECODE_STRING; kind < BYTECODE_KINDS; kind++) {
+		ObjectTable *table = &writer->tables[kind];
+		size_t size = record_size((BytecodeKind)kind);
+		for (size_t i = 0; i < table->count; i++) {
+			// The buffer moves as it grows, so records are built on the side.
+			union {
+				BytecodeString string;
+				BytecodeNative native;
+				BytecodeFunction function;
+				BytecodeList list;
+				BytecodeDict dict;
+				BytecodeValue upvalue;
+				BytecodeClosure closure;
+			} record;
+			memset(&record, 0, sizeof(record));
+			write_object(writer, (BytecodeKind)kind, table->objects[i], &record);
+			memcpy(out->bytes + header.tables[kind].offset + size * i, &record, size);
+		}
+	}
+
+	memcpy(header.magic, BYTECODE_MAGIC, BYTECODE_MAGIC_LENGTH);
+	header.version = BYTECODE_VERSION;
+	header.byte_order = BYTECODE_BYTE_ORDER;
+	header.word_size = sizeof(size_t);
+	header.size = out->length;
+	memcpy(out->bytes, &header, sizeof(header));
+	return true;
+}
+
+bool bytecode_write(Value root, FILE *file) {
+	Writer writer;
+	memset(&writer, 0, sizeof(writer));
+	object_map_init(&writer.ids);
+	bool ok = write_image(&writer, root)
+	          && fwrite(writer.out.bytes, 1, writer.out.length, file) == writer.out.length;
+	free(writer.out.bytes);
+	for (int kind = 0; kind < BYTECODE_KINDS; kind++) {
+		free(writer.tables[kind].objects);
+	}
+	object_map_free(&writer.ids);
+	return ok;
+}
+
+bool bytecode_detect(const char *path) {
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		return false;
+	}
+	char magic[BYTECODE_MAGIC_LENGTH];
+	bool found = fread(magic, 1, sizeof(magic), file) == sizeof(magic)
+	             && memcmp(magic, BYTECODE_MAGIC, BYTECODE_MAGIC_LENGTH) == 0;
+	fclose(file);
+	return found;
+}
+
+static bool map_file(const char *path, BytecodeImage *image) {
+#ifdef WIN32
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		return false;
+	}
+	fseek(file, 0, SEEK_END);
+	image->size = (size_t)ftell(file);
+	rewind(file);
+	image->bytes = (char *)malloc(image->size > 0 ? image->size : 1);
+	bool ok = image->bytes != NULL && fread(image->bytes, 1, image->size, file) == image->size;
+	fclose(file);
+	image->mapped = false;
+	return ok;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat info;
+	if (fstat(fd, &info) < 0 || info.st_size == 0) {
+		close(fd);
+		return false;
+	}
+	void *bytes = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (bytes == MAP_FAILED) {
+		return false;
+	}
+	image->bytes = (char *)bytes;
+	image->size = (size_t)info.st_size;
+	image->mapped = true;
+	return true;
+#endif
+}
+
+void bytecode_unload(BytecodeImage *image) {
+	if (image->bytes == NULL) {
+		return;
+	}
+#ifndef WIN32
+	if (image->mapped) {
+		munmap(image->bytes, image->size);
+		image->bytes = NULL;
+		return;
+	}
+#endif
+	free(image->bytes);
+	image->bytes = NULL;
+}
+
+// Whether `count` elements of `size` bytes at `offset` lie within the image.
+static bool in_image(const BytecodeImage *image, uint64_t offset, uint64_t count, size_t size,
+                     size_t alignment) {
+	if (offset % alignment != 0 || offset > image->size) {
+		return false;
+	}
+	return count <= (image->size - offset) / size;
+}
+
+typedef struct {
+	const BytecodeImage *image;
+	const BytecodeHeader *header;
+	// Every object loaded so far, rooted on the stack, kind by kind: an
+	// object's index in its kind's table plus `base[kind]`.
+	List *objects;
+	size_t base[BYTECODE_KINDS];
+} Loader;
+
+static const void *record_at(Loader *loader, BytecodeKind kind, size_t index) {
+	return loader->image->bytes + loader->header->tables[kind].offset + record_size(kind) * index;
+}
+
+static size_t count_of(Loader *loader, BytecodeKind kind) {
+	return (size_t)loader->header->tables[kind].count;
+}
+
+static Object *object_at(Loader *loader, BytecodeKind kind, size_t index) {
+	return AS_OBJ(loader->objects->values.values[loader->base[kind] + index]);
+}
+
+static void add_object(Loader *loader, Object *obj) {
+	ValueArray *objects = &loader->objects->values;
+	objects->values[objects->count++] = OBJ_VAL(obj);
+}
+
+static bool decode(Loader *loader, const BytecodeValue *encoded, Value *value) {
+	switch (encoded->kind) {
+	case BYTECODE_NIL:
+		*value = NIL_VAL;
+		return true;
+	case BYTECODE_FALSE:
+		*value = BOOL_VAL(false);
+		return true;
+	case BYTECODE_TRUE:
+		*value = BOOL_VAL(true);
+		return true;
+	case BYTECODE_NUMBER: {
+		double number;
+		memcpy(&number, &encoded->number, sizeof(number));
+		*value = NUMBER_VAL(number);
+		return true;
+	}
+	case BYTECODE_STRING:
+	case BYTECODE_NATIVE:
+	case BYTECODE_FUNCTION:
+	case BYTECODE_LIST:
+	case BYTECODE_DICT:
+	case BYTECODE_CLOSURE:
+		if (encoded->index >= count_of(loader, (BytecodeKind)encoded->kind)) {
+			return false;
+		}
+		*value = OBJ_VAL(object_at(loader, (BytecodeKind)encoded->kind, encoded->index));
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Decodes `count` values at `offset` into a new heap array.
+static bool decode_values(Loader *loader, uint64_t offset, uint64_t count, Value **values) {
+	if (!in_image(loader->image, offset, count, sizeof(BytecodeValue), 8)) {
+		return false;
+	}
+	*values = GROW_ARRAY(Value, NULL, 0, (size_t)count);
+	const BytecodeValue *encoded = (const BytecodeValue *)(loader->image->bytes + offset);
+	for (size_t i = 0; i < count; i++) {
+		if (!decode(loader, &encoded[i], &(*values)[i])) {
+			FREE_ARRAY(Value, *values, (size_t)count);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool string_in_range(Loader *loader, uint32_t index) {
+	return index < count_of(loader, BYTECODE_STRING);
+}
+
+// First pass: allocates the object, and fills in what isn't a reference
+// to another object, except for natives and closures, whose references
+// come from earlier kinds.
+static bool allocate_object(Loader *loader, BytecodeKind kind, const void *record) {
+	const BytecodeImage *image = loader->image;
+	switch (kind) {
+	case BYTECODE_STRING: {
+		const BytecodeString *string = (const BytecodeString *)record;
+		if (string->length >= image->size || !in_image(image, string->chars, string->length + 1, 1, 1)
+		    || image->bytes[string->chars + string->length] != '\0') {
+			return false;
+		}
+		add_object(loader, (Object *)const_string(image->bytes + string->chars, (size_t)string->length));
+		return true;
+	}
+	case BYTECODE_NATIVE: {
+		const BytecodeNative *native = (const BytecodeNative *)record;
+		Value value;
+		if (!string_in_range(loader, native->name)
+		    || !table_get(&vm.globals, (String *)object_at(loader, BYTECODE_STRING, native->name), &value)
+		    || !IS_NATIVE(value)) {
+			return false;
+		}
+		add_object(loader, AS_OBJ(value));
+		return true;
+	}
+	case BYTECODE_FUNCTION: {
+		const BytecodeFunction *from = (const BytecodeFunction *)record;
+		if (from->stack_map_words > UINT32_MAX
+		    || !in_image(image, from->code, from->code_count, 1, 1)
+		    || !in_image(image, from->line_runs, from->line_runs_length, 1, 1)
+		    || !in_image(image, from->line_checkpoints, from->line_checkpoint_count,
+		                 sizeof(LineCheckpoint), 8)
+		    || from->line_start > from->code_count
+		    || !in_image(image, from->stack_maps, from->stack_map_count,
+		                 sizeof(uint32_t) * 2 + sizeof(uint64_t) * from->stack_map_words, 8)
+		    || (from->name != BYTECODE_NONE && !string_in_range(loader, from->name))) {
+			return false;
+		}
+		Function *function = function_new();
+		add_object(loader, (Object *)function);
+		if (from->name != BYTECODE_NONE) {
+			function->name = (String *)object_at(loader, BYTECODE_STRING, from->name);
+		}
+		function->arity = from->arity;
+		function->upvalue_count = from->upvalue_count;
+		function->stackless = from->stackless != 0;
+
+		// With no capacity, the chunk frees none of this (see chunk_free).
+		Chunk *chunk = &function->chunk;
+		chunk->code = (uint8_t *)(image->bytes + from->code);
+		chunk->count = (size_t)from->code_count;
+		LineInfo *lines = &chunk->lines;
+		lines->runs = (uint8_t *)(image->bytes + from->line_runs);
+		lines->length = (size_t)from->line_runs_length;
+		lines->checkpoints = (LineCheckpoint *)(image->bytes + from->line_checkpoints);
+		lines->checkpoint_count = (size_t)from->line_checkpoint_count;
+		lines->line = (Linenr)from->line;
+		lines->start = (uint32_t)from->line_start;
+		lines->end = (uint32_t)from->code_count;
+		if (from->stack_map_count > 0) {
+			StackMaps *maps = &chunk->stack_maps;
+			size_t count = (size_t)from->stack_map_count;
+			maps->offsets = (uint32_t *)(image->bytes + from->stack_maps);
+			maps->local_counts = maps->offsets + count;
+			maps->live = (uint64_t *)(maps->offsets + count * 2);
+			maps->words = (uint32_t)from->stack_map_words;
+			maps->count = count;
+		}
+		return true;
+	}
+	case BYTECODE_LIST:
+		add_object(loader, (Object *)list_new());
+		return true;
+	case BYTECODE_DICT:
+		add_object(loader, (Object *)dict_new());
+		return true;
+	case BYTECODE_UPVALUE: {
+		Upvalue *upvalue = upvalue_new(NULL);
+		upvalue->location = &upvalue->closed;
+		add_object(loader, (Object *)upvalue);
+		return true;
+	}
+	case BYTECODE_CLOSURE: {
+		const BytecodeClosure *closure = (const BytecodeClosure *)record;
+		if (closure->function >= count_of(loader, BYTECODE_FUNCTION)) {
+			return false;
+		}
+		Function *function = (Function *)object_at(loader, BYTECODE_FUNCTION, closure->function);
+		if (closure->upvalue_count != function->upvalue_count) {
+			return false;
+		}
+		add_object(loader, (Object *)closure_new(function));
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+// Second pass: fills in the references. Each object is complete, if
+// empty, until its arrays are in place.
+static bool fill_object(Loader *loader, BytecodeKind kind, const void *record, Object *obj) {
+	const BytecodeImage *image = loader->image;
+	switch (kind) {
+	case BYTECODE_FUNCTION: {
+		const BytecodeFunction *from = (const BytecodeFunction *)record;
+		Value *values;
+		if (!decode_values(loader, from->constants, from->constant_count, &values)) {
+			return false;
+		}
+		ValueArray *constants = &((Function *)obj)->chunk.constants;
+		constants->values = values;
+		constants->count = (size_t)from->constant_count;
+		constants->capacity = (size_t)from->constant_count;
+		return true;
+	}
+	case BYTECODE_LIST: {
+		const BytecodeList *from = (const BytecodeList *)record;
+		Value *values;
+		if (!decode_values(loader, from->values, from->count, &values)) {
+			return false;
+		}
+		ValueArray *list = &((List *)obj)->values;
+		list->values = values;
+		list->count = (size_t)from->count;
+		list->capacity = (size_t)from->count;
+		return true;
+	}
+	case BYTECODE_DICT: {
+		const BytecodeDict *from = (const BytecodeDict *)record;
+		size_t capacity = (size_t)from->capacity;
+		if ((capacity & (capacity - 1)) != 0
+		    || !in_image(image, from->entries, capacity, sizeof(BytecodeEntry), 8)) {
+			return false;
+		}
+		Entry *entries = GROW_ARRAY(Entry, NULL, 0, capacity);
+		const BytecodeEntry *encoded = (const BytecodeEntry *)(image->bytes + from->entries);
+		size_t count = 0;
+		for (size_t i = 0; i < capacity; i++) {
+			Entry *entry = &entries[i];
+			entry->key = NULL;
+			if (encoded[i].key != BYTECODE_NONE) {
+				if (!string_in_range(loader, encoded[i].key)) {
+					FREE_ARRAY(Entry, entries, capacity);
+					return false;
+				}
+				entry->key = (String *)object_at(loader, BYTECODE_STRING, encoded[i].key);
+			}
+			if (!decode(loader, &encoded[i].value, &entry->value)) {
+				FREE_ARRAY(Entry, entries, capacity);
+				return false;
+			}
+			// Tombstones count too, as in table.c.
+			count += entry->key != NULL || !IS_NIL(entry->value);
+		}
+		// Lookups stop at the first empty slot, so there must be one.
+		if (capacity > 0 && count == capacity) {
+			FREE_ARRAY(Entry, entries, capacity);
+			return false;
+		}
+		Table *table = &((Dictionary *)obj)->table;
+		table->entries = entries;
+		table->capacity = capacity;
+		table->count = count;
+		return true;
+	}
+	case BYTECODE_UPVALUE:
+		return decode(loader, (const BytecodeValue *)record, &((Upvalue *)obj)->closed);
+	case BYTECODE_CLOSURE: {
+		const BytecodeClosure *from = (const BytecodeClosure *)record;
+		if (!in_image(image, from->upvalues, from->upvalue_count, sizeof(uint32_t), 4)) {
+			return false;
+		}
+		Closure *closure = (Closure *)obj;
+		const uint32_t *upvalues = (const uint32_t *)(image->bytes + from->upvalues);
+		for (size_t i = 0; i < from->upvalue_count; i++) {
+			if (upvalues[i] >= count_of(loader, BYTECODE_UPVALUE)) {
+				return false;
+			}
+			closure->upvalues[i] = (Upvalue *)object_at(loader, BYTECODE_UPVALUE, upvalues[i]);
+		}
+		return true;
+	}
+	default:
+		return true;
+	}
+}
+
+static const char *load_objects(Loader *loader, Value *root) {
+	for (int kind = BYTECODE_STRING; kind < BYTECODE_KINDS; kind++) {
+		for (size_t i = 0; i < count_of(loader, (BytecodeKind)kind); i++) {
+			if (!allocate_object(loader, (BytecodeKind)kind, record_at(loader, (BytecodeKind)kind, i))) {
+				return "bad object";
+			}
+		}
+	}
+	for (int kind = BYTECODE_STRING; kind < BYTECODE_KINDS; kind++) {
+		for (size_t i = 0; i < count_of(loader, (BytecodeKind)kind); i++) {
+			if (!fill_object(loader, (BytecodeKind)kind, record_at(loader, (BytecodeKind)kind, i),
+			                 object_at(loader, (BytecodeKind)kind, i))) {
+				return "bad object";
+			}
+		}
+	}
+	if (!decode(loader, &loader->header->root, root)) {
+		return "bad root";
+	}
+	return NULL;
+}
+
+static const char *load(const BytecodeImage *image, Value *root) {
+	BytecodeHeader header;
+	if (image->size < sizeof(header)) {
+		return "truncated";
+	}
+	memcpy(&header, image->bytes, sizeof(header));
+	if (memcmp(header.magic, BYTECODE_MAGIC, BYTECODE_MAGIC_LENGTH) != 0) {
+		return "not a bytecode file";
+	}
+	if (header.version != BYTECODE_VERSION || header.byte_order != BYTECODE_BYTE_ORDER
+	    || header.word_size != sizeof(size_t)) {
+		return "written by a different version or for a different machine";
+	}
+	if (header.size != image->size) {
+		return "truncated";
+	}
+
+	Loader loader;
+	loader.image = image;
+	loader.header = &header;
+	size_t total = 0;
+	for (int kind = BYTECODE_STRING; kind < BYTECODE_KINDS; kind++) {
+		BytecodeTable *table = &header.tables[kind];
+		if (!in_image(image, table->offset, table->count, record_size((BytecodeKind)kind), 8)) {
+			return "truncated";
+		}
+		loader.base[kind] = total;
+		total += (size_t)table->count;
+	}
+
+	loader.objects = list_new();
+	vm_push(OBJ_VAL(loader.objects));
+	loader.objects->values.values = GROW_ARRAY(Value, NULL, 0, total);
+	loader.objects->values.capacity = total;
+	const char *error = load_objects(&loader, root);
+	vm_pop();
+	return error;
+}
+
+const char *bytecode_open(const char *path, BytecodeImage *image, Value *root) {
+	image->bytes = NULL;
+	if (!map_file(path, image)) {
+		return "could not open file";
+	}
+	return load(image, root);
+}
+
+bool bytecode_load(const char *path, BytecodeImage *image, Value *root) {
+	const char *error = bytecode_open(path, image, root);
+	if (error != NULL) {
+		printf("Could not load bytecode file %s: %s\n", path, error);
+		return false;
+	}
+	return true;
+}
+
+Value bytecode_snapshot_native(uint8_t argc, Value *args) {
+	if (!IS_STRING(args[0]) || !IS_DICT(args[1])) {
+		return NIL_VAL;
+	}
+	FILE *file = fopen(AS_CSTRING(args[0]), "wb");
+	if (file == NULL) {
+		return NIL_VAL;
+	}
+	// Only compiling bodies allocates, and nothing moves outside of
+	// safepoints, so the graph stays put.
+	bool ok = bytecode_write(args[1], file);
+	ok = fclose(file) == 0 && ok;
+	if (!ok) {
+		remove(AS_CSTRING(args[0]));
+		return NIL_VAL;
+	}
+	return BOOL_VAL(true);
+}
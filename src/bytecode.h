@@ -0,0 +1,177 @@
+#ifndef clox_bytecode_h
+#define clox_bytecode_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+// Images of object graphs that can be mapped and used in place, written by
+// `clox -o` for a compiled script and by snapshot() for whatever a script
+// built before it. Code, line info and stack maps are used where they sit
+// in the mapping, and strings are non-owned strings over their bytes in it
+// (see const_string). Everything else is allocated on the heap as it was,
+// with the references between objects relocated, and without running any
+// code: dicts even keep their layout, since string hashes don't depend on
+// where the strings are.
+//
+//   header          BytecodeHeader
+//   tables          one record per object, a table per kind of object
+//   data            string bytes (NUL terminated), code, lines, constants,
+//                   stack maps, list values, dict entries, upvalue indices
+//
+// Objects refer to each other by kind and index into the kind's table.
+// Offsets are from the start of the file. Arrays of 8-byte fields start
+// 8-byte aligned. A compiled script's root is its function; a snapshot's is
+// a dict of globals.
+//
+// Lines and stack maps are written as they are in memory, so a file only
+// loads on a machine with the same word size and byte order, and only into
+// the version of clox that wrote it. Loading checks that everything lies
+// within the file and that indices are in range, but not the code itself,
+// so only run files clox wrote.
+
+#define BYTECODE_MAGIC "LOXC"
+#define BYTECODE_MAGIC_LENGTH 4
+#define BYTECODE_VERSION 3
+// Written in native byte order; reads back differently on the other one.
+#define BYTECODE_BYTE_ORDER 0x01020304u
+// In place of a string index: a function without a name, an empty slot.
+#define BYTECODE_NONE UINT32_MAX
+
+typedef enum {
+  BYTECODE_NIL,
+  BYTECODE_FALSE,
+  BYTECODE_TRUE,
+  BYTECODE_NUMBER,
+  // The kinds of objects, each with a table of its own.
+  BYTECODE_STRING,
+  BYTECODE_NATIVE,
+  BYTECODE_FUNCTION,
+  BYTECODE_LIST,
+  BYTECODE_DICT,
+  BYTECODE_UPVALUE,
+  BYTECODE_CLOSURE,
+  BYTECODE_KINDS,
+} BytecodeKind;
+
+typedef struct {
+  uint32_t kind;
+  // The object's index in its kind's table.
+  uint32_t index;
+  // The number's bits.
+  uint64_t number;
+} BytecodeValue;
+
+typedef struct {
+  uint64_t offset;
+  uint64_t count;
+} BytecodeTable;
+
+typedef struct {
+  char magic[BYTECODE_MAGIC_LENGTH];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t word_size;
+  uint64_t size;
+  BytecodeValue root;
+  // Only the kinds of objects are used.
+  BytecodeTable tables[BYTECODE_KINDS];
+} BytecodeHeader;
+
+typedef struct {
+  uint64_t chars;
+  uint64_t length;
+} BytecodeString;
+
+// Natives are looked up by the name of the global they were defined as.
+typedef struct {
+  uint32_t name;
+  uint32_t unused;
+} BytecodeNative;
+
+typedef struct {
+  uint32_t name;
+  uint8_t arity;
+  uint8_t upvalue_count;
+  uint8_t stackless;
+  uint8_t unused;
+  uint64_t code;
+  uint64_t code_count;
+  // The line table (see LineInfo): the encoded runs, the checkpoints, and
+  // the last run.
+  uint64_t line_runs;
+  uint64_t line_runs_length;
+  uint64_t line_checkpoints;
+  uint64_t line_checkpoint_count;
+  uint64_t line;
+  uint64_t line_start;
+  // BytecodeValue[constant_count].
+  uint64_t constants;
+  uint64_t constant_count;
+  // Three arrays of `stack_map_count`: offsets and local counts, each a
+  // uint32_t, then `stack_map_words` words of liveness per safepoint.
+  uint64_t stack_maps;
+  uint64_t stack_map_count;
+  uint64_t stack_map_words;
+} BytecodeFunction;
+
+typedef struct {
+  // BytecodeValue[count].
+  uint64_t values;
+  uint64_t count;
+} BytecodeList;
+
+typedef struct {
+  uint32_t key;
+  uint32_t unused;
+  // For an empty slot, nil, or true for a tombstone (see table.c).
+  BytecodeValue value;
+} BytecodeEntry;
+
+typedef struct {
+  // BytecodeEntry[capacity], in the order of the table's slots.
+  uint64_t entries;
+  uint64_t capacity;
+} BytecodeDict;
+
+// Upvalues are written closed, so each record is just a BytecodeValue.
+
+typedef struct {
+  uint32_t function;
+  uint32_t upvalue_count;
+  // uint32_t[upvalue_count], indices of upvalues.
+  uint64_t upvalues;
+} BytecodeClosure;
+
+// A loaded file, which everything loaded from it points into.
+typedef struct {
+  char *bytes;
+  size_t size;
+  bool mapped;
+} BytecodeImage;
+
+// Writes `root` and everything it references, compiling function bodies
+// that haven't been (see compile_lazy), so `root` must be reachable.
+// Returns false if that includes coroutines, channels or frozen values, or
+// `file` couldn't be written.
+bool bytecode_write(Value root, FILE *file);
+
+// Whether the file at `path` starts with the bytecode magic.
+bool bytecode_detect(const char *path);
+// Maps the file at `path` and builds its objects into `root`. Returns
+// false after printing why the file can't be loaded. The image must stay
+// loaded for as long as the VM runs.
+bool bytecode_load(const char *path, BytecodeImage *image, Value *root);
+// Like bytecode_load, but returns why the file can't be loaded, or NULL,
+// instead of printing it. Strings from a file that fails partway through
+// may have been interned already, so the image must stay loaded anyway.
+const char *bytecode_open(const char *path, BytecodeImage *image, Value *root);
+void bytecode_unload(BytecodeImage *image);
+
+// snapshot(path, globals) writes the dict `globals` and everything it
+// references to an image at `path`, for `clox --image path` to start from.
+// Returns true, or nil if it couldn't be written.
+Value bytecode_snapshot_native(uint8_t argc, Value *args);
+
+#endif
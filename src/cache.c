@@ -0,0 +1,228 @@
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include "cache.h"
+#include "memory.h"
+
+#ifdef WIN32
+
+Function *cache_load(const char *src, size_t length, BytecodeImage *image) {
+	return NULL;
+}
+
+void cache_store(const char *src, size_t length, Function *function) {
+}
+
+#else
+
+#define CACHE_SUFFIX ".loxc"
+// Temporary files left by runs that died before renaming them are removed
+// once they're this old.
+#define CACHE_STALE_SECONDS 3600
+
+typedef struct {
+	char name[NAME_MAX + 1];
+	off_t size;
+	struct timespec used;
+} CacheEntry;
+
+static uint64_t hash_bytes(uint64_t hash, const void *bytes, size_t length) {
+	const unsigned char *from = (const unsigned char *)bytes;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= from[i];
+		hash *= 1099511628211u;
+	}
+	return hash;
+}
+
+// Identifies the compiler by the binary it's part of, so that rebuilding
+// clox starts a new set of entries. Without the binary to look at, the
+// time this file was compiled stands in for it.
+static uint64_t compiler_hash() {
+	uint64_t hash = hash_bytes(14695981039346656037u, BYTECODE_MAGIC, BYTECODE_MAGIC_LENGTH);
+	uint32_t version = BYTECODE_VERSION;
+	hash = hash_bytes(hash, &version, sizeof(version));
+	struct stat info;
+	if (stat("/proc/self/exe", &info) == 0) {
+		hash = hash_bytes(hash, &info.st_dev, sizeof(info.st_dev));
+		hash = hash_bytes(hash, &info.st_ino, sizeof(info.st_ino));
+		hash = hash_bytes(hash, &info.st_size, sizeof(info.st_size));
+		hash = hash_bytes(hash, &info.st_mtim, sizeof(info.st_mtim));
+		return hash;
+	}
+	const char *built = __DATE__ " " __TIME__;
+	return hash_bytes(hash, built, strlen(built));
+}
+
+static bool cache_dir(char *path, size_t size) {
+	const char *enabled = getenv("CLOX_CACHE");
+	if (enabled != NULL && strcmp(enabled, "0") == 0) {
+		return false;
+	}
+	const char *dir = getenv("CLOX_CACHE_DIR");
+	int written;
+	if (dir != NULL && dir[0] != '\0') {
+		written = snprintf(path, size, "%s", dir);
+	} else if ((dir = getenv("XDG_CACHE_HOME")) != NULL && dir[0] != '\0') {
+		written = snprintf(path, size, "%s/clox", dir);
+	} else if ((dir = getenv("HOME")) != NULL && dir[0] != '\0') {
+		written = snprintf(path, size, "%s/.cache/clox", dir);
+	} else {
+		return false;
+	}
+	return written > 0 && (size_t)written < size;
+}
+
+static bool entry_path(const char *src, size_t length, char *path, size_t size) {
+	char dir[PATH_MAX];
+	if (!cache_dir(dir, sizeof(dir))) {
+		return false;
+	}
+	uint64_t source = hash_bytes(14695981039346656037u, &length, sizeof(length));
+	source = hash_bytes(source, src, length);
+	int written = snprintf(path, size, "%s/%016llx-%016llx" CACHE_SUFFIX, dir,
+	                       (unsigned long long)source, (unsigned long long)compiler_hash());
+	return written > 0 && (size_t)written < size;
+}
+
+// Creates `dir` and any of its parents that are missing.
+static bool make_dirs(char *dir) {
+	for (char *slash = strchr(dir + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		bool ok = mkdir(dir, 0777) == 0 || errno == EEXIST;
+		*slash = '/';
+		if (!ok) {
+			return false;
+		}
+	}
+	return mkdir(dir, 0777) == 0 || errno == EEXIST;
+}
+
+static int compare_used(const void *a, const void *b) {
+	const struct timespec *x = &((const CacheEntry *)a)->used;
+	const struct timespec *y = &((const CacheEntry *)b)->used;
+	if (x->tv_sec != y->tv_sec) {
+		return x->tv_sec < y->tv_sec ? -1 : 1;
+	}
+	return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec;
+}
+
+// Removes the least recently used entries, other than `kept`, until the
+// rest fit in CLOX_CACHE_MAX. Runs that trim at the same time may both
+// remove an entry, which one of them then fails to, harmlessly.
+static void trim(const char *dir, const char *kept) {
+	DIR *stream = opendir(dir);
+	if (stream == NULL) {
+		return;
+	}
+	CacheEntry *entries = NULL;
+	size_t count = 0;
+	size_t capacity = 0;
+	off_t total = 0;
+	time_t now = time(NULL);
+	char path[PATH_MAX];
+	struct dirent *found;
+	while ((found = readdir(stream)) != NULL) {
+		const char *suffix = strstr(found->d_name, CACHE_SUFFIX);
+		struct stat info;
+		if (suffix == NULL || fstatat(dirfd(stream), found->d_name, &info, 0) != 0
+		    || !S_ISREG(info.st_mode)) {
+			continue;
+		}
+		if (suffix[strlen(CACHE_SUFFIX)] != '\0') {
+			// A temporary file, still being written or abandoned.
+			if (now - info.st_mtim.tv_sec > CACHE_STALE_SECONDS) {
+				unlinkat(dirfd(stream), found->d_name, 0);
+			}
+			continue;
+		}
+		total += info.st_size;
+		if (strcmp(found->d_name, kept) == 0) {
+			continue;
+		}
+		if (count == capacity) {
+			capacity = GROW_CAPACITY(capacity);
+			entries = (CacheEntry *)realloc(entries, sizeof(CacheEntry) * capacity);
+			if (entries == NULL) {
+				exit(1);
+			}
+		}
+		CacheEntry *entry = &entries[count++];
+		snprintf(entry->name, sizeof(entry->name), "%s", found->d_name);
+		entry->size = info.st_size;
+		entry->used = info.st_mtim;
+	}
+	closedir(stream);
+
+	off_t max = (off_t)env_size("CLOX_CACHE_MAX", CACHE_DEFAULT_MAX);
+	if (total > max) {
+		qsort(entries, count, sizeof(CacheEntry), compare_used);
+		for (size_t i = 0; i < count && total > max; i++) {
+			if (snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name) >= (int)sizeof(path)) {
+				continue;
+			}
+			if (unlink(path) == 0) {
+				total -= entries[i].size;
+			}
+		}
+	}
+	free(entries);
+}
+
+Function *cache_load(const char *src, size_t length, BytecodeImage *image) {
+	char path[PATH_MAX];
+	if (!entry_path(src, length, path, sizeof(path))) {
+		return NULL;
+	}
+	Value root;
+	if (bytecode_open(path, image, &root) != NULL || !IS_FUNCTION(root)) {
+		// Only a damaged entry gets here, as every binary has entries of its
+		// own. The next store replaces it.
+		return NULL;
+	}
+	// Entries are trimmed by when they were last used, not written.
+	utimensat(AT_FDCWD, path, NULL, 0);
+	return AS_FUNCTION(root);
+}
+
+void cache_store(const char *src, size_t length, Function *function) {
+	char path[PATH_MAX];
+	char temp[PATH_MAX];
+	if (!entry_path(src, length, path, sizeof(path))
+	    || snprintf(temp, sizeof(temp), "%s.XXXXXX", path) >= (int)sizeof(temp)) {
+		return;
+	}
+	char *name = strrchr(path, '/');
+	*name = '\0';
+	bool made = make_dirs(path);
+	*name = '/';
+	int fd = made ? mkstemp(temp) : -1;
+	if (fd < 0) {
+		return;
+	}
+	FILE *file = fdopen(fd, "wb");
+	if (file == NULL) {
+		close(fd);
+		unlink(temp);
+		return;
+	}
+	bool ok = bytecode_write(OBJ_VAL(function), file);
+	if (fclose(file) != 0 || !ok || rename(temp, path) != 0) {
+		unlink(temp);
+		return;
+	}
+	*name = '\0';
+	trim(path, name + 1);
+}
+
+#endif
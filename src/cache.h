@@ -0,0 +1,35 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "bytecode.h"
+#include "common.h"
+#include "object.h"
+
+// A cache of compiled scripts, so running the same source again skips the
+// compiler. An entry is a bytecode file named after a hash of the source
+// and one of the compiler, so it's found again only for the same source
+// run by the same clox binary, and an entry from another build is never
+// looked at.
+//
+// The cache lives in $CLOX_CACHE_DIR, or $XDG_CACHE_HOME/clox, or
+// ~/.cache/clox. CLOX_CACHE=0 turns it off.
+//
+// Entries are written to a temporary file and renamed into place, so
+// concurrent runs either find a whole entry or none, and the last of them
+// to finish compiling wins. Loading maps the file, which stays valid even
+// if another run replaces or removes it in the meantime.
+//
+// Loading an entry touches it. After writing one, the least recently used
+// entries are removed until the cache is under CLOX_CACHE_MAX bytes
+// (CACHE_DEFAULT_MAX if not set).
+
+#define CACHE_DEFAULT_MAX (64 * 1024 * 1024)
+
+// Returns the cached script for `length` bytes of `src`, with its image
+// loaded into `image`, or NULL if there's none.
+Function *cache_load(const char *src, size_t length, BytecodeImage *image);
+// Writes `function`, compiled from `length` bytes of `src`, to the cache.
+// Failing to is not an error; the next run compiles again.
+void cache_store(const char *src, size_t length, Function *function);
+
+#endif
@@ -0,0 +1,94 @@
+#include "channel.h"
+#include "loop.h"
+#include "object.h"
+#include "vm.h"
+
+// channel(limit) makes a channel that buffers up to `limit` values, or as
+// many as are sent if `limit` is nil.
+Value channel_native(uint8_t argc, Value *args) {
+	if (IS_NIL(args[0])) {
+		return OBJ_VAL(channel_new(0));
+	}
+	if (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 1) {
+		return NIL_VAL;
+	}
+	return OBJ_VAL(channel_new((size_t)AS_NUMBER(args[0])));
+}
+
+// send(channel, value) returns true once the value is buffered or handed to
+// a receiver, parking the caller while the channel is full. Returns false
+// if the channel is closed, or full and the caller can't be parked.
+Value channel_send_native(uint8_t argc, Value *args) {
+	if (!IS_CHANNEL(args[0])) {
+		return FALSE_VAL;
+	}
+	Channel *channel = AS_CHANNEL(args[0]);
+	if (channel->closed) {
+		return FALSE_VAL;
+	}
+	if (channel->receivers.count > 0) {
+		ChannelWaiter receiver = wait_queue_shift(&channel->receivers);
+		loop_wake(&vm.loop, receiver.task, args[1]);
+		return TRUE_VAL;
+	}
+	if (channel->limit == 0 || channel->count < channel->limit) {
+		channel_push(channel, args[1]);
+		return TRUE_VAL;
+	}
+
+	Coroutine *task = vm_parkable();
+	if (task == NULL) {
+		return FALSE_VAL;
+	}
+	wait_queue_push(&channel->senders, task, args[1]);
+	loop_park(&vm.loop, task);
+	return NIL_VAL;
+}
+
+// recv(channel) returns the oldest value sent, parking the caller while the
+// channel is empty. Returns nil once the channel is closed and drained, or
+// if it is empty and the caller can't be parked.
+Value channel_recv_native(uint8_t argc, Value *args) {
+	if (!IS_CHANNEL(args[0])) {
+		return NIL_VAL;
+	}
+	Channel *channel = AS_CHANNEL(args[0]);
+	if (channel->count > 0) {
+		Value value = channel_shift(channel);
+		if (channel->senders.count > 0) {
+			// Room for the first parked sender's value.
+			ChannelWaiter sender = wait_queue_shift(&channel->senders);
+			channel_push(channel, sender.value);
+			loop_wake(&vm.loop, sender.task, TRUE_VAL);
+		}
+		return value;
+	}
+	if (channel->closed) {
+		return NIL_VAL;
+	}
+
+	Coroutine *task = vm_parkable();
+	if (task == NULL) {
+		return NIL_VAL;
+	}
+	wait_queue_push(&channel->receivers, task, NIL_VAL);
+	loop_park(&vm.loop, task);
+	return NIL_VAL;
+}
+
+// Closing wakes every parked receiver with nil and every parked sender with
+// false. Values already buffered can still be received.
+Value channel_close_native(uint8_t argc, Value *args) {
+	Channel *channel = AS_CHANNEL(args[0]);
+	if (channel->closed) {
+		return FALSE_VAL;
+	}
+	channel->closed = true;
+	while (channel->receivers.count > 0) {
+		loop_wake(&vm.loop, wait_queue_shift(&channel->receivers).task, NIL_VAL);
+	}
+	while (channel->senders.count > 0) {
+		loop_wake(&vm.loop, wait_queue_shift(&channel->senders).task, FALSE_VAL);
+	}
+	return TRUE_VAL;
+}
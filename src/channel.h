@@ -0,0 +1,17 @@
+#ifndef clox_channel_h
+#define clox_channel_h
+
+#include "common.h"
+#include "value.h"
+
+// Channels hand values between tasks run by the event loop. A receive on an
+// empty channel, or a send on a full one, parks the task on the channel
+// instead of polling. The matching send or receive passes the value
+// straight to the parked peer and puts it back on the run queue.
+
+Value channel_native(uint8_t argc, Value *args);
+Value channel_send_native(uint8_t argc, Value *args);
+Value channel_recv_native(uint8_t argc, Value *args);
+Value channel_close_native(uint8_t argc, Value *args);
+
+#endif
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "debug.h"
@@ -6,47 +7,182 @@
 #include "vm.h"
 
 void line_info_init(LineInfo *lines) {
-	lines->count = 0;
+	lines->runs = NULL;
+	lines->length = 0;
 	lines->capacity = 0;
-	lines->lines = NULL;
+	lines->checkpoints = NULL;
+	lines->checkpoint_count = 0;
+	lines->checkpoint_capacity = 0;
+	lines->run_count = 0;
+	lines->encoded = 0;
+	lines->line = 0;
+	lines->start = 0;
+	lines->end = 0;
 }
 
-void line_info_inc(LineInfo *lines, Linenr line) {
-	if (lines->count == 0 || lines->lines[lines->count-1].line < line) {
-		if (lines->capacity < lines->count + 1) {
+static void write_varint(LineInfo *lines, size_t value) {
+	do {
+		if (lines->capacity < lines->length + 1) {
 			size_t old_capacity = lines->capacity;
 			lines->capacity = GROW_CAPACITY(old_capacity);
-			lines->lines = GROW_ARRAY(Line, lines->lines, old_capacity, lines->capacity);
+			lines->runs = GROW_ARRAY(uint8_t, lines->runs, old_capacity, lines->capacity);
+		}
+		uint8_t byte = value & 0x7f;
+		value >>= 7;
+		lines->runs[lines->length++] = byte | (value != 0 ? 0x80 : 0);
+	} while (value != 0);
+}
+
+// Reads a varint at `*at`, stopping at the end of the runs.
+static size_t read_varint(const LineInfo *lines, size_t *at) {
+	size_t value = 0;
+	for (unsigned shift = 0; *at < lines->length && shift < 64; shift += 7) {
+		uint8_t byte = lines->runs[(*at)++];
+		value |= (size_t)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) {
+			break;
 		}
-		size_t start = 0;
-		if (lines->count > 0) {
-			start = lines->lines[lines->count - 1].start + lines->lines[lines->count - 1].len;
+	}
+	return value;
+}
+
+// Encodes the last run, which a new one is about to follow.
+static void encode_run(LineInfo *lines) {
+	if (lines->run_count % LINE_CHECKPOINT_RUNS == 0) {
+		if (lines->checkpoint_capacity < lines->checkpoint_count + 1) {
+			size_t old_capacity = lines->checkpoint_capacity;
+			lines->checkpoint_capacity = GROW_CAPACITY(old_capacity);
+			lines->checkpoints = GROW_ARRAY(LineCheckpoint, lines->checkpoints, old_capacity,
+			                                lines->checkpoint_capacity);
 		}
-		lines->lines[lines->count] = (Line) {
-			.line = line,
-			.start = start,
-			.len = 0,
+		lines->checkpoints[lines->checkpoint_count++] = (LineCheckpoint) {
+			.offset = (uint32_t)lines->length,
+			.start = lines->start,
+			.base = lines->encoded,
 		};
-		lines->count++;
 	}
-	lines->lines[lines->count-1].len++;
+	write_varint(lines, lines->line - lines->encoded);
+	write_varint(lines, lines->end - lines->start);
+	lines->encoded = lines->line;
+	lines->run_count++;
+}
+
+void line_info_inc(LineInfo *lines, Linenr line) {
+	if (lines->end == 0) {
+		lines->line = line;
+	} else if (lines->line < line) {
+		encode_run(lines);
+		lines->line = line;
+		lines->start = lines->end;
+	}
+	lines->end++;
+}
+
+void line_info_copy(LineInfo *lines, const LineInfo *from) {
+	line_info_init(lines);
+	if (from->length > 0) {
+		lines->runs = GROW_ARRAY(uint8_t, NULL, 0, from->length);
+		memcpy(lines->runs, from->runs, from->length);
+		lines->capacity = from->length;
+	}
+	if (from->checkpoint_count > 0) {
+		lines->checkpoints = GROW_ARRAY(LineCheckpoint, NULL, 0, from->checkpoint_count);
+		memcpy(lines->checkpoints, from->checkpoints, sizeof(LineCheckpoint) * from->checkpoint_count);
+		lines->checkpoint_capacity = from->checkpoint_count;
+	}
+	lines->length = from->length;
+	lines->checkpoint_count = from->checkpoint_count;
+	lines->run_count = from->run_count;
+	lines->encoded = from->encoded;
+	lines->line = from->line;
+	lines->start = from->start;
+	lines->end = from->end;
 }
 
 void line_info_free(LineInfo *lines) {
-	FREE_ARRAY(Line, lines->lines, lines->capacity);
+	FREE_ARRAY(uint8_t, lines->runs, lines->capacity);
+	FREE_ARRAY(LineCheckpoint, lines->checkpoints, lines->checkpoint_capacity);
 	line_info_init(lines);
 }
 
-Linenr line_info_get (const LineInfo *lines, size_t offset) {
-	Linenr linenr = 0;
-	for (size_t i = 0; i < lines->count; i++) {
-		Line *line = &lines->lines[i];
-		linenr = line->line;
-		if (offset >= line->start && offset < line->start + line->len)  {
-			break;
+Linenr line_info_get(const LineInfo *lines, size_t offset) {
+	if (lines->checkpoint_count == 0 || offset >= lines->start) {
+		return lines->line;
+	}
+	// The last checkpoint at or before `offset`.
+	size_t low = 0;
+	size_t high = lines->checkpoint_count;
+	while (high - low > 1) {
+		size_t middle = low + (high - low) / 2;
+		if (lines->checkpoints[middle].start <= offset) {
+			low = middle;
+		} else {
+			high = middle;
+		}
+	}
+	const LineCheckpoint *checkpoint = &lines->checkpoints[low];
+	Linenr line = checkpoint->base;
+	size_t start = checkpoint->start;
+	size_t at = checkpoint->offset;
+	while (at < lines->length) {
+		line += read_varint(lines, &at);
+		start += read_varint(lines, &at);
+		if (offset < start) {
+			return line;
+		}
+	}
+	return lines->line;
+}
+
+void stack_maps_init(StackMaps *maps) {
+	maps->offsets = NULL;
+	maps->local_counts = NULL;
+	maps->live = NULL;
+	maps->words = 0;
+	maps->count = 0;
+	maps->capacity = 0;
+}
+
+void stack_maps_add(StackMaps *maps, uint32_t offset, uint32_t local_count) {
+	if (maps->capacity < maps->count + 1) {
+		size_t old_capacity = maps->capacity;
+		maps->capacity = GROW_CAPACITY(old_capacity);
+		maps->offsets = GROW_ARRAY(uint32_t, maps->offsets, old_capacity, maps->capacity);
+		maps->local_counts = GROW_ARRAY(uint32_t, maps->local_counts, old_capacity, maps->capacity);
+	}
+	maps->offsets[maps->count] = offset;
+	maps->local_counts[maps->count] = local_count;
+	maps->count++;
+}
+
+void stack_maps_free(StackMaps *maps) {
+	FREE_ARRAY(uint32_t, maps->offsets, maps->capacity);
+	FREE_ARRAY(uint32_t, maps->local_counts, maps->capacity);
+	if (maps->capacity > 0) {
+		FREE_ARRAY(uint64_t, maps->live, maps->count * maps->words);
+	}
+	stack_maps_init(maps);
+}
+
+const uint64_t *stack_maps_find(const StackMaps *maps, uint32_t offset, uint32_t *local_count) {
+	if (maps->live == NULL) {
+		return NULL;
+	}
+	size_t low = 0;
+	size_t high = maps->count;
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		if (maps->offsets[mid] < offset) {
+			low = mid + 1;
+		} else {
+			high = mid;
 		}
 	}
-	return linenr;
+	if (low == maps->count || maps->offsets[low] != offset) {
+		return NULL;
+	}
+	*local_count = maps->local_counts[low];
+	return &maps->live[low * maps->words];
 }
 
 void chunk_init(Chunk *chunk) {
@@ -55,6 +191,7 @@ void chunk_init(Chunk *chunk) {
 	chunk->code = NULL;
 	line_info_init(&chunk->lines);
 	value_array_init(&chunk->constants);
+	stack_maps_init(&chunk->stack_maps);
 }
 
 void chunk_write(Chunk *chunk, uint8_t byte, Linenr line) {
@@ -74,6 +211,7 @@ void chunk_free(Chunk *chunk) {
 	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
 	value_array_free(&chunk->constants);
 	line_info_free(&chunk->lines);
+	stack_maps_free(&chunk->stack_maps);
 	chunk_init(chunk);
 }
 
@@ -84,8 +222,95 @@ uint32_t chunk_add_constant(Chunk *chunk, Value value) {
 	return chunk->constants.count - 1;
 }
 
-uint32_t chunk_write_constant(Chunk *chunk, Value constant, Linenr line) {
-	uint32_t index = chunk_add_constant(chunk, constant);
+void constant_map_init(ConstantMap *map) {
+	map->slots = NULL;
+	map->count = 0;
+	map->capacity = 0;
+}
+
+void constant_map_free(ConstantMap *map) {
+	free(map->slots);
+	constant_map_init(map);
+}
+
+static uint64_t constant_bits(Value value) {
+#ifdef NAN_BOXING
+	return value;
+#else
+	uint64_t bits = 0;
+	switch (value.type) {
+	case VAL_BOOL:
+		bits = value.as.boolean;
+		break;
+	case VAL_NUMBER:
+		memcpy(&bits, &value.as.number, sizeof(double));
+		break;
+	case VAL_OBJ:
+		bits = (uint64_t)(uintptr_t)value.as.object;
+		break;
+	case VAL_NIL:
+		break;
+	}
+	return bits ^ (uint64_t)value.type << 60;
+#endif
+}
+
+static size_t constant_hash(uint64_t bits, size_t capacity) {
+	bits ^= bits >> 33;
+	bits *= 0xff51afd7ed558ccdull;
+	bits ^= bits >> 33;
+	return (size_t)bits & (capacity - 1);
+}
+
+static bool constants_identical(Value a, Value b) {
+#ifdef NAN_BOXING
+	return a == b;
+#else
+	return a.type == b.type && constant_bits(a) == constant_bits(b);
+#endif
+}
+
+static void constant_map_grow(ConstantMap *map, const ValueArray *constants) {
+	size_t capacity = map->capacity < 16 ? 16 : map->capacity * 2;
+	uint32_t *slots = (uint32_t *)calloc(capacity, sizeof(uint32_t));
+	if (slots == NULL) {
+		exit(1);
+	}
+	for (size_t i = 0; i < map->capacity; i++) {
+		uint32_t slot = map->slots[i];
+		if (slot == 0) {
+			continue;
+		}
+		size_t j = constant_hash(constant_bits(constants->values[slot - 1]), capacity);
+		while (slots[j] != 0) {
+			j = (j + 1) & (capacity - 1);
+		}
+		slots[j] = slot;
+	}
+	free(map->slots);
+	map->slots = slots;
+	map->capacity = capacity;
+}
+
+uint32_t chunk_add_unique_constant(Chunk *chunk, ConstantMap *map, Value value) {
+	if (map->count + 1 > map->capacity / 2) {
+		constant_map_grow(map, &chunk->constants);
+	}
+	size_t i = constant_hash(constant_bits(value), map->capacity);
+	for (; map->slots[i] != 0; i = (i + 1) & (map->capacity - 1)) {
+		if (constants_identical(chunk->constants.values[map->slots[i] - 1], value)) {
+			return map->slots[i] - 1;
+		}
+	}
+	uint32_t index = chunk_add_constant(chunk, value);
+	map->slots[i] = index + 1;
+	map->count++;
+	return index;
+}
+
+uint32_t chunk_write_constant(Chunk *chunk, ConstantMap *map, Value constant, Linenr line) {
+	uint32_t index = map != NULL ? chunk_add_unique_constant(chunk, map, constant)
+	                 : chunk_add_constant(chunk, constant);
 
 	if (index > UINT8_MAX) {
 		chunk_write(chunk, OP_CONSTANT_LONG, line);
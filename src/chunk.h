@@ -58,51 +58,116 @@ typedef enum {
 
 typedef size_t Linenr;
 
-// Represents a line of instructions in the source text,
-// for error reporting.
+// Which source line each byte of code came from, for error reporting and
+// disassembly. Code is written in runs of bytes from the same line, and a
+// run only starts when the line goes up, so lines never decrease.
+//
+// Every run but the last is encoded in `runs` as two varints: how many
+// lines it is past the run before it (the first, past line 0), and how many
+// bytes of code it covers. The last run extends to the end of the code and
+// is kept decoded. The first of every LINE_CHECKPOINT_RUNS runs has a
+// checkpoint, where decoding can start, so a lookup is a binary search over
+// the checkpoints and then at most that many runs.
+#define LINE_CHECKPOINT_RUNS 16
+
 typedef struct {
-  // The actual line number
-  Linenr line;
-  // The offset of the first instruction in the line
-  size_t start;
-  // The number of instructions in the line
-  size_t len;
-} Line;
+  // Offset of the run's encoding in `runs`.
+  uint32_t offset;
+  // Offset of the run's first byte of code.
+  uint32_t start;
+  // The line of the run before it, which its delta is from.
+  Linenr base;
+} LineCheckpoint;
 
 typedef struct {
-  // Info should always be added in sorted order, as this needs
-  // to be fast.
-  //
-  // Lookup can be slower, as it is only used for error reporting.
-  Line *lines;
-  // This is *not* the number of lines in the source text,
-  // but the number of lines that have at least one instruction.
-  // Not guaranteed to start with line 1.
-  size_t count;
+  uint8_t *runs;
+  size_t length;
   size_t capacity;
+  LineCheckpoint *checkpoints;
+  size_t checkpoint_count;
+  size_t checkpoint_capacity;
+  // Runs encoded so far.
+  size_t run_count;
+  // The line of the last encoded run.
+  Linenr encoded;
+  // The last run, and the end of the code so far. Not guaranteed to start
+  // with line 1; 0 until there's code.
+  Linenr line;
+  uint32_t start;
+  uint32_t end;
 } LineInfo;
 
 void line_info_init(LineInfo *lines);
 void line_info_inc(LineInfo *lines, Linenr line);
+// Copies `from` into `lines`, which is initialized first.
+void line_info_copy(LineInfo *lines, const LineInfo *from);
 void line_info_free(LineInfo *lines);
 Linenr line_info_get(const LineInfo *lines, size_t offset);
 
+// Which local slots a frame still needs at each safepoint, so the collector
+// doesn't keep values alive just because their slot hasn't been popped yet.
+//
+// Safepoints are recorded by the compiler as the end offset of instructions
+// that can allocate, and only cover initialized locals: the slots above
+// `local_counts[i]` hold temporaries, which are always live. The bitmaps are
+// filled in by `stack_maps_build` once the chunk is complete; until then, and
+// at any offset without a map, frames are scanned in full.
+typedef struct {
+  uint32_t *offsets;
+  uint32_t *local_counts;
+  // `words` words per safepoint.
+  uint64_t *live;
+  uint32_t words;
+  size_t count;
+  size_t capacity;
+} StackMaps;
+
+void stack_maps_init(StackMaps *maps);
+void stack_maps_add(StackMaps *maps, uint32_t offset, uint32_t local_count);
+void stack_maps_free(StackMaps *maps);
+// Returns the live bitmap for the safepoint ending at `offset`, or NULL.
+const uint64_t *stack_maps_find(const StackMaps *maps, uint32_t offset, uint32_t *local_count);
+
 // A bytecode chunk, containing a sequence of instructions,
 // debug information, and the chunk's constants.
+//
+// A chunk loaded from a bytecode file (see bytecode.h) has its code, lines
+// and stack maps in the file's mapping, with capacities of 0, and frees
+// none of them.
 typedef struct {
   size_t count;
   size_t capacity;
   uint8_t *code;
   ValueArray constants;
   LineInfo lines;
+  StackMaps stack_maps;
 } Chunk;
 
 void chunk_init(Chunk *chunk);
 void chunk_write(Chunk *chunk, uint8_t byte, Linenr line);
 void chunk_free(Chunk *chunk);
+// Runs liveness analysis over the finished chunk (see liveness.c).
+void stack_maps_build(Chunk *chunk);
+
+// The constants already in a chunk being compiled, so that each is added
+// once. Constants are the same if their bits are: strings are interned, so
+// equal strings are one object, while 0 and -0 stay apart. Slots hold an
+// index plus one, 0 for an empty slot, and the constant itself is read from
+// the chunk. Lives outside the heap.
+typedef struct {
+  uint32_t *slots;
+  size_t count;
+  size_t capacity;
+} ConstantMap;
+
+void constant_map_init(ConstantMap *map);
+void constant_map_free(ConstantMap *map);
 
 uint32_t chunk_add_constant(Chunk *chunk, Value value);
-uint32_t chunk_write_constant(Chunk *chunk, Value constant, Linenr line);
+// Returns the index `value` already has in the chunk, if it's in `map`, and
+// adds it otherwise.
+uint32_t chunk_add_unique_constant(Chunk *chunk, ConstantMap *map, Value value);
+uint32_t chunk_write_constant(Chunk *chunk, ConstantMap *map, Value constant, Linenr line);
 uint32_t chunk_last_instruction_len(Chunk *chunk);
 
 #endif
@@ -26,6 +26,10 @@
 #define ALLOW_SHADOWING
 #define NAN_BOXING
 
+// Interpreter state that would otherwise be global is kept per thread, so
+// that every thread can run an isolated VM with its own heap.
+#define THREAD_LOCAL _Thread_local
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 #define UINT32_COUNT (UINT32_MAX + 1)
 
@@ -6,6 +6,7 @@
 #include "common.h"
 #include "compiler.h"
 #include "object.h"
+#include "pipeline.h"
 #include "scanner.h"
 #include "chunk.h"
 
@@ -45,8 +46,11 @@ typedef struct  {
 } ParseRule;
 
 
-Parser parser;
-Compiler *current = NULL;
+THREAD_LOCAL Parser parser;
+THREAD_LOCAL Compiler *current = NULL;
+// Whether function bodies are skimmed, to be compiled when first called.
+THREAD_LOCAL bool skim_bodies = false;
+THREAD_LOCAL bool quiet_errors = false;
 
 static Chunk *current_chunk() {
 	return &current->function->chunk;
@@ -55,6 +59,8 @@ static Chunk *current_chunk() {
 static void error_at(Token *token, const char* message) {
 	if (parser.panic_mode) return;
 	parser.panic_mode = true;
+	parser.had_error = true;
+	if (quiet_errors) return;
 	fprintf(stderr, "[line %zu] Error", token->line);
 
 	switch(token->type) {
@@ -68,7 +74,6 @@ static void error_at(Token *token, const char* message) {
 		break;
 	}
 	fprintf(stderr, ": %s\n", message);
-	parser.had_error = true;
 }
 
 static void error_at_current(const char *message) {
@@ -178,6 +183,18 @@ static void emit_bytes(uint32_t byte1, uint32_t byte2) {
 	emit_byte(byte2);
 }
 
+// Records the end of an instruction that can allocate, so the collector can
+// look up which locals are still needed there (see StackMaps). Only
+// initialized locals are covered: a local being declared doesn't have its
+// slot yet, and whatever sits there belongs to its initializer.
+static void emit_safepoint() {
+	uint32_t locals = current->local_count;
+	while (locals > 0 && current->locals[locals - 1].depth == (uint32_t)-1) {
+		locals--;
+	}
+	stack_maps_add(&current_chunk()->stack_maps, current_chunk()->count, locals);
+}
+
 static void emit_loop(uint32_t loop_start) {
 	emit_byte(OP_LOOP);
 	uint32_t offset = current_chunk()->count - loop_start + 4;
@@ -220,7 +237,7 @@ static void emit_return() {
 }
 
 static uint32_t emit_constant(Value value) {
-	return chunk_write_constant(current_chunk(), value, prev_token().line);
+	return chunk_write_constant(current_chunk(), &current->constants, value, prev_token().line);
 }
 
 static void parser_init() {
@@ -232,14 +249,29 @@ static void parser_init() {
 	parser.panic_mode = false;
 }
 
-void compiler_init(Compiler *compiler, FunctionType type) {
+static void compiler_begin(Compiler *compiler, FunctionType type, Function *function) {
 	compiler->enclosing = current;
 	compiler->type = type;
 	compiler->scope_depth = 0;
-	compiler->function = function_new();
+	compiler->function = function;
 	compiler->local_count = 0;
+	compiler->has_yield = false;
+	compiler->has_await = false;
+	compiler->has_captures = false;
+	compiler->lazy = NULL;
+	constant_map_init(&compiler->constants);
 	current = compiler;
 
+	Local *local = &current->locals[current->local_count++];
+	local->depth = 0;
+	local->is_captured = false;
+	local->name.start = "";
+	local->name.length = 0;
+}
+
+void compiler_init(Compiler *compiler, FunctionType type) {
+	compiler_begin(compiler, type, function_new());
+
 	switch(type) {
 	case FN_TYPE_NAMED:
 		current->function->name = copy_string((char*)prev_token().start, prev_token().length);
@@ -249,17 +281,19 @@ void compiler_init(Compiler *compiler, FunctionType type) {
 	case FN_TYPE_SCRIPT:
 		break;
 	}
-
-	Local *local = &current->locals[current->local_count++];
-	local->depth = 0;
-	local->is_captured = false;
-	local->name.start = "";
-	local->name.length = 0;
 }
 
 Function *end_compilation() {
 	emit_return();
 	Function *function = current->function;
+	if (!parser.had_error) {
+		stack_maps_build(&function->chunk);
+	}
+	// A body that yields itself, never awaits, and doesn't let closures
+	// capture its locals can be suspended by copying its slots out, so
+	// coroutines over it don't need their own stack.
+	function->stackless = current->type != FN_TYPE_SCRIPT && current->has_yield
+	                      && !current->has_await && !current->has_captures;
 
 	#ifdef DEBUG_PRINT_CODE
 	if (!parser.had_error) {
@@ -275,6 +309,7 @@ Function *end_compilation() {
 	}
 	#endif
 
+	constant_map_free(&current->constants);
 	current = current->enclosing;
 
 	return function;
@@ -375,19 +410,8 @@ static void synchronize() {
 }
 
 static uint32_t identifier_constant(Token *name) {
-	Chunk *chunk = current_chunk();
 	String *ident = ref_string((char*)name->start, name->length);
-
-	// slower at compile time, but saves memory by deduplicating constant idents
-	for (uint32_t i = 0; i < chunk->constants.count; i++) {
-		Value value = chunk->constants.values[i];
-		if (IS_STRING(value) && AS_STRING(value)->hash == ident->hash) {
-			// There is a string with the same hash, so we can
-			// just return its index.
-			return i;
-		}
-	}
-	return chunk_add_constant(current_chunk(), OBJ_VAL(ident));
+	return chunk_add_unique_constant(current_chunk(), &current->constants, OBJ_VAL(ident));
 }
 
 static void add_local(Token name) {
@@ -469,13 +493,18 @@ static void var_declaration() {
 	define_variable();
 }
 
-static void function(FunctionType type) {
-	Compiler compiler;
-	Local locals[UINT8_COUNT];
-	compiler_init(&compiler, type);
-	begin_scope();
+typedef struct {
+	bool success;
+	uint32_t index;
+} Resolve;
 
-	// Compile the parameter list.
+#define RESOLVE_ERROR (Resolve){ .success = false, .index = 0 }
+#define RESOLVE_SUCCESS(idx) (Resolve){ .success = true, .index = idx }
+
+static Resolve resolve_local(Compiler *compiler, Token *name);
+static Resolve resolve_upvalue(Compiler *compiler, Token *name);
+
+static void parameters() {
 	consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
 	if (!check(TOKEN_RIGHT_PAREN)) {
 		do {
@@ -490,10 +519,81 @@ static void function(FunctionType type) {
 	consume(TOKEN_RIGHT_PAREN, "Expect ')' after function parameters.");
 
 	consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-	block();
+}
 
-	Function *function = end_compilation();
-	uint32_t index = chunk_add_constant(current_chunk(), OBJ_VAL(function));
+// Skips to the end of the body by matching braces, and resolves every name
+// in it that isn't a parameter as an upvalue, the way the body would if it
+// didn't declare a local by that name first. The closure may then capture
+// a variable it never uses, which only keeps it alive for longer.
+static Function *skim_body(Token *start) {
+	size_t body = parser.current;
+	uint32_t depth = 1;
+	while (depth > 0) {
+		if (current_token_type() == TOKEN_EOF) {
+			error_at_current("Expect '}' after block.");
+			break;
+		}
+		advance();
+		Token *token = ref_prev_token();
+		switch (token->type) {
+		case TOKEN_LEFT_BRACE:
+			depth++;
+			break;
+		case TOKEN_RIGHT_BRACE:
+			depth--;
+			break;
+		case TOKEN_IDENTIFIER:
+			if (parser.tokens[parser.current - 2].type != TOKEN_DOT
+			    && !resolve_local(current, token).success) {
+				resolve_upvalue(current, token);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	Function *function = current->function;
+	LazyBody *lazy = ALLOCATE(LazyBody, 1);
+	lazy->start = start->start;
+	lazy->line = start->line;
+	lazy->upvalues = ALLOCATE(Token, function->upvalue_count);
+	for (uint32_t i = 0; i < function->upvalue_count; i++) {
+		lazy->upvalues[i] = current->upvalues[i].name;
+	}
+	lazy->job = NULL;
+	function->lazy = lazy;
+	constant_map_free(&current->constants);
+	current = current->enclosing;
+
+	// Nothing looks back past the closing brace, so drop the tokens before
+	// it rather than keep every token of the script.
+	if (depth == 0) {
+		size_t dropped = parser.current - 1 - body;
+		memmove(&parser.tokens[body], &parser.tokens[parser.current - 1],
+		        sizeof(Token) * (parser.count - parser.current + 1));
+		parser.current -= dropped;
+		parser.count -= dropped;
+	}
+	return function;
+}
+
+static void function(FunctionType type) {
+	Compiler compiler;
+	Local locals[UINT8_COUNT];
+	compiler_init(&compiler, type);
+	begin_scope();
+
+	Token start = current_token();
+	parameters();
+	Function *function;
+	if (skim_bodies) {
+		function = skim_body(&start);
+	} else {
+		block();
+		function = end_compilation();
+	}
+	uint32_t index = chunk_add_unique_constant(current_chunk(), &current->constants, OBJ_VAL(function));
 	if (index > UINT8_MAX) {
 		emit_bytes(OP_CLOSURE_LONG, index & 0xff);
 		emit_bytes( (index >> 8) & 0xff, (index >> 16) & 0xff);
@@ -543,16 +643,16 @@ static void block() {
 	consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-uint32_t current_continue_jump = 0;
-uint32_t current_break_jump = 0;
+THREAD_LOCAL uint32_t current_continue_jump = 0;
+THREAD_LOCAL uint32_t current_break_jump = 0;
 
 typedef struct {
 	uint32_t depth;
 	size_t ip;
 } Break;
 
-Break breaks[UINT8_COUNT];
-size_t break_count = 0;
+THREAD_LOCAL Break breaks[UINT8_COUNT];
+THREAD_LOCAL size_t break_count = 0;
 
 static void push_break(uint32_t depth, size_t ip) {
 	if (current->local_count == UINT8_COUNT) {
@@ -721,6 +821,7 @@ static void or_(bool can_assign) {
 }
 
 static void yield_statement() {
+	current->has_yield = true;
 	if (match(TOKEN_SEMICOLON)) {
 		emit_byte(OP_NIL);
 		emit_byte(OP_YIELD);
@@ -729,6 +830,7 @@ static void yield_statement() {
 		consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
 		emit_byte(OP_YIELD);
 	}
+	emit_safepoint();
 }
 
 static void statement() {
@@ -807,7 +909,7 @@ static bool identifiers_equal(Token *a, Token *b) {
 	return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static uint8_t add_upvalue(Compiler *compiler, uint32_t index, bool is_local) {
+static uint8_t add_upvalue(Compiler *compiler, uint32_t index, bool is_local, Token *name) {
 	uint32_t upvalue_count = compiler->function->upvalue_count;
 
 	for (uint8_t i = 0; i < upvalue_count; i++) {
@@ -825,17 +927,10 @@ static uint8_t add_upvalue(Compiler *compiler, uint32_t index, bool is_local) {
 
 	compiler->upvalues[upvalue_count].is_local = is_local;
 	compiler->upvalues[upvalue_count].index = index;
+	compiler->upvalues[upvalue_count].name = *name;
 	return compiler->function->upvalue_count++;
 }
 
-typedef struct {
-	bool success;
-	uint32_t index;
-} Resolve;
-
-#define RESOLVE_ERROR (Resolve){ .success = false, .index = 0 }
-#define RESOLVE_SUCCESS(idx) (Resolve){ .success = true, .index = idx }
-
 static Resolve resolve_local(Compiler *compiler, Token *name) {
 	for (int32_t i = compiler->local_count - 1; i >= 0; i--) {
 		Local *local = &compiler->locals[i];
@@ -854,18 +949,27 @@ static Resolve resolve_local(Compiler *compiler, Token *name) {
 }
 
 static Resolve resolve_upvalue(Compiler *compiler, Token *name) {
-	if (compiler->enclosing == NULL) return RESOLVE_ERROR;
+	if (compiler->enclosing == NULL) {
+		if (compiler->lazy == NULL) return RESOLVE_ERROR;
+		for (uint32_t i = 0; i < compiler->function->upvalue_count; i++) {
+			if (identifiers_equal(name, &compiler->lazy->upvalues[i])) {
+				return RESOLVE_SUCCESS(i);
+			}
+		}
+		return RESOLVE_ERROR;
+	}
 
 	Resolve local = resolve_local(compiler->enclosing, name);
 	if (local.success) {
 		compiler->enclosing->locals[local.index].is_captured = true;
-		local.index = add_upvalue(compiler, local.index, true);
+		compiler->enclosing->has_captures = true;
+		local.index = add_upvalue(compiler, local.index, true, name);
 		return local;
 	}
 
 	Resolve upvalue = resolve_upvalue(compiler->enclosing, name);
 	if (upvalue.success) {
-		upvalue.index = add_upvalue(compiler, upvalue.index, false);
+		upvalue.index = add_upvalue(compiler, upvalue.index, false, name);
 		return upvalue;
 	}
 
@@ -935,6 +1039,7 @@ static uint8_t argument_list() {
 static void call(bool can_assign) {
 	uint8_t arg_count = argument_list();
 	emit_bytes(OP_CALL, arg_count);
+	emit_safepoint();
 }
 
 static uint32_t array_list() {
@@ -953,7 +1058,9 @@ static uint32_t array_list() {
 static void list(bool can_assign) {
 	uint32_t arg_count = array_list();
 	if (arg_count <= UINT8_MAX) {
-		return emit_bytes(OP_LIST, arg_count);
+		emit_bytes(OP_LIST, arg_count);
+		emit_safepoint();
+		return;
 	}
 
 	if (arg_count > (UINT32_MAX >> 8)) {
@@ -961,6 +1068,7 @@ static void list(bool can_assign) {
 	}
 	emit_bytes(OP_LIST_LONG, arg_count);
 	emit_bytes(arg_count >> 8, arg_count >> 16);
+	emit_safepoint();
 }
 
 static uint32_t dict_entry_list() {
@@ -987,7 +1095,9 @@ static uint32_t dict_entry_list() {
 static void dict(bool can_assign) {
 	uint32_t arg_count = dict_entry_list();
 	if (arg_count <= UINT8_MAX) {
-		return emit_bytes(OP_DICT, arg_count);
+		emit_bytes(OP_DICT, arg_count);
+		emit_safepoint();
+		return;
 	}
 
 	if (arg_count > (UINT32_MAX >> 8)) {
@@ -995,6 +1105,7 @@ static void dict(bool can_assign) {
 	}
 	emit_bytes(OP_DICT_LONG, arg_count);
 	emit_bytes(arg_count >> 8, arg_count >> 16);
+	emit_safepoint();
 }
 
 static void dot(bool can_assign) {
@@ -1013,6 +1124,7 @@ static void dot(bool can_assign) {
 	if (can_assign && match(TOKEN_EQUAL)) {
 		expression();
 		emit_byte(OP_SET_FIELD);
+		emit_safepoint();
 	} else {
 		emit_byte(OP_GET_FIELD);
 	}
@@ -1021,11 +1133,14 @@ static void dot(bool can_assign) {
 static void coroutine(bool can_assign) {
 	expression();
 	emit_byte(OP_COROUTINE);
+	emit_safepoint();
 }
 
 static void await(bool can_assign) {
+	current->has_await = true;
 	expression();
 	emit_byte(OP_AWAIT);
+	emit_safepoint();
 }
 
 static void index_(bool can_assign) {
@@ -1035,6 +1150,7 @@ static void index_(bool can_assign) {
 	if (can_assign && match(TOKEN_EQUAL)) {
 		expression();
 		emit_byte(OP_SET_FIELD);
+		emit_safepoint();
 	} else {
 		emit_byte(OP_GET_FIELD);
 	}
@@ -1117,7 +1233,7 @@ static void binary(bool can_assign) {
 	case TOKEN_GREATER_EQUAL: emit_bytes(OP_LESS, OP_NOT); break;
 	case TOKEN_LESS: emit_byte(OP_LESS); break;
 	case TOKEN_LESS_EQUAL: emit_bytes(OP_GREATER, OP_NOT); break;
-	case TOKEN_PLUS: emit_byte(OP_ADD); break;
+	case TOKEN_PLUS: emit_byte(OP_ADD); emit_safepoint(); break;
 	case TOKEN_MINUS: emit_byte(OP_SUBTRACT); break;
 	case TOKEN_STAR: emit_byte(OP_MULTIPLY); break;
 	case TOKEN_SLASH: emit_byte(OP_DIVIDE); break;
@@ -1133,6 +1249,60 @@ void compiler_mark_roots() {
 	}
 }
 
+void compiler_forward_roots() {
+	for (Compiler *compiler = current; compiler != NULL; compiler = compiler->enclosing) {
+		compiler->function = (Function *)gc_forward((Object *)compiler->function);
+	}
+}
+
+Function *compile_lazy(char *src) {
+	skim_bodies = true;
+	Function *function = compile(src);
+	skim_bodies = false;
+	return function;
+}
+
+bool compile_body(Function *function) {
+	LazyBody *lazy = function->lazy;
+	if (lazy == NULL || (lazy->job != NULL && pipeline_install(function))) {
+		return true;
+	}
+	scanner_resume(lazy->start, lazy->line);
+	parser_init();
+	skim_bodies = true;
+
+	// The function is already there, with the upvalues its closures have.
+	Compiler compiler;
+	compiler_begin(&compiler, FN_TYPE_NAMED, function);
+	compiler.lazy = lazy;
+	begin_scope();
+	function->arity = 0;
+	parameters();
+	block();
+	end_compilation();
+
+	skim_bodies = false;
+	FREE_ARRAY(Token, parser.tokens, parser.capacity);
+	parser.tokens = NULL;
+	if (parser.had_error) {
+		chunk_free(&function->chunk);
+		chunk_init(&function->chunk);
+		return false;
+	}
+	compile_body_free(function);
+	return true;
+}
+
+void compile_body_free(Function *function) {
+	LazyBody *lazy = function->lazy;
+	if (lazy == NULL) {
+		return;
+	}
+	FREE_ARRAY(Token, lazy->upvalues, function->upvalue_count);
+	FREE(LazyBody, lazy);
+	function->lazy = NULL;
+}
+
 Function* compile(char *src) {
 	scanner_init(src);
 
@@ -14,8 +14,25 @@ typedef struct {
 typedef struct {
   uint32_t index;
   bool is_local;
+  // The name it was first resolved by, for bodies compiled lazily.
+  Token name;
 } UpvalueMeta;
 
+// The body of a function that hasn't been compiled yet (see compile_lazy).
+// Its upvalues were resolved when it was skimmed, so the closures over it
+// could be made, and are found by name when it's compiled.
+typedef struct LazyBody {
+  // The '(' starting the parameter list, in a source that outlives the
+  // function.
+  char *start;
+  Linenr line;
+  // function->upvalue_count names, by index.
+  Token *upvalues;
+  // Set while the body is queued to be compiled in the background (see
+  // pipeline.h).
+  struct PipelineJob *job;
+} LazyBody;
+
 typedef enum {
   FN_TYPE_NAMED,
   FN_TYPE_ANONYMOUS,
@@ -35,14 +52,41 @@ typedef struct Compiler {
   uint32_t upvalue_count;
 
   uint32_t scope_depth;
+
+  // The function's constants, to add each once.
+  ConstantMap constants;
+
+  // What the body does, to decide whether it can run as a stackless
+  // generator (see end_compilation).
+  bool has_yield;
+  bool has_await;
+  bool has_captures;
+
+  // The upvalues of a body compiled lazily, which has no enclosing compiler
+  // left to resolve them in.
+  LazyBody *lazy;
 } Compiler;
 
 Function *compile(char *source);
+// Like compile, but only skims the bodies of functions, which are compiled
+// the first time they're called (see compile_body). Startup then costs
+// scanning the source and compiling the top level. `source` must outlive
+// every function from it, and errors in a body are reported when it's
+// compiled instead.
+Function *compile_lazy(char *source);
+// Compiles the body of `function` if it hasn't been yet. Returns false
+// after reporting a compile error in it.
+bool compile_body(Function *function);
+// Whether compile errors only make compiling fail, without being printed,
+// on this thread.
+extern THREAD_LOCAL bool quiet_errors;
+void compile_body_free(Function *function);
 void compile_line(char *source);
 void compiler_init(Compiler *compiler, FunctionType type);
 void scanner_init(char *source);
 Function *end_compilation();
 void compiler_mark_roots();
+void compiler_forward_roots();
 void declaration();
 void emit_byte(uint8_t byte);
 
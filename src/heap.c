@@ -0,0 +1,752 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <malloc.h>
+#else
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "heap.h"
+
+// Granularity of large mappings.
+#define OS_PAGE_SIZE 4096
+
+#define ROUND_UP(n, align) (((n) + (align) - 1) & ~((size_t)(align) - 1))
+
+// 16 byte steps up to 128, then four classes per doubling.
+static const uint32_t class_sizes[HEAP_SIZE_CLASSES] = {
+	16,   32,   48,   64,   80,   96,   112,  128,
+	160,  192,  224,  256,  320,  384,  448,  512,
+	640,  768,  896,  1024, 1280, 1536, 1792, 2048,
+	2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192,
+};
+
+size_t heap_size_class(size_t size) {
+	if (size <= 128) {
+		return size == 0 ? 0 : (size - 1) >> 4;
+	}
+	size_t s = size - 1;
+	size_t bit = 63 - __builtin_clzll(s);
+	return 8 + (bit - 7) * 4 + ((s >> (bit - 2)) & 3);
+}
+
+size_t heap_class_size(size_t size_class) {
+	return class_sizes[size_class];
+}
+
+static void *os_map(size_t size) {
+#ifdef WIN32
+	void *ptr = _aligned_malloc(size, OS_PAGE_SIZE);
+#else
+	void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED) {
+		ptr = NULL;
+	}
+#endif
+	if (ptr == NULL) {
+		exit(1);
+	}
+	return ptr;
+}
+
+static void os_unmap(void *ptr, size_t size) {
+#ifdef WIN32
+	_aligned_free(ptr);
+#else
+	munmap(ptr, size);
+#endif
+}
+
+// Maps a page aligned to its own size by over-allocating and trimming.
+static void *os_map_aligned(size_t size) {
+#ifdef WIN32
+	void *ptr = _aligned_malloc(size, size);
+	if (ptr == NULL) {
+		exit(1);
+	}
+	return ptr;
+#else
+	char *ptr = (char *)os_map(size * 2);
+	char *aligned = (char *)ROUND_UP((uintptr_t)ptr, size);
+	if (aligned > ptr) {
+		munmap(ptr, aligned - ptr);
+	}
+	munmap(aligned + size, ptr + size - aligned);
+	return aligned;
+#endif
+}
+
+#ifndef WIN32
+// A mapping to give back to the OS, or a small slot a sweep freed.
+typedef struct {
+	void *ptr;
+	size_t size;
+	bool mapping;
+} Release;
+
+struct HeapReclaimer {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	// Signalled when work is queued or the thread should stop.
+	pthread_cond_t work;
+	Release queue[HEAP_RECLAIM_QUEUE];
+	size_t count;
+	size_t pending_bytes;
+	bool stop;
+	// Collected by the heap's own thread without locking, and queued a batch
+	// at a time.
+	Release staged[HEAP_RECLAIM_BATCH];
+	size_t staged_count;
+	size_t staged_bytes;
+	// Slots the thread has linked up, per size class, for the allocator to
+	// take all at once when its own free list runs out (see alloc_small).
+	// Only ever pushed onto as a whole chain, and taken as a whole.
+	_Atomic(HeapSlot *) returned[HEAP_SIZE_CLASSES];
+};
+
+static void *reclaimer_main(void *arg) {
+	HeapReclaimer *reclaimer = (HeapReclaimer *)arg;
+	Release batch[HEAP_RECLAIM_QUEUE];
+
+	pthread_mutex_lock(&reclaimer->lock);
+	for (;;) {
+		while (reclaimer->count == 0 && !reclaimer->stop) {
+			pthread_cond_wait(&reclaimer->work, &reclaimer->lock);
+		}
+		if (reclaimer->count == 0) {
+			break;
+		}
+
+		// Take the whole queue so the sweeping thread never waits on munmap.
+		size_t count = reclaimer->count;
+		memcpy(batch, reclaimer->queue, sizeof(Release) * count);
+		reclaimer->count = 0;
+		pthread_mutex_unlock(&reclaimer->lock);
+
+		// Linking a slot writes to it, which is a cache miss per slot that
+		// the sweep no longer takes.
+		HeapSlot *heads[HEAP_SIZE_CLASSES] = { NULL };
+		HeapSlot *tails[HEAP_SIZE_CLASSES];
+		size_t bytes = 0;
+		for (size_t i = 0; i < count; i++) {
+			bytes += batch[i].size;
+			if (batch[i].mapping) {
+				munmap(batch[i].ptr, batch[i].size);
+				continue;
+			}
+			size_t index = heap_size_class(batch[i].size);
+			HeapSlot *slot = (HeapSlot *)batch[i].ptr;
+			slot->next = heads[index];
+			if (heads[index] == NULL) {
+				tails[index] = slot;
+			}
+			heads[index] = slot;
+		}
+		for (size_t i = 0; i < HEAP_SIZE_CLASSES; i++) {
+			if (heads[i] == NULL) {
+				continue;
+			}
+			HeapSlot *returned = atomic_load(&reclaimer->returned[i]);
+			do {
+				tails[i]->next = returned;
+			} while (!atomic_compare_exchange_weak(&reclaimer->returned[i], &returned, heads[i]));
+		}
+
+		pthread_mutex_lock(&reclaimer->lock);
+		reclaimer->pending_bytes -= bytes;
+	}
+	pthread_mutex_unlock(&reclaimer->lock);
+	return NULL;
+}
+
+static void release_now(Heap *heap, Release release) {
+	if (release.mapping) {
+		os_unmap(release.ptr, release.size);
+		return;
+	}
+	SizeClass *class = &heap->classes[heap_size_class(release.size)];
+	HeapSlot *slot = (HeapSlot *)release.ptr;
+	slot->next = class->free;
+	class->free = slot;
+}
+
+// Queues the staged releases for the reclaimer, or releases them right away
+// if the queue is full or too many bytes are already in flight.
+static void hand_over(Heap *heap) {
+	HeapReclaimer *reclaimer = heap->reclaimer;
+	if (reclaimer->staged_count == 0) {
+		return;
+	}
+	pthread_mutex_lock(&reclaimer->lock);
+	bool queued = reclaimer->count + reclaimer->staged_count <= HEAP_RECLAIM_QUEUE
+	              && reclaimer->pending_bytes + reclaimer->staged_bytes <= HEAP_RECLAIM_MAX_BYTES;
+	if (queued) {
+		memcpy(reclaimer->queue + reclaimer->count, reclaimer->staged,
+		       sizeof(Release) * reclaimer->staged_count);
+		reclaimer->count += reclaimer->staged_count;
+		reclaimer->pending_bytes += reclaimer->staged_bytes;
+		// Waking the thread costs a syscall, so wait for more unless it's
+		// worth it on its own. `heap_sweep` flushes whatever is left.
+		if (reclaimer->count >= HEAP_RECLAIM_QUEUE / 2
+		    || reclaimer->pending_bytes >= HEAP_RECLAIM_MAX_BYTES / 2) {
+			pthread_cond_signal(&reclaimer->work);
+		}
+	}
+	pthread_mutex_unlock(&reclaimer->lock);
+	if (!queued) {
+		for (size_t i = 0; i < reclaimer->staged_count; i++) {
+			release_now(heap, reclaimer->staged[i]);
+		}
+	}
+	reclaimer->staged_count = 0;
+	reclaimer->staged_bytes = 0;
+}
+
+// Stages a mapping or a slot for the reclaimer.
+static void reclaim(Heap *heap, void *ptr, size_t size, bool mapping) {
+	HeapReclaimer *reclaimer = heap->reclaimer;
+	if (reclaimer->staged_count == HEAP_RECLAIM_BATCH
+	    || reclaimer->staged_bytes + size > HEAP_RECLAIM_MAX_BYTES / 4) {
+		hand_over(heap);
+	}
+	reclaimer->staged[reclaimer->staged_count++] = (Release){ ptr, size, mapping };
+	reclaimer->staged_bytes += size;
+}
+#endif
+
+static void reclaim_flush(Heap *heap) {
+#ifndef WIN32
+	HeapReclaimer *reclaimer = heap->reclaimer;
+	if (reclaimer == NULL) {
+		return;
+	}
+	hand_over(heap);
+	pthread_mutex_lock(&reclaimer->lock);
+	if (reclaimer->count > 0) {
+		pthread_cond_signal(&reclaimer->work);
+	}
+	pthread_mutex_unlock(&reclaimer->lock);
+#endif
+}
+
+bool heap_start_reclaimer(Heap *heap) {
+#ifdef WIN32
+	return false;
+#else
+	if (heap->reclaimer != NULL) {
+		return true;
+	}
+	HeapReclaimer *reclaimer = (HeapReclaimer *)calloc(1, sizeof(HeapReclaimer));
+	if (reclaimer == NULL) {
+		return false;
+	}
+	pthread_mutex_init(&reclaimer->lock, NULL);
+	pthread_cond_init(&reclaimer->work, NULL);
+	if (pthread_create(&reclaimer->thread, NULL, reclaimer_main, reclaimer) != 0) {
+		pthread_cond_destroy(&reclaimer->work);
+		pthread_mutex_destroy(&reclaimer->lock);
+		free(reclaimer);
+		return false;
+	}
+	heap->reclaimer = reclaimer;
+	return true;
+#endif
+}
+
+void heap_stop_reclaimer(Heap *heap) {
+#ifndef WIN32
+	HeapReclaimer *reclaimer = heap->reclaimer;
+	if (reclaimer == NULL) {
+		return;
+	}
+	hand_over(heap);
+	pthread_mutex_lock(&reclaimer->lock);
+	reclaimer->stop = true;
+	pthread_cond_signal(&reclaimer->work);
+	pthread_mutex_unlock(&reclaimer->lock);
+	pthread_join(reclaimer->thread, NULL);
+
+	for (size_t i = 0; i < HEAP_SIZE_CLASSES; i++) {
+		HeapSlot *returned = atomic_load(&reclaimer->returned[i]);
+		while (returned != NULL) {
+			HeapSlot *next = returned->next;
+			returned->next = heap->classes[i].free;
+			heap->classes[i].free = returned;
+			returned = next;
+		}
+	}
+
+	pthread_cond_destroy(&reclaimer->work);
+	pthread_mutex_destroy(&reclaimer->lock);
+	free(reclaimer);
+	heap->reclaimer = NULL;
+#endif
+}
+
+size_t heap_reclaim_pending(Heap *heap) {
+#ifdef WIN32
+	return 0;
+#else
+	HeapReclaimer *reclaimer = heap->reclaimer;
+	if (reclaimer == NULL) {
+		return 0;
+	}
+	pthread_mutex_lock(&reclaimer->lock);
+	size_t pending = reclaimer->pending_bytes;
+	pthread_mutex_unlock(&reclaimer->lock);
+	return pending;
+#endif
+}
+
+// Gives memory back to the OS, on the reclaimer thread if there is one.
+static void heap_unmap(Heap *heap, void *ptr, size_t size) {
+	heap->mapped_bytes -= size;
+#ifndef WIN32
+	if (heap->reclaimer != NULL) {
+		reclaim(heap, ptr, size, true);
+		return;
+	}
+#endif
+	os_unmap(ptr, size);
+}
+
+void heap_init(Heap *heap) {
+	for (size_t i = 0; i < HEAP_SIZE_CLASSES; i++) {
+		heap->classes[i].free = NULL;
+		heap->classes[i].bump = NULL;
+		heap->classes[i].limit = NULL;
+	}
+	heap->pages = NULL;
+	heap->page_count = 0;
+	heap->page_capacity = 0;
+	heap->object_pages = NULL;
+	heap->object_page_count = 0;
+	heap->object_page_capacity = 0;
+	for (size_t i = 0; i < HEAP_SIZE_CLASSES; i++) {
+		heap->object_free[i] = NULL;
+	}
+	heap->mapped_bytes = 0;
+	heap->large_count = 0;
+	heap->reclaimer = NULL;
+	heap->sweeping = false;
+}
+
+void heap_free(Heap *heap) {
+	heap_stop_reclaimer(heap);
+	for (size_t i = 0; i < heap->page_count; i++) {
+		os_unmap(heap->pages[i], HEAP_PAGE_SIZE);
+	}
+	free(heap->pages);
+	heap->mapped_bytes -= heap->page_count * HEAP_PAGE_SIZE;
+	for (size_t i = 0; i < heap->object_page_count; i++) {
+		os_unmap(heap->object_pages[i]->base, HEAP_PAGE_SIZE);
+		free(heap->object_pages[i]);
+	}
+	free(heap->object_pages);
+	heap->mapped_bytes -= heap->object_page_count * HEAP_PAGE_SIZE;
+	heap_init(heap);
+}
+
+static void add_page(Heap *heap, SizeClass *class) {
+	if (heap->page_capacity < heap->page_count + 1) {
+		heap->page_capacity = heap->page_capacity < 8 ? 8 : heap->page_capacity * 2;
+		heap->pages = (char **)realloc(heap->pages, sizeof(char *) * heap->page_capacity);
+		if (heap->pages == NULL) {
+			exit(1);
+		}
+	}
+
+	char *page = (char *)os_map(HEAP_PAGE_SIZE);
+	heap->pages[heap->page_count++] = page;
+	heap->mapped_bytes += HEAP_PAGE_SIZE;
+
+	class->bump = page;
+	class->limit = page + HEAP_PAGE_SIZE;
+}
+
+static void *alloc_small(Heap *heap, size_t size) {
+	size_t index = heap_size_class(size);
+	SizeClass *class = &heap->classes[index];
+
+	HeapSlot *slot = class->free;
+#ifndef WIN32
+	if (slot == NULL && heap->reclaimer != NULL
+	    && atomic_load_explicit(&heap->reclaimer->returned[index], memory_order_relaxed) != NULL) {
+		slot = atomic_exchange(&heap->reclaimer->returned[index], NULL);
+	}
+#endif
+	if (slot != NULL) {
+		class->free = slot->next;
+		return slot;
+	}
+
+	size_t slot_size = class_sizes[index];
+	if (class->bump == NULL || class->bump + slot_size > class->limit) {
+		add_page(heap, class);
+	}
+	void *ptr = class->bump;
+	class->bump += slot_size;
+	return ptr;
+}
+
+static void release_small(Heap *heap, void *ptr, size_t size) {
+#ifndef WIN32
+	// What a sweep frees is linked back on the reclaimer thread.
+	if (heap->sweeping && heap->reclaimer != NULL) {
+		reclaim(heap, ptr, size, false);
+		return;
+	}
+#endif
+	SizeClass *class = &heap->classes[heap_size_class(size)];
+	HeapSlot *slot = (HeapSlot *)ptr;
+	slot->next = class->free;
+	class->free = slot;
+}
+
+static void *alloc_large(Heap *heap, size_t size) {
+	size_t mapped = ROUND_UP(size, OS_PAGE_SIZE);
+	heap->mapped_bytes += mapped;
+	heap->large_count++;
+	return os_map(mapped);
+}
+
+static void release_large(Heap *heap, void *ptr, size_t size) {
+	heap->large_count--;
+	heap_unmap(heap, ptr, ROUND_UP(size, OS_PAGE_SIZE));
+}
+
+void *heap_alloc(Heap *heap, size_t size) {
+	if (size == 0) {
+		return NULL;
+	}
+	if (size > HEAP_SMALL_MAX) {
+		return alloc_large(heap, size);
+	}
+	return alloc_small(heap, size);
+}
+
+void heap_release(Heap *heap, void *ptr, size_t size) {
+	if (ptr == NULL || size == 0) {
+		return;
+	}
+	if (size > HEAP_SMALL_MAX) {
+		release_large(heap, ptr, size);
+	} else {
+		release_small(heap, ptr, size);
+	}
+}
+
+void *heap_realloc(Heap *heap, void *ptr, size_t old_size, size_t new_size) {
+	if (ptr == NULL || old_size == 0) {
+		return heap_alloc(heap, new_size);
+	}
+	if (new_size == 0) {
+		heap_release(heap, ptr, old_size);
+		return NULL;
+	}
+
+	if (old_size <= HEAP_SMALL_MAX && new_size <= HEAP_SMALL_MAX) {
+		// Still fits in the slot it already has.
+		if (heap_size_class(old_size) == heap_size_class(new_size)) {
+			return ptr;
+		}
+	} else if (old_size > HEAP_SMALL_MAX && new_size > HEAP_SMALL_MAX) {
+		size_t old_mapped = ROUND_UP(old_size, OS_PAGE_SIZE);
+		size_t new_mapped = ROUND_UP(new_size, OS_PAGE_SIZE);
+		if (old_mapped == new_mapped) {
+			return ptr;
+		}
+#ifdef __linux__
+		// Let the kernel move the page table entries instead of copying.
+		void *moved = mremap(ptr, old_mapped, new_mapped, MREMAP_MAYMOVE);
+		if (moved == MAP_FAILED) {
+			exit(1);
+		}
+		heap->mapped_bytes += new_mapped - old_mapped;
+		return moved;
+#endif
+	}
+
+	void *rv = heap_alloc(heap, new_size);
+	memcpy(rv, ptr, old_size < new_size ? old_size : new_size);
+	heap_release(heap, ptr, old_size);
+	return rv;
+}
+
+static HeapPage *add_object_page(Heap *heap, size_t size_class) {
+	if (heap->object_page_capacity < heap->object_page_count + 1) {
+		heap->object_page_capacity = heap->object_page_capacity < 8 ? 8 : heap->object_page_capacity * 2;
+		heap->object_pages = (HeapPage **)realloc(heap->object_pages,
+		                                          sizeof(HeapPage *) * heap->object_page_capacity);
+		if (heap->object_pages == NULL) {
+			exit(1);
+		}
+	}
+
+	HeapPage *page = (HeapPage *)calloc(1, sizeof(HeapPage));
+	if (page == NULL) {
+		exit(1);
+	}
+	page->base = (char *)os_map_aligned(HEAP_PAGE_SIZE);
+	*(HeapPage **)page->base = page;
+	page->slot_size = class_sizes[size_class];
+	page->slot_count = (HEAP_PAGE_SIZE - HEAP_PAGE_HEADER) / page->slot_size;
+	page->slot_reciprocal = (uint32_t)((((uint64_t)1 << 32) + page->slot_size - 1) / page->slot_size);
+	page->size_class = (uint8_t)size_class;
+	page->index = (uint32_t)heap->object_page_count;
+
+	heap->object_pages[heap->object_page_count++] = page;
+	heap->mapped_bytes += HEAP_PAGE_SIZE;
+	return page;
+}
+
+static void remove_object_page(Heap *heap, HeapPage *page) {
+	HeapPage *last = heap->object_pages[--heap->object_page_count];
+	heap->object_pages[page->index] = last;
+	last->index = page->index;
+
+	heap_unmap(heap, page->base, HEAP_PAGE_SIZE);
+	free(page);
+}
+
+static void *slot_address(HeapPage *page, size_t index) {
+	return page->base + HEAP_PAGE_HEADER + index * page->slot_size;
+}
+
+void *heap_alloc_object(Heap *heap, size_t size) {
+	size_t size_class = heap_size_class(size);
+	HeapPage *page = heap->object_free[size_class];
+	if (page == NULL) {
+		page = add_object_page(heap, size_class);
+		heap->object_free[size_class] = page;
+	}
+
+	// Every word before `scan` is full, and there is a free slot somewhere.
+	size_t word = page->scan;
+	while (page->live[word] == ~(uint64_t)0) {
+		word++;
+	}
+	size_t index = word * 64 + __builtin_ctzll(~page->live[word]);
+	page->live[word] |= (uint64_t)1 << (index % 64);
+	page->scan = (uint32_t)word;
+
+	if (++page->live_count == page->slot_count) {
+		heap->object_free[size_class] = page->next_free;
+		page->next_free = NULL;
+	}
+
+	return slot_address(page, index);
+}
+
+void heap_sweep(Heap *heap, void (*finalize)(void *ptr)) {
+	for (size_t i = 0; i < HEAP_SIZE_CLASSES; i++) {
+		heap->object_free[i] = NULL;
+	}
+	// Keep one empty page per class around so that a program which only
+	// allocates a handful of objects between collections doesn't remap a page
+	// every time.
+	bool kept_empty[HEAP_SIZE_CLASSES] = { false };
+	// Only unlink the dead objects here. The buffers `finalize` releases
+	// go to the reclaimer, if there is one.
+	heap->sweeping = true;
+
+	size_t i = 0;
+	while (i < heap->object_page_count) {
+		HeapPage *page = heap->object_pages[i];
+		if (page->inherited) {
+			memset(page->marks, 0, sizeof(page->marks));
+			i++;
+			continue;
+		}
+		size_t words = (page->slot_count + 63) / 64;
+		for (size_t w = 0; w < words; w++) {
+			uint64_t dead = page->live[w] & ~page->marks[w];
+			while (dead != 0) {
+				size_t index = w * 64 + __builtin_ctzll(dead);
+				finalize(slot_address(page, index));
+				page->live_count--;
+				dead &= dead - 1;
+			}
+			page->live[w] &= page->marks[w];
+			page->marks[w] = 0;
+		}
+		page->scan = 0;
+
+		if (page->live_count == 0) {
+			if (kept_empty[page->size_class]) {
+				// The last page moves into slot i, so look at it next.
+				remove_object_page(heap, page);
+				continue;
+			}
+			kept_empty[page->size_class] = true;
+		}
+		if (page->live_count < page->slot_count) {
+			page->next_free = heap->object_free[page->size_class];
+			heap->object_free[page->size_class] = page;
+		} else {
+			page->next_free = NULL;
+		}
+		i++;
+	}
+	heap->sweeping = false;
+
+	reclaim_flush(heap);
+}
+
+void heap_each_object(Heap *heap, void (*fn)(void *ptr, void *ctx), void *ctx) {
+	for (size_t i = 0; i < heap->object_page_count; i++) {
+		HeapPage *page = heap->object_pages[i];
+		if (page->evacuating) {
+			continue;
+		}
+		size_t words = (page->slot_count + 63) / 64;
+		for (size_t w = 0; w < words; w++) {
+			for (uint64_t live = page->live[w]; live != 0; live &= live - 1) {
+				fn(slot_address(page, w * 64 + __builtin_ctzll(live)), ctx);
+			}
+		}
+	}
+}
+
+void heap_after_fork(Heap *heap) {
+	for (size_t i = 0; i < heap->object_page_count; i++) {
+		heap->object_pages[i]->inherited = true;
+		heap->object_pages[i]->next_free = NULL;
+	}
+	for (size_t i = 0; i < HEAP_SIZE_CLASSES; i++) {
+		heap->object_free[i] = NULL;
+		// Slots freed from here on are still handed out again, but nothing
+		// is carved out of a half-used inherited page.
+		heap->classes[i] = (SizeClass){ NULL, NULL, NULL };
+	}
+	// Only the thread that called fork() was copied. Whatever was still
+	// queued or waiting to be taken back is never released in the child.
+	heap->reclaimer = NULL;
+}
+
+double heap_fragmentation(Heap *heap, size_t *free_bytes) {
+	size_t free = 0;
+	for (size_t i = 0; i < heap->object_page_count; i++) {
+		HeapPage *page = heap->object_pages[i];
+		free += (size_t)(page->slot_count - page->live_count) * page->slot_size;
+	}
+	*free_bytes = free;
+	if (heap->object_page_count == 0) {
+		return 0;
+	}
+	return (double)free / ((double)heap->object_page_count * HEAP_PAGE_SIZE);
+}
+
+// Sparsest pages first, grouped by size class.
+static int compare_pages(const void *a, const void *b) {
+	const HeapPage *x = *(const HeapPage **)a;
+	const HeapPage *y = *(const HeapPage **)b;
+	if (x->size_class != y->size_class) {
+		return x->size_class < y->size_class ? -1 : 1;
+	}
+	if (x->live_count != y->live_count) {
+		return x->live_count < y->live_count ? -1 : 1;
+	}
+	return 0;
+}
+
+// Marks pages for evacuation, returning how many were picked.
+static size_t plan_evacuation(Heap *heap) {
+	size_t count = heap->object_page_count;
+	HeapPage **sorted = (HeapPage **)malloc(sizeof(HeapPage *) * count);
+	if (sorted == NULL) {
+		exit(1);
+	}
+	memcpy(sorted, heap->object_pages, sizeof(HeapPage *) * count);
+	qsort(sorted, count, sizeof(HeapPage *), compare_pages);
+
+	size_t picked = 0;
+	size_t start = 0;
+	while (start < count) {
+		size_t end = start;
+		size_t holes = 0;
+		while (end < count && sorted[end]->size_class == sorted[start]->size_class) {
+			holes += sorted[end]->slot_count - sorted[end]->live_count;
+			end++;
+		}
+
+		// Take pages from the sparse end while what they hold still fits into
+		// the holes left on the pages that stay.
+		size_t moving = 0;
+		for (size_t i = start; i < end; i++) {
+			HeapPage *page = sorted[i];
+			size_t remaining = holes - (page->slot_count - page->live_count);
+			if (moving + page->live_count > remaining) {
+				break;
+			}
+			holes = remaining;
+			moving += page->live_count;
+			page->evacuating = true;
+			picked++;
+		}
+		start = end;
+	}
+
+	free(sorted);
+	return picked;
+}
+
+size_t heap_evacuate(Heap *heap, void (*moved)(void *from, void *to)) {
+	size_t pages = plan_evacuation(heap);
+	if (pages == 0) {
+		return 0;
+	}
+
+	// Only allocate into pages that stay.
+	for (size_t i = 0; i < HEAP_SIZE_CLASSES; i++) {
+		heap->object_free[i] = NULL;
+	}
+	for (size_t i = 0; i < heap->object_page_count; i++) {
+		HeapPage *page = heap->object_pages[i];
+		page->scan = 0;
+		if (!page->evacuating && page->live_count < page->slot_count) {
+			page->next_free = heap->object_free[page->size_class];
+			heap->object_free[page->size_class] = page;
+		}
+	}
+
+	for (size_t i = 0; i < heap->object_page_count; i++) {
+		HeapPage *page = heap->object_pages[i];
+		if (!page->evacuating) {
+			continue;
+		}
+		size_t words = (page->slot_count + 63) / 64;
+		for (size_t w = 0; w < words; w++) {
+			for (uint64_t live = page->live[w]; live != 0; live &= live - 1) {
+				void *from = slot_address(page, w * 64 + __builtin_ctzll(live));
+				void *to = heap_alloc_object(heap, page->slot_size);
+				memcpy(to, from, page->slot_size);
+				moved(from, to);
+				*(void **)from = to;
+			}
+		}
+	}
+	return pages;
+}
+
+void heap_release_evacuated(Heap *heap) {
+	size_t i = 0;
+	while (i < heap->object_page_count) {
+		HeapPage *page = heap->object_pages[i];
+		if (page->evacuating) {
+			// The last page moves into slot i, so look at it next.
+			remove_object_page(heap, page);
+			continue;
+		}
+		i++;
+	}
+	reclaim_flush(heap);
+}
@@ -0,0 +1,182 @@
+#ifndef clox_heap_h
+#define clox_heap_h
+
+#include "common.h"
+
+// Small allocations are carved out of pages of this size. Every page only
+// holds slots of a single size class, so related objects of the same type end
+// up next to each other and no per-allocation header is needed: the caller
+// always knows the size of what it is freeing (see `reallocate`).
+#define HEAP_PAGE_SIZE (64 * 1024)
+
+// Anything larger than the biggest size class is mapped directly from the OS.
+#define HEAP_SMALL_MAX 8192
+#define HEAP_SIZE_CLASSES 32
+
+// Objects get pages of their own, aligned to their size so the page an object
+// lives on can be found by masking off the low bits of its address. The page
+// starts with a pointer back to its descriptor. Everything the collector
+// writes (mark bits, liveness) lives in the descriptor, outside of the page,
+// so marking never dirties the objects themselves.
+#define HEAP_PAGE_HEADER 16
+#define HEAP_BITMAP_WORDS (HEAP_PAGE_SIZE / 16 / 64)
+
+// Unmapping is slow (the kernel has to shoot down TLB entries), and so is
+// touching every buffer a sweep frees to link it onto a free list, so both
+// can be handed to a background thread instead. With one running, a sweep
+// only unlinks the dead objects and queues their buffers and the empty
+// pages, a batch at a time. At most this many bytes wait in the queue at
+// once; past that, the releasing thread releases them itself.
+#define HEAP_RECLAIM_MAX_BYTES (256 * 1024 * 1024)
+#define HEAP_RECLAIM_QUEUE 16384
+#define HEAP_RECLAIM_BATCH 256
+
+typedef struct HeapReclaimer HeapReclaimer;
+
+typedef struct HeapSlot {
+  struct HeapSlot *next;
+} HeapSlot;
+
+typedef struct {
+  // Slots that have been freed and can be handed out again.
+  HeapSlot *free;
+  // Untouched tail of the newest page of this class.
+  char *bump;
+  char *limit;
+} SizeClass;
+
+typedef struct HeapPage {
+  char *base;
+  // Next page of the same size class that has free slots.
+  struct HeapPage *next_free;
+  uint32_t slot_size;
+  uint32_t slot_count;
+  // ceil(2^32 / slot_size), so slot indices can be found without a division.
+  uint32_t slot_reciprocal;
+  uint32_t live_count;
+  // First word of `live` that may still have a clear bit.
+  uint32_t scan;
+  // Index of the page in `Heap.object_pages`.
+  uint32_t index;
+  uint8_t size_class;
+  // Set while the page's objects are being moved out. Every live slot on
+  // it then holds the address of its object's new copy.
+  bool evacuating;
+  // Set for the descriptor of a shared segment (see segment.h), whose
+  // objects belong to no heap. Nothing else in it is used then.
+  bool shared;
+  // Set in a forked child for the pages it inherited from its parent (see
+  // heap_after_fork). Sweeping leaves them alone.
+  bool inherited;
+  // One bit per slot: allocated, and reached by the current collection.
+  uint64_t live[HEAP_BITMAP_WORDS];
+  uint64_t marks[HEAP_BITMAP_WORDS];
+} HeapPage;
+
+typedef struct {
+  // Raw memory: arrays, strings, table entries.
+  SizeClass classes[HEAP_SIZE_CLASSES];
+
+  // Base addresses of all raw pages, so they can be returned to the OS.
+  char **pages;
+  size_t page_count;
+  size_t page_capacity;
+
+  // Objects, which the collector iterates page by page.
+  HeapPage **object_pages;
+  size_t object_page_count;
+  size_t object_page_capacity;
+  HeapPage *object_free[HEAP_SIZE_CLASSES];
+
+  // Bytes currently mapped from the OS, for pages and large allocations.
+  // Memory queued for the reclaimer no longer counts.
+  size_t mapped_bytes;
+  size_t large_count;
+
+  // NULL unless `heap_start_reclaimer` was called.
+  HeapReclaimer *reclaimer;
+  // Set while `heap_sweep` runs, when freed buffers go to the reclaimer.
+  bool sweeping;
+} Heap;
+
+void heap_init(Heap *heap);
+void heap_free(Heap *heap);
+
+// Starts the background reclaimer. Returns false if threads aren't available.
+bool heap_start_reclaimer(Heap *heap);
+// Waits for everything queued so far to be released and stops the thread.
+void heap_stop_reclaimer(Heap *heap);
+// Bytes queued for release that the reclaimer hasn't gotten to yet.
+size_t heap_reclaim_pending(Heap *heap);
+
+void *heap_alloc(Heap *heap, size_t size);
+void *heap_realloc(Heap *heap, void *ptr, size_t old_size, size_t new_size);
+void heap_release(Heap *heap, void *ptr, size_t size);
+
+void *heap_alloc_object(Heap *heap, size_t size);
+// Calls `finalize` on every allocated object that was not marked, frees their
+// slots, returns empty pages to the OS and clears all mark bits.
+void heap_sweep(Heap *heap, void (*finalize)(void *ptr));
+// Fraction of object page memory not taken by live objects.
+double heap_fragmentation(Heap *heap, size_t *free_bytes);
+// Picks the sparsest pages of each size class whose objects fit into the
+// holes on the other pages of the class and moves them there, leaving a
+// forwarding address in each old slot (see `heap_forward`). `moved` is
+// called for every object after it's copied. Returns the number of pages
+// being evacuated.
+size_t heap_evacuate(Heap *heap, void (*moved)(void *from, void *to));
+// Unmaps the pages emptied by `heap_evacuate`, once every reference has
+// been forwarded.
+void heap_release_evacuated(Heap *heap);
+// Calls `fn` on every allocated object, skipping pages being evacuated.
+void heap_each_object(Heap *heap, void (*fn)(void *ptr, void *ctx), void *ctx);
+// Call in the child after a fork(). The pages the child got from its parent
+// are shared with it copy-on-write, so from then on the child only allocates
+// on fresh pages, and sweeping never frees a slot on the inherited ones:
+// their objects stay where they are, dead or not, and the pages stay shared
+// for as long as the child only reads them. The reclaimer's thread doesn't
+// exist in the child, so it unmaps memory itself.
+void heap_after_fork(Heap *heap);
+
+size_t heap_size_class(size_t size);
+size_t heap_class_size(size_t size_class);
+
+static inline HeapPage *heap_page_of(const void *ptr) {
+  uintptr_t base = (uintptr_t)ptr & ~(uintptr_t)(HEAP_PAGE_SIZE - 1);
+  return *(HeapPage **)base;
+}
+
+static inline size_t heap_slot_index(const HeapPage *page, const void *ptr) {
+  uint64_t offset = (uint64_t)((const char *)ptr - page->base - HEAP_PAGE_HEADER);
+  return (size_t)((offset * page->slot_reciprocal) >> 32);
+}
+
+static inline bool heap_is_marked(const void *ptr) {
+  HeapPage *page = heap_page_of(ptr);
+  size_t index = heap_slot_index(page, ptr);
+  return (page->marks[index / 64] >> (index % 64)) & 1;
+}
+
+static inline bool heap_is_shared(const void *ptr) {
+  return heap_page_of(ptr)->shared;
+}
+
+// Where an object lives after `heap_evacuate`.
+static inline void *heap_forward(void *ptr) {
+  HeapPage *page = heap_page_of(ptr);
+  return page->evacuating ? *(void **)ptr : ptr;
+}
+
+// Marks the object, returning whether it was already marked.
+static inline bool heap_mark(const void *ptr) {
+  HeapPage *page = heap_page_of(ptr);
+  size_t index = heap_slot_index(page, ptr);
+  uint64_t bit = (uint64_t)1 << (index % 64);
+  if (page->marks[index / 64] & bit) {
+    return true;
+  }
+  page->marks[index / 64] |= bit;
+  return false;
+}
+
+#endif
@@ -0,0 +1,272 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "debug.h"
+#include "isolate.h"
+#include "object.h"
+
+struct Isolate {
+	pthread_t thread;
+	char *source;
+	InterpretResult result;
+};
+
+static void *isolate_main(void *arg) {
+	Isolate *isolate = (Isolate *)arg;
+	char *err = vm_init();
+	if (err != NULL) {
+		fprintf(stderr, "%s\n", err);
+		isolate->result = INTERPRET_RUNTIME_ERROR;
+		return NULL;
+	}
+	Function *function = compile(isolate->source);
+	isolate->result = function != NULL ? vm_interpret(function) : INTERPRET_COMPILE_ERROR;
+	vm_free();
+	return NULL;
+}
+
+Isolate *isolate_spawn(const char *source, size_t length) {
+	Isolate *isolate = (Isolate *)malloc(sizeof(Isolate));
+	if (isolate == NULL) {
+		return NULL;
+	}
+	isolate->source = (char *)malloc(length + 1);
+	if (isolate->source == NULL) {
+		free(isolate);
+		return NULL;
+	}
+	memcpy(isolate->source, source, length);
+	isolate->source[length] = '\0';
+	isolate->result = INTERPRET_OK;
+	if (pthread_create(&isolate->thread, NULL, isolate_main, isolate) != 0) {
+		free(isolate->source);
+		free(isolate);
+		return NULL;
+	}
+	return isolate;
+}
+
+InterpretResult isolate_join(Isolate *isolate) {
+	pthread_join(isolate->thread, NULL);
+	InterpretResult result = isolate->result;
+	free(isolate->source);
+	free(isolate);
+	return result;
+}
+
+void isolate_copy_init(IsolateCopy *copy, Table *globals) {
+	object_map_init(&copy->copies);
+	copy->globals = globals;
+	copy->keep = list_new();
+	vm_push(OBJ_VAL(copy->keep));
+}
+
+void isolate_copy_free(IsolateCopy *copy) {
+	object_map_free(&copy->copies);
+	vm_pop();
+}
+
+static void insert_copy(IsolateCopy *copy, Object *source, Value value) {
+	object_map_set(&copy->copies, source, value);
+	// Growing the list can collect, and nothing else holds the copy yet.
+	vm_push(value);
+	list_push(copy->keep, value);
+	vm_pop();
+}
+
+static Value copy_object(IsolateCopy *copy, Object *obj);
+
+// Copies the globals `function` reads or writes that aren't defined here.
+static void copy_globals(IsolateCopy *copy, Function *function) {
+	Chunk *chunk = &function->chunk;
+	for (size_t offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+		uint32_t constant;
+		switch (chunk->code[offset]) {
+		case OP_GET_GLOBAL:
+		case OP_SET_GLOBAL:
+			constant = chunk->code[offset + 1];
+			break;
+		case OP_GET_GLOBAL_LONG:
+		case OP_SET_GLOBAL_LONG:
+			constant = chunk->code[offset + 1] | (chunk->code[offset + 2] << 8)
+			           | (chunk->code[offset + 3] << 16);
+			break;
+		default:
+			continue;
+		}
+		String *source_name = AS_STRING(chunk->constants.values[constant]);
+		Value value;
+		if (!table_get(copy->globals, source_name, &value)) {
+			continue;
+		}
+		String *name = AS_STRING(copy_object(copy, (Object *)source_name));
+		if (table_has_key(&vm.globals, name)) {
+			continue;
+		}
+		// Defined first, so a function that refers to itself isn't copied
+		// again while it is being copied.
+		table_set(&vm.globals, name, NIL_VAL);
+		table_set(&vm.globals, name, isolate_copy(copy, value));
+	}
+}
+
+static Function *copy_function(IsolateCopy *copy, Function *source) {
+	Function *function = function_new();
+	insert_copy(copy, (Object *)source, OBJ_VAL(function));
+	function->arity = source->arity;
+	function->upvalue_count = source->upvalue_count;
+	function->stackless = source->stackless;
+	if (source->name != NULL) {
+		function->name = AS_STRING(copy_object(copy, (Object *)source->name));
+	}
+	if (source->lazy != NULL) {
+		// There's no chunk yet. The body is compiled on the first call, in
+		// whichever isolate that happens.
+		LazyBody *lazy = ALLOCATE(LazyBody, 1);
+		*lazy = *source->lazy;
+		// Only the main isolate takes bodies from the pipeline.
+		lazy->job = NULL;
+		lazy->upvalues = ALLOCATE(Token, source->upvalue_count);
+		for (uint32_t i = 0; i < source->upvalue_count; i++) {
+			lazy->upvalues[i] = source->lazy->upvalues[i];
+		}
+		function->lazy = lazy;
+		return function;
+	}
+
+	Chunk *chunk = &function->chunk;
+	const Chunk *from = &source->chunk;
+	chunk->code = GROW_ARRAY(uint8_t, NULL, 0, from->count);
+	memcpy(chunk->code, from->code, from->count);
+	chunk->count = from->count;
+	chunk->capacity = from->count;
+	line_info_copy(&chunk->lines, &from->lines);
+	StackMaps *maps = &chunk->stack_maps;
+	for (size_t i = 0; i < from->stack_maps.count; i++) {
+		stack_maps_add(maps, from->stack_maps.offsets[i], from->stack_maps.local_counts[i]);
+	}
+	if (from->stack_maps.live != NULL) {
+		// The liveness analysis only depends on the code, so its result is
+		// copied rather than computed again.
+		maps->words = from->stack_maps.words;
+		maps->live = ALLOCATE(uint64_t, maps->count * maps->words);
+		memcpy(maps->live, from->stack_maps.live, sizeof(uint64_t) * maps->count * maps->words);
+	}
+	for (size_t i = 0; i < from->constants.count; i++) {
+		value_array_write(&chunk->constants, isolate_copy(copy, from->constants.values[i]));
+	}
+
+	if (copy->globals != NULL) {
+		copy_globals(copy, source);
+	}
+	return function;
+}
+
+static Value copy_object(IsolateCopy *copy, Object *obj) {
+	if (heap_is_shared(obj)) {
+		segment_attach(&vm.segments, segment_of(obj));
+		return OBJ_VAL(obj);
+	}
+	Value *copied = object_map_get(&copy->copies, obj);
+	if (copied != NULL) {
+		return *copied;
+	}
+
+	switch (object_type(obj)) {
+	case OBJ_STRING: {
+		String *str = (String *)obj;
+		Value value = OBJ_VAL(copy_string(str->chars, str->length));
+		insert_copy(copy, obj, value);
+		return value;
+	}
+	case OBJ_FUNCTION:
+		return OBJ_VAL(copy_function(copy, (Function *)obj));
+	case OBJ_CLOSURE: {
+		Closure *source = (Closure *)obj;
+		Function *function = AS_FUNCTION(copy_object(copy, (Object *)source->function));
+		Closure *closure = closure_new(function);
+		insert_copy(copy, obj, OBJ_VAL(closure));
+		for (size_t i = 0; i < closure->upvalue_count; i++) {
+			closure->upvalues[i] = (Upvalue *)AS_OBJ(copy_object(copy, (Object *)source->upvalues[i]));
+		}
+		return OBJ_VAL(closure);
+	}
+	case OBJ_UPVALUE: {
+		// Captured variables come over closed: writes don't go back.
+		Upvalue *upvalue = upvalue_new(NULL);
+		upvalue->location = &upvalue->closed;
+		insert_copy(copy, obj, OBJ_VAL(upvalue));
+		upvalue->closed = isolate_copy(copy, *((Upvalue *)obj)->location);
+		return OBJ_VAL(upvalue);
+	}
+	case OBJ_NATIVE: {
+		NativeFunction *source = (NativeFunction *)obj;
+		Value value = OBJ_VAL(native_new(source->function, source->arity));
+		insert_copy(copy, obj, value);
+		return value;
+	}
+	case OBJ_LIST: {
+		ValueArray *from = &((List *)obj)->values;
+		List *list = list_new();
+		insert_copy(copy, obj, OBJ_VAL(list));
+		for (size_t i = 0; i < from->count; i++) {
+			list_push(list, isolate_copy(copy, from->values[i]));
+		}
+		return OBJ_VAL(list);
+	}
+	case OBJ_DICT: {
+		Table *from = &((Dictionary *)obj)->table;
+		Dictionary *dict = dict_new();
+		insert_copy(copy, obj, OBJ_VAL(dict));
+		for (size_t i = 0; i < from->capacity; i++) {
+			Entry *entry = &from->entries[i];
+			if (entry->key == NULL || IS_NIL(entry->value)) {
+				continue;
+			}
+			String *key = AS_STRING(copy_object(copy, (Object *)entry->key));
+			dict_set(dict, key, isolate_copy(copy, entry->value));
+		}
+		return OBJ_VAL(dict);
+	}
+	case OBJ_COROUTINE:
+	case OBJ_CHANNEL:
+		break;
+	}
+	return NIL_VAL;
+}
+
+Value isolate_copy(IsolateCopy *copy, Value value) {
+	return IS_OBJ(value) ? copy_object(copy, AS_OBJ(value)) : value;
+}
+
+// isolates(sources) runs each source string in an isolate of its own, all
+// in parallel, and returns a list telling which of them ran without error.
+Value isolate_run_native(uint8_t argc, Value *args) {
+	if (!IS_LIST(args[0])) {
+		return NIL_VAL;
+	}
+	List *sources = AS_LIST(args[0]);
+	size_t count = sources->values.count;
+	Isolate **isolates = (Isolate **)calloc(count > 0 ? count : 1, sizeof(Isolate *));
+	if (isolates == NULL) {
+		return NIL_VAL;
+	}
+	for (size_t i = 0; i < count; i++) {
+		Value source = sources->values.values[i];
+		if (IS_STRING(source)) {
+			isolates[i] = isolate_spawn(AS_CSTRING(source), AS_STRING(source)->length);
+		}
+	}
+
+	List *results = list_new();
+	vm_push(OBJ_VAL(results));
+	for (size_t i = 0; i < count; i++) {
+		bool ok = isolates[i] != NULL && isolate_join(isolates[i]) == INTERPRET_OK;
+		list_push(results, BOOL_VAL(ok));
+	}
+	vm_pop();
+	free(isolates);
+	return OBJ_VAL(results);
+}
@@ -0,0 +1,50 @@
+#ifndef clox_isolate_h
+#define clox_isolate_h
+
+#include "common.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+// An isolate is a complete interpreter (VM, heap, compiler and scanner
+// state) running a script on a thread of its own. All of that state is
+// THREAD_LOCAL, so isolates share nothing but frozen segments, which are
+// never written, and need no locking. Values cross between them as source
+// text, copies, or references into a frozen segment.
+typedef struct Isolate Isolate;
+
+// Starts a fresh isolate running `source`, which is copied. Returns NULL if
+// the thread couldn't be started.
+Isolate *isolate_spawn(const char *source, size_t length);
+// Waits for the isolate to finish, frees it, and returns how its script
+// went.
+InterpretResult isolate_join(Isolate *isolate);
+
+// Copies values out of another isolate's heap into this thread's. The other
+// isolate may keep running, as long as what is copied stays reachable there
+// and unwritten until the copy is done, and its collector never compacts:
+// marking only touches page bitmaps, but compaction moves objects. An
+// object reached twice is copied once, so
+// sharing and cycles carry over. Functions are copied with their bytecode,
+// constants and captured values, and with the globals they use if this
+// isolate doesn't have them yet. Frozen objects aren't copied at all: both
+// isolates reference the same segment (see segment.h). Coroutines and
+// channels can't be copied and turn into nil.
+typedef struct {
+  // From objects in the other heap to their copies.
+  ObjectMap copies;
+  // Every copy made, so that they stay reachable until the copy is done.
+  List *keep;
+  // The other isolate's globals, or NULL to copy no globals.
+  Table *globals;
+} IsolateCopy;
+
+// Roots the copier on the stack; isolate_copy_free pops it again.
+void isolate_copy_init(IsolateCopy *copy, Table *globals);
+void isolate_copy_free(IsolateCopy *copy);
+Value isolate_copy(IsolateCopy *copy, Value value);
+
+Value isolate_run_native(uint8_t argc, Value *args);
+
+#endif
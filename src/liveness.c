@@ -0,0 +1,298 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+
+// Backward liveness analysis of local slots over a chunk's bytecode, run once
+// when a function finishes compiling to fill in its stack maps.
+//
+// A slot is live at a point if some path from there reads it with
+// OP_GET_LOCAL before overwriting it with OP_SET_LOCAL. Slots captured by a
+// closure are read through their upvalue, so those, and slot 0 (the callee),
+// are treated as live everywhere.
+
+typedef struct {
+	size_t count;
+	uint32_t *starts;
+	// Instruction index for each offset that starts an instruction, else -1.
+	int32_t *index_at;
+} Instructions;
+
+static uint32_t read_long_operand(const uint8_t *code, size_t offset) {
+	return code[offset] | (code[offset + 1] << 8) | (code[offset + 2] << 16);
+}
+
+static uint32_t read_jump_operand(const uint8_t *code, size_t offset) {
+	return ((uint32_t)code[offset] << 24) | ((uint32_t)code[offset + 1] << 16)
+	       | ((uint32_t)code[offset + 2] << 8) | (uint32_t)code[offset + 3];
+}
+
+// Length of the instruction at `offset`, or 0 if it can't be decoded.
+static size_t instruction_size(const Chunk *chunk, size_t offset) {
+	switch ((Opcode)chunk->code[offset]) {
+	case OP_CLOSURE:
+	case OP_CLOSURE_LONG: {
+		bool is_long = chunk->code[offset] == OP_CLOSURE_LONG;
+		if (offset + (is_long ? 4 : 2) > chunk->count) {
+			return 0;
+		}
+		uint32_t constant = is_long ? read_long_operand(chunk->code, offset + 1)
+		                    : chunk->code[offset + 1];
+		if (constant >= chunk->constants.count
+		    || !IS_FUNCTION(chunk->constants.values[constant])) {
+			return 0;
+		}
+		Function *function = AS_FUNCTION(chunk->constants.values[constant]);
+		return (is_long ? 4 : 2) + 2 * (size_t)function->upvalue_count;
+	}
+	case OP_DICT:
+	case OP_CALL:
+	case OP_LIST:
+	case OP_GET_UPVALUE:
+	case OP_SET_UPVALUE:
+	case OP_CONSTANT:
+	case OP_DEFINE_GLOBAL:
+	case OP_GET_GLOBAL:
+	case OP_SET_GLOBAL:
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+		return 2;
+	case OP_DICT_LONG:
+	case OP_LIST_LONG:
+	case OP_CONSTANT_LONG:
+	case OP_DEFINE_GLOBAL_LONG:
+	case OP_GET_GLOBAL_LONG:
+	case OP_SET_GLOBAL_LONG:
+	case OP_GET_LOCAL_LONG:
+	case OP_SET_LOCAL_LONG:
+		return 4;
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_LOOP:
+		return 5;
+	case OP_COROUTINE:
+	case OP_YIELD:
+	case OP_AWAIT:
+	case OP_NIL:
+	case OP_TRUE:
+	case OP_FALSE:
+	case OP_NOT:
+	case OP_EQUAL:
+	case OP_GREATER:
+	case OP_LESS:
+	case OP_ADD:
+	case OP_SUBTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	case OP_NEGATE:
+	case OP_SET_FIELD:
+	case OP_GET_FIELD:
+	case OP_RETURN:
+	case OP_CLOSE_UPVALUE:
+	case OP_POP:
+		return 1;
+	}
+	return 0;
+}
+
+static bool decode(const Chunk *chunk, Instructions *instructions) {
+	instructions->count = 0;
+	instructions->starts = (uint32_t *)malloc(sizeof(uint32_t) * (chunk->count + 1));
+	instructions->index_at = (int32_t *)malloc(sizeof(int32_t) * (chunk->count + 1));
+	if (instructions->starts == NULL || instructions->index_at == NULL) {
+		return false;
+	}
+	for (size_t i = 0; i <= chunk->count; i++) {
+		instructions->index_at[i] = -1;
+	}
+
+	size_t offset = 0;
+	while (offset < chunk->count) {
+		size_t size = instruction_size(chunk, offset);
+		if (size == 0 || offset + size > chunk->count) {
+			return false;
+		}
+		instructions->index_at[offset] = (int32_t)instructions->count;
+		instructions->starts[instructions->count++] = (uint32_t)offset;
+		offset += size;
+	}
+	return true;
+}
+
+static inline void set_bit(uint64_t *bits, uint32_t words, uint32_t slot) {
+	if (slot / 64 < words) {
+		bits[slot / 64] |= (uint64_t)1 << (slot % 64);
+	}
+}
+
+static inline void clear_bit(uint64_t *bits, uint32_t words, uint32_t slot) {
+	if (slot / 64 < words) {
+		bits[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+	}
+}
+
+// ORs the live-in set of the instruction at `target` into `out`. Returns
+// false if the target isn't an instruction boundary.
+static bool merge_successor(const Instructions *instructions, size_t count, size_t target,
+                            const uint64_t *live_in, uint32_t words, uint64_t *out) {
+	if (target == count) {
+		return true;
+	}
+	if (target > count || instructions->index_at[target] < 0) {
+		return false;
+	}
+	const uint64_t *in = &live_in[(size_t)instructions->index_at[target] * words];
+	for (uint32_t w = 0; w < words; w++) {
+		out[w] |= in[w];
+	}
+	return true;
+}
+
+static bool solve(const Chunk *chunk, const Instructions *instructions, uint32_t words,
+                  uint64_t *live_in, uint64_t *captured) {
+	const uint8_t *code = chunk->code;
+	uint64_t *out = (uint64_t *)malloc(sizeof(uint64_t) * words);
+	if (out == NULL) {
+		return false;
+	}
+
+	// Captures don't depend on control flow, so collect them up front.
+	for (size_t i = 0; i < instructions->count; i++) {
+		size_t offset = instructions->starts[i];
+		if (code[offset] != OP_CLOSURE && code[offset] != OP_CLOSURE_LONG) {
+			continue;
+		}
+		size_t size = instruction_size(chunk, offset);
+		size_t operands = code[offset] == OP_CLOSURE_LONG ? 4 : 2;
+		for (size_t at = offset + operands; at < offset + size; at += 2) {
+			if (code[at]) {
+				set_bit(captured, words, code[at + 1]);
+			}
+		}
+	}
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (size_t i = instructions->count; i-- > 0;) {
+			size_t offset = instructions->starts[i];
+			size_t end = offset + instruction_size(chunk, offset);
+			memset(out, 0, sizeof(uint64_t) * words);
+
+			bool ok = true;
+			switch (code[offset]) {
+			case OP_RETURN:
+				break;
+			case OP_JUMP:
+				ok = merge_successor(instructions, chunk->count,
+				                     end + read_jump_operand(code, offset + 1),
+				                     live_in, words, out);
+				break;
+			case OP_JUMP_IF_FALSE:
+				ok = merge_successor(instructions, chunk->count, end, live_in, words, out)
+				     && merge_successor(instructions, chunk->count,
+				                        end + read_jump_operand(code, offset + 1),
+				                        live_in, words, out);
+				break;
+			case OP_LOOP: {
+				uint32_t back = read_jump_operand(code, offset + 1);
+				ok = back <= end
+				     && merge_successor(instructions, chunk->count, end - back,
+				                        live_in, words, out);
+				break;
+			}
+			default:
+				ok = merge_successor(instructions, chunk->count, end, live_in, words, out);
+				break;
+			}
+			if (!ok) {
+				free(out);
+				return false;
+			}
+
+			switch (code[offset]) {
+			case OP_GET_LOCAL:
+				set_bit(out, words, code[offset + 1]);
+				break;
+			case OP_GET_LOCAL_LONG:
+				set_bit(out, words, read_long_operand(code, offset + 1));
+				break;
+			case OP_SET_LOCAL:
+				clear_bit(out, words, code[offset + 1]);
+				break;
+			case OP_SET_LOCAL_LONG:
+				clear_bit(out, words, read_long_operand(code, offset + 1));
+				break;
+			default:
+				break;
+			}
+
+			uint64_t *in = &live_in[i * words];
+			if (memcmp(in, out, sizeof(uint64_t) * words) != 0) {
+				memcpy(in, out, sizeof(uint64_t) * words);
+				changed = true;
+			}
+		}
+	}
+
+	free(out);
+	return true;
+}
+
+void stack_maps_build(Chunk *chunk) {
+	StackMaps *maps = &chunk->stack_maps;
+	if (maps->count == 0) {
+		return;
+	}
+
+	uint32_t max_locals = 0;
+	for (size_t i = 0; i < maps->count; i++) {
+		if (maps->local_counts[i] > max_locals) {
+			max_locals = maps->local_counts[i];
+		}
+	}
+	uint32_t words = (max_locals + 63) / 64;
+	if (words == 0) {
+		words = 1;
+	}
+
+	Instructions instructions = { 0, NULL, NULL };
+	uint64_t *live_in = NULL;
+	uint64_t *captured = (uint64_t *)calloc(words, sizeof(uint64_t));
+	bool ok = captured != NULL && decode(chunk, &instructions);
+	if (ok) {
+		live_in = (uint64_t *)calloc(instructions.count * words + 1, sizeof(uint64_t));
+		ok = live_in != NULL && solve(chunk, &instructions, words, live_in, captured);
+	}
+
+	// If anything about the code looks off, leave the maps empty and let the
+	// collector scan these frames in full.
+	if (ok) {
+		uint64_t *live = ALLOCATE(uint64_t, maps->count * words);
+		for (size_t i = 0; i < maps->count; i++) {
+			uint64_t *bits = &live[i * words];
+			uint32_t offset = maps->offsets[i];
+			if (offset == chunk->count) {
+				memset(bits, 0, sizeof(uint64_t) * words);
+			} else if (instructions.index_at[offset] >= 0) {
+				memcpy(bits, &live_in[(size_t)instructions.index_at[offset] * words],
+				       sizeof(uint64_t) * words);
+			} else {
+				memset(bits, 0xff, sizeof(uint64_t) * words);
+			}
+			for (uint32_t w = 0; w < words; w++) {
+				bits[w] |= captured[w];
+			}
+			bits[0] |= 1;
+		}
+		maps->live = live;
+		maps->words = words;
+	}
+
+	free(live_in);
+	free(captured);
+	free(instructions.starts);
+	free(instructions.index_at);
+}
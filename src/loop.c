@@ -0,0 +1,488 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "channel.h"
+#include "loop.h"
+#include "memory.h"
+#include "vm.h"
+
+#define LOOP_MAX_EVENTS 64
+#define LOOP_READ_MAX (1024 * 1024)
+
+static double now_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// The loop's own bookkeeping isn't made of objects, so like the gray stack
+// it lives outside the collected heap.
+static void *grow(void *array, size_t element_size, size_t *capacity) {
+	size_t new_capacity = GROW_CAPACITY(*capacity);
+	array = realloc(array, element_size * new_capacity);
+	if (array == NULL) {
+		exit(1);
+	}
+	*capacity = new_capacity;
+	return array;
+}
+
+void loop_init(EventLoop *loop) {
+	loop->epoll_fd = -1;
+	loop->ready = NULL;
+	loop->ready_head = 0;
+	loop->ready_count = 0;
+	loop->ready_capacity = 0;
+	loop->timers = NULL;
+	loop->timer_count = 0;
+	loop->timer_capacity = 0;
+	loop->timer_sequence = 0;
+	loop->watches = NULL;
+	loop->watch_capacity = 0;
+	loop->watching = 0;
+	loop->current = NULL;
+	loop->parked = false;
+}
+
+void loop_free(EventLoop *loop) {
+	if (loop->epoll_fd >= 0) {
+		close(loop->epoll_fd);
+	}
+	free(loop->ready);
+	free(loop->timers);
+	free(loop->watches);
+	loop_init(loop);
+}
+
+void loop_after_fork(EventLoop *loop) {
+	if (loop->epoll_fd < 0) {
+		return;
+	}
+	// The descriptor refers to the parent's epoll instance, which the child
+	// must not change under it, so the watches move to one of its own.
+	close(loop->epoll_fd);
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	for (size_t fd = 0; fd < loop->watch_capacity; fd++) {
+		LoopWatch *watch = &loop->watches[fd];
+		if (watch->events == 0) {
+			continue;
+		}
+		struct epoll_event event;
+		event.events = watch->events;
+		event.data.fd = (int)fd;
+		if (loop->epoll_fd < 0 || epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, (int)fd, &event) < 0) {
+			watch->events = 0;
+		}
+	}
+}
+
+static LoopTask *ready_at(EventLoop *loop, size_t i) {
+	return &loop->ready[(loop->ready_head + i) % loop->ready_capacity];
+}
+
+static void push_ready(EventLoop *loop, Coroutine *task, Value value, bool has_value) {
+	if (loop->ready_count == loop->ready_capacity) {
+		// Unwrap the ring into the bigger buffer.
+		size_t old_capacity = loop->ready_capacity;
+		LoopTask *old = loop->ready;
+		LoopTask *ready = NULL;
+		ready = grow(ready, sizeof(LoopTask), &loop->ready_capacity);
+		for (size_t i = 0; i < loop->ready_count; i++) {
+			ready[i] = old[(loop->ready_head + i) % old_capacity];
+		}
+		free(old);
+		loop->ready = ready;
+		loop->ready_head = 0;
+	}
+	LoopTask *entry = ready_at(loop, loop->ready_count++);
+	entry->task = task;
+	entry->value = value;
+	entry->has_value = has_value;
+}
+
+static LoopTask pop_ready(EventLoop *loop) {
+	LoopTask task = loop->ready[loop->ready_head];
+	loop->ready_head = (loop->ready_head + 1) % loop->ready_capacity;
+	loop->ready_count--;
+	return task;
+}
+
+static bool timer_before(const LoopTimer *a, const LoopTimer *b) {
+	return a->deadline < b->deadline
+	       || (a->deadline == b->deadline && a->sequence < b->sequence);
+}
+
+static void push_timer(EventLoop *loop, double deadline, Coroutine *task) {
+	if (loop->timer_count == loop->timer_capacity) {
+		loop->timers = grow(loop->timers, sizeof(LoopTimer), &loop->timer_capacity);
+	}
+	LoopTimer timer = { deadline, loop->timer_sequence++, task };
+	size_t i = loop->timer_count++;
+	while (i > 0 && timer_before(&timer, &loop->timers[(i - 1) / 2])) {
+		loop->timers[i] = loop->timers[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	loop->timers[i] = timer;
+}
+
+static void pop_timer(EventLoop *loop) {
+	LoopTimer last = loop->timers[--loop->timer_count];
+	size_t i = 0;
+	for (;;) {
+		size_t child = 2 * i + 1;
+		if (child >= loop->timer_count) {
+			break;
+		}
+		if (child + 1 < loop->timer_count
+		    && timer_before(&loop->timers[child + 1], &loop->timers[child])) {
+			child++;
+		}
+		if (!timer_before(&loop->timers[child], &last)) {
+			break;
+		}
+		loop->timers[i] = loop->timers[child];
+		i = child;
+	}
+	if (loop->timer_count > 0) {
+		loop->timers[i] = last;
+	}
+}
+
+static void fire_timers(EventLoop *loop, double now) {
+	while (loop->timer_count > 0 && loop->timers[0].deadline <= now) {
+		Coroutine *task = loop->timers[0].task;
+		pop_timer(loop);
+		push_ready(loop, task, NIL_VAL, true);
+	}
+}
+
+// Brings the epoll registration for `fd` in line with who is waiting on it.
+static bool update_watch(EventLoop *loop, int fd) {
+	LoopWatch *watch = &loop->watches[fd];
+	uint32_t events = (watch->reader != NULL ? EPOLLIN : 0)
+	                  | (watch->writer != NULL ? EPOLLOUT : 0);
+	if (events == watch->events) {
+		return true;
+	}
+	struct epoll_event event;
+	event.events = events;
+	event.data.fd = fd;
+	int op = watch->events == 0 ? EPOLL_CTL_ADD : events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+	if (epoll_ctl(loop->epoll_fd, op, fd, &event) < 0) {
+		return false;
+	}
+	watch->events = events;
+	return true;
+}
+
+static bool watch(EventLoop *loop, int fd, Coroutine *task, bool write) {
+	if (loop->epoll_fd < 0) {
+		loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (loop->epoll_fd < 0) {
+			return false;
+		}
+	}
+	while ((size_t)fd >= loop->watch_capacity) {
+		size_t old_capacity = loop->watch_capacity;
+		loop->watches = grow(loop->watches, sizeof(LoopWatch), &loop->watch_capacity);
+		memset(loop->watches + old_capacity, 0,
+		       sizeof(LoopWatch) * (loop->watch_capacity - old_capacity));
+	}
+
+	LoopWatch *entry = &loop->watches[fd];
+	Coroutine **slot = write ? &entry->writer : &entry->reader;
+	if (*slot != NULL) {
+		// Someone else is already waiting for this.
+		return false;
+	}
+	*slot = task;
+	if (!update_watch(loop, fd)) {
+		*slot = NULL;
+		return false;
+	}
+	loop->watching++;
+	return true;
+}
+
+// Waits for timers and file descriptors, moving whatever is ready to the
+// run queue. Only blocks if nothing is runnable yet.
+static void poll_events(EventLoop *loop) {
+	double now = now_seconds();
+	fire_timers(loop, now);
+	if (loop->watching == 0 && (loop->ready_count > 0 || loop->timer_count == 0)) {
+		return;
+	}
+
+	int timeout = -1;
+	if (loop->ready_count > 0) {
+		timeout = 0;
+	} else if (loop->timer_count > 0) {
+		// Round up, so the timer has expired once we wake up.
+		double wait = (loop->timers[0].deadline - now) * 1000;
+		timeout = wait <= 0 ? 0 : (int)wait + 1;
+	}
+
+	if (loop->watching == 0) {
+		// Just a timer to wait for.
+		struct timespec ts = { timeout / 1000, (long)(timeout % 1000) * 1000000 };
+		while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+		}
+	} else {
+		struct epoll_event events[LOOP_MAX_EVENTS];
+		int count = epoll_wait(loop->epoll_fd, events, LOOP_MAX_EVENTS, timeout);
+		for (int i = 0; i < count; i++) {
+			int fd = events[i].data.fd;
+			LoopWatch *entry = &loop->watches[fd];
+			// Errors and hangups wake both sides; the next read or write reports them.
+			bool failed = events[i].events & (EPOLLERR | EPOLLHUP);
+			if (entry->reader != NULL && (failed || events[i].events & EPOLLIN)) {
+				push_ready(loop, entry->reader, TRUE_VAL, true);
+				entry->reader = NULL;
+				loop->watching--;
+			}
+			if (entry->writer != NULL && (failed || events[i].events & EPOLLOUT)) {
+				push_ready(loop, entry->writer, TRUE_VAL, true);
+				entry->writer = NULL;
+				loop->watching--;
+			}
+			update_watch(loop, fd);
+		}
+	}
+	fire_timers(loop, now_seconds());
+}
+
+void loop_mark_roots(EventLoop *loop) {
+	for (size_t i = 0; i < loop->ready_count; i++) {
+		LoopTask *entry = ready_at(loop, i);
+		mark_object((Object *)entry->task);
+		mark_value(entry->value);
+	}
+	for (size_t i = 0; i < loop->timer_count; i++) {
+		mark_object((Object *)loop->timers[i].task);
+	}
+	if (loop->watching > 0) {
+		for (size_t fd = 0; fd < loop->watch_capacity; fd++) {
+			if (loop->watches[fd].reader != NULL) {
+				mark_object((Object *)loop->watches[fd].reader);
+			}
+			if (loop->watches[fd].writer != NULL) {
+				mark_object((Object *)loop->watches[fd].writer);
+			}
+		}
+	}
+	if (loop->current != NULL) {
+		mark_object((Object *)loop->current);
+	}
+}
+
+void loop_forward_roots(EventLoop *loop) {
+	for (size_t i = 0; i < loop->ready_count; i++) {
+		LoopTask *entry = ready_at(loop, i);
+		entry->task = (Coroutine *)gc_forward((Object *)entry->task);
+		gc_forward_value(&entry->value);
+	}
+	for (size_t i = 0; i < loop->timer_count; i++) {
+		loop->timers[i].task = (Coroutine *)gc_forward((Object *)loop->timers[i].task);
+	}
+	for (size_t fd = 0; fd < loop->watch_capacity && loop->watching > 0; fd++) {
+		LoopWatch *entry = &loop->watches[fd];
+		entry->reader = (Coroutine *)gc_forward((Object *)entry->reader);
+		entry->writer = (Coroutine *)gc_forward((Object *)entry->writer);
+	}
+	loop->current = (Coroutine *)gc_forward((Object *)loop->current);
+}
+
+// spawn(task) queues a coroutine to be started by run(), and returns it.
+Value loop_spawn_native(uint8_t argc, Value *args) {
+	if (!IS_COROUTINE(args[0])) {
+		return NIL_VAL;
+	}
+	push_ready(&vm.loop, AS_COROUTINE(args[0]), NIL_VAL, false);
+	return args[0];
+}
+
+// run() resumes spawned tasks until none are left runnable or waiting. It
+// returns false, doing nothing, if called from one of those tasks.
+Value loop_run_native(uint8_t argc, Value *args) {
+	EventLoop *loop = &vm.loop;
+	if (loop->current != NULL) {
+		// Already inside run().
+		return FALSE_VAL;
+	}
+	while (loop->ready_count > 0 || loop->timer_count > 0 || loop->watching > 0) {
+		poll_events(loop);
+		// Only run what is ready now, so a busy task can't starve I/O.
+		for (size_t n = loop->ready_count; n > 0; n--) {
+			LoopTask next = pop_ready(loop);
+			loop->current = next.task;
+			loop->parked = false;
+			if (!vm_resume(next.task, next.value, next.has_value)) {
+				loop->current = NULL;
+				vm.native_error = true;
+				return NIL_VAL;
+			}
+
+			Coroutine *task = loop->current;
+			loop->current = NULL;
+			if (task->state == COROUTINE_PAUSED) {
+				push_ready(loop, task, NIL_VAL, false);
+			} else if (task->state == COROUTINE_AWAITING && !loop->parked) {
+				// Awaiting a value just gives way to the other tasks.
+				push_ready(loop, task, NIL_VAL, true);
+			}
+		}
+	}
+	return TRUE_VAL;
+}
+
+void loop_park(EventLoop *loop, Coroutine *task) {
+	if (task == loop->current) {
+		loop->parked = true;
+	}
+	vm_park();
+}
+
+void loop_wake(EventLoop *loop, Coroutine *task, Value value) {
+	push_ready(loop, task, value, true);
+}
+
+// sleep(seconds) parks the calling task for at least that long, then
+// returns nil. Returns false straight away if it can't be parked.
+Value loop_sleep_native(uint8_t argc, Value *args) {
+	Coroutine *task = vm_parkable();
+	if (!IS_NUMBER(args[0]) || task == NULL) {
+		return FALSE_VAL;
+	}
+	push_timer(&vm.loop, now_seconds() + AS_NUMBER(args[0]), task);
+	loop_park(&vm.loop, task);
+	return NIL_VAL;
+}
+
+static Value wait_fd(Value fd, bool write) {
+	Coroutine *task = vm_parkable();
+	if (!IS_NUMBER(fd) || AS_NUMBER(fd) < 0 || task == NULL) {
+		return FALSE_VAL;
+	}
+	if (!watch(&vm.loop, (int)AS_NUMBER(fd), task, write)) {
+		return FALSE_VAL;
+	}
+	loop_park(&vm.loop, task);
+	return NIL_VAL;
+}
+
+// readable(fd) and writable(fd) park the calling task until the descriptor
+// is ready and return true, or false if it was closed meanwhile. They
+// return false straight away if it can't be watched.
+Value loop_readable_native(uint8_t argc, Value *args) {
+	return wait_fd(args[0], false);
+}
+
+Value loop_writable_native(uint8_t argc, Value *args) {
+	return wait_fd(args[0], true);
+}
+
+static bool set_nonblocking(int fd) {
+	int flags = fcntl(fd, F_GETFL);
+	return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) >= 0;
+}
+
+static Value fd_pair(int fds[2]) {
+	if (!set_nonblocking(fds[0]) || !set_nonblocking(fds[1])) {
+		close(fds[0]);
+		close(fds[1]);
+		return NIL_VAL;
+	}
+	List *list = list_new();
+	vm_push(OBJ_VAL(list));
+	list_push(list, NUMBER_VAL(fds[0]));
+	list_push(list, NUMBER_VAL(fds[1]));
+	vm_pop();
+	return OBJ_VAL(list);
+}
+
+// pipe() returns [read_fd, write_fd], both non-blocking, or nil.
+Value loop_pipe_native(uint8_t argc, Value *args) {
+	int fds[2];
+	if (pipe(fds) < 0) {
+		return NIL_VAL;
+	}
+	return fd_pair(fds);
+}
+
+// socketpair() returns two connected, non-blocking local stream sockets.
+Value loop_socketpair_native(uint8_t argc, Value *args) {
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		return NIL_VAL;
+	}
+	return fd_pair(fds);
+}
+
+// read(fd, max) returns up to `max` bytes as a string, "" at end of file,
+// or nil if nothing is available yet (or on error).
+Value loop_read_native(uint8_t argc, Value *args) {
+	if (!IS_NUMBER(args[0]) || !IS_NUMBER(args[1]) || AS_NUMBER(args[1]) < 1) {
+		return NIL_VAL;
+	}
+	size_t max = AS_NUMBER(args[1]) > LOOP_READ_MAX ? LOOP_READ_MAX : (size_t)AS_NUMBER(args[1]);
+	char *chars = ALLOCATE(char, max + 1);
+	ssize_t count;
+	do {
+		count = read((int)AS_NUMBER(args[0]), chars, max);
+	} while (count < 0 && errno == EINTR);
+	if (count < 0) {
+		FREE_ARRAY(char, chars, max + 1);
+		return NIL_VAL;
+	}
+	String *string = copy_string(chars, (size_t)count);
+	FREE_ARRAY(char, chars, max + 1);
+	return OBJ_VAL(string);
+}
+
+// write(fd, string) returns the number of bytes written, or nil if the
+// descriptor isn't ready (or on error).
+Value loop_write_native(uint8_t argc, Value *args) {
+	if (!IS_NUMBER(args[0]) || !IS_STRING(args[1])) {
+		return NIL_VAL;
+	}
+	String *string = AS_STRING(args[1]);
+	ssize_t count;
+	do {
+		count = write((int)AS_NUMBER(args[0]), string->chars, string->length);
+	} while (count < 0 && errno == EINTR);
+	return count < 0 ? NIL_VAL : NUMBER_VAL((double)count);
+}
+
+// close(fd) closes a descriptor. Tasks still waiting on it are woken up.
+// Channels are closed with it too.
+Value loop_close_native(uint8_t argc, Value *args) {
+	if (IS_CHANNEL(args[0])) {
+		return channel_close_native(argc, args);
+	}
+	if (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 0) {
+		return FALSE_VAL;
+	}
+	int fd = (int)AS_NUMBER(args[0]);
+	EventLoop *loop = &vm.loop;
+	if ((size_t)fd < loop->watch_capacity) {
+		LoopWatch *entry = &loop->watches[fd];
+		if (entry->reader != NULL) {
+			push_ready(loop, entry->reader, FALSE_VAL, true);
+			entry->reader = NULL;
+			loop->watching--;
+		}
+		if (entry->writer != NULL) {
+			push_ready(loop, entry->writer, FALSE_VAL, true);
+			entry->writer = NULL;
+			loop->watching--;
+		}
+		update_watch(loop, fd);
+	}
+	return BOOL_VAL(close(fd) == 0);
+}
@@ -0,0 +1,87 @@
+#ifndef clox_loop_h
+#define clox_loop_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// The event loop behind run(). Coroutines handed to spawn() are resumed in
+// turn. One that calls sleep(), readable() or writable() is parked until
+// its timer expires or its file descriptor is ready, and the call then
+// returns the event's value. One that yields or awaits a plain value goes
+// to the back of the queue.
+
+typedef struct {
+  Coroutine *task;
+  Value value;
+  // Whether the task is suspended in an await or a parking native, and
+  // expects `value`.
+  bool has_value;
+} LoopTask;
+
+typedef struct {
+  double deadline;
+  // Keeps timers with the same deadline in the order they were set.
+  uint64_t sequence;
+  Coroutine *task;
+} LoopTimer;
+
+typedef struct {
+  Coroutine *reader;
+  Coroutine *writer;
+  // The events currently registered with epoll for this descriptor.
+  uint32_t events;
+} LoopWatch;
+
+typedef struct {
+  int epoll_fd;
+
+  // Ring buffer of tasks ready to run.
+  LoopTask *ready;
+  size_t ready_head;
+  size_t ready_count;
+  size_t ready_capacity;
+
+  // Binary min-heap on (deadline, sequence).
+  LoopTimer *timers;
+  size_t timer_count;
+  size_t timer_capacity;
+  uint64_t timer_sequence;
+
+  // Indexed by file descriptor.
+  LoopWatch *watches;
+  size_t watch_capacity;
+  size_t watching;
+
+  // The task being resumed. Kept here rather than in a C local so
+  // compaction can update it.
+  Coroutine *current;
+  // Whether `current` got parked while it ran.
+  bool parked;
+} EventLoop;
+
+void loop_init(EventLoop *loop);
+void loop_free(EventLoop *loop);
+// Call in the child after a fork().
+void loop_after_fork(EventLoop *loop);
+void loop_mark_roots(EventLoop *loop);
+void loop_forward_roots(EventLoop *loop);
+// Suspends `task`, which must be vm_parkable(), when the current native
+// returns. It stays off the run queue until it is handed to loop_wake.
+void loop_park(EventLoop *loop, Coroutine *task);
+// Queues a parked task, to be resumed with `value` as the result of the
+// native call that parked it.
+void loop_wake(EventLoop *loop, Coroutine *task, Value value);
+
+Value loop_spawn_native(uint8_t argc, Value *args);
+Value loop_run_native(uint8_t argc, Value *args);
+Value loop_sleep_native(uint8_t argc, Value *args);
+Value loop_readable_native(uint8_t argc, Value *args);
+Value loop_writable_native(uint8_t argc, Value *args);
+Value loop_pipe_native(uint8_t argc, Value *args);
+Value loop_socketpair_native(uint8_t argc, Value *args);
+Value loop_read_native(uint8_t argc, Value *args);
+Value loop_write_native(uint8_t argc, Value *args);
+Value loop_close_native(uint8_t argc, Value *args);
+
+#endif
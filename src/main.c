@@ -1,6 +1,10 @@
+#include "bytecode.h"
+#include "cache.h"
 #include "chunk.h"
 #include "compiler.h"
 #include "debug.h"
+#include "memory.h"
+#include "pipeline.h"
 #include "scanner.h"
 #include "table.h"
 #include "repl.h"
@@ -19,8 +23,15 @@
 
 #include "vm.h"
 
-static Function *try_compile(char *src) {
-	Function *function = compile(src);
+typedef enum {
+	COMPILE_EAGER,
+	COMPILE_LAZY,
+	// Lazily, with the bodies compiled in the background (see pipeline.h).
+	COMPILE_PIPELINED,
+} CompileMode;
+
+static Function *try_compile(char *src, bool lazy) {
+	Function *function = lazy ? compile_lazy(src) : compile(src);
 	if (!function) {
 		exit(65);
 	}
@@ -51,34 +62,79 @@ static char *read_file(const char *path) {
 	return buffer;
 }
 
-static void run_file(const char *path, const char *output_path) {
-	char *src = read_file(path);
+static void write_bytecode(Function *function, const char *output_path) {
+	FILE *file = fopen(output_path, "wb");
+	if (!file) {
+		printf("Could not open file %s\n", output_path);
+		exit(74);
+	}
+	bool ok = bytecode_write(OBJ_VAL(function), file);
+	if (fclose(file) != 0 || !ok) {
+		printf("Could not write file %s\n", output_path);
+		exit(74);
+	}
+}
 
-	Function *function = try_compile(src);
+// Defines the globals a snapshot() left in the image at `path`.
+static void load_image(const char *path, BytecodeImage *image) {
+	Value root;
+	if (!bytecode_load(path, image, &root)) {
+		exit(65);
+	}
+	if (!IS_DICT(root)) {
+		printf("%s is not a snapshot\n", path);
+		exit(65);
+	}
+	Table *globals = &AS_DICT(root)->table;
+	for (size_t i = 0; i < globals->capacity; i++) {
+		Entry *entry = &globals->entries[i];
+		if (entry->key != NULL && !IS_NIL(entry->value)) {
+			table_set(&vm.globals, entry->key, entry->value);
+		}
+	}
+}
 
+static void run_file(const char *path, const char *output_path, CompileMode mode, BytecodeImage *image) {
+	Function *function;
+	char *src = NULL;
+	if (bytecode_detect(path)) {
+		// Runs straight from the mapped file: no scanning, no compiling.
+		Value root;
+		if (!bytecode_load(path, image, &root)) {
+			exit(65);
+		}
+		if (!IS_FUNCTION(root)) {
+			printf("%s is a snapshot; start from it with --image\n", path);
+			exit(65);
+		}
+		function = AS_FUNCTION(root);
+	} else {
+		src = read_file(path);
+		size_t length = strlen(src);
+		function = output_path ? NULL : cache_load(src, length, image);
+		if (!function && (output_path || mode == COMPILE_EAGER)) {
+			function = try_compile(src, false);
+			if (!output_path) {
+				cache_store(src, length, function);
+			}
+		} else if (!function) {
+			// Only whole scripts are cached, and compiling all of this one
+			// is what being lazy avoids.
+			function = try_compile(src, true);
+			if (mode == COMPILE_PIPELINED) {
+				pipeline_start(function);
+			}
+		}
+	}
 	if (output_path) {
-		// FILE *file = fopen(output_path, "wb");
-		// if (!file) {
-		// 	printf("Could not open file %s\n", output_path);
-		// 	exit(74);
-		// }
-		// char *magic = "CLOX";
-		// Chunk chunk = function->chunk;
-		// TODO: figure out how to write const strings to/from bytecode file,
-		// transition from constants array to static segment in code.
-		// size_t buf_size =
-		// 	4 // magic
-		// 	+ 1 // code size
-		// 	+ 1 // debug info size
-		// 	+ 1 // constants size
-		// 	+ chunk.count // code
-		// 	+ (chunk.lines.count * sizeof(Line)) // debug info
-		// 	+ (chunk.constants.count * sizeof(Value)) // constants
-		// 	;
-		// fclose(file);
+		write_bytecode(function, output_path);
+		free(src);
+		return;
 	}
 
 	InterpretResult res = vm_interpret(function);
+	// The compiler thread may still be reading the source.
+	pipeline_stop();
 	free(src);
 
 	if (res == INTERPRET_COMPILE_ERROR) exit(65);
@@ -94,6 +150,10 @@ int main(int argc, const char *argv[]) {
 
 	const char *input = NULL;
 	const char *output = NULL;
+	const char *snapshot = NULL;
+	CompileMode mode = COMPILE_EAGER;
+	BytecodeImage image = { 0 };
+	BytecodeImage snapshot_image = { 0 };
 	bool error = false;
 	switch(argc) {
 	case 1:
@@ -101,7 +161,18 @@ int main(int argc, const char *argv[]) {
 		break;
 	default:
 		for (int i = 1; i < argc; i++) {
-			if (strncmp(argv[i], "-o", 2) == 0 || strncmp(argv[i], "--output", 8) == 0) {
+			if (strcmp(argv[i], "--lazy") == 0) {
+				mode = COMPILE_LAZY;
+			} else if (strcmp(argv[i], "--pipeline") == 0) {
+				mode = COMPILE_PIPELINED;
+			} else if (strcmp(argv[i], "--image") == 0) {
+				snapshot = argv[++i];
+				if (snapshot == NULL) {
+					error = true;
+					printf("Missing image file name\n");
+					break;
+				}
+			} else if (strncmp(argv[i], "-o", 2) == 0 || strncmp(argv[i], "--output", 8) == 0) {
 				output = argv[++i];
 				if (output == NULL) {
 					error = true;
@@ -125,16 +196,31 @@ int main(int argc, const char *argv[]) {
 			printf(
 				"Usage: clox [path]\n"
 				"\n"
-				"  -o --output <file> Output bytecode\n"
+				"  -o --output <file> Compile to a bytecode file instead of running\n"
+				"  --image <file>     Start with the globals from a snapshot() image\n"
+				"  --lazy             Compile functions when they're first called\n"
+				"  --pipeline         Compile functions on another thread as the script runs\n"
 				);
 			break;
 		} else {
-			run_file(input, output);
+			if (snapshot != NULL) {
+				load_image(snapshot, &snapshot_image);
+			}
+			run_file(input, output, mode, &image);
 		}
 		break;
 	}
 
+	// Only for the main interpreter: isolates and the pipeline's compiler
+	// free theirs too.
+	const char *print_stats = getenv("CLOX_GC_STATS");
+	if (print_stats != NULL && print_stats[0] != '\0' && print_stats[0] != '0') {
+		gc_print_stats(stderr);
+	}
 	vm_free();
+	// Strings from the image were in use until now.
+	bytecode_unload(&image);
+	bytecode_unload(&snapshot_image);
 
 	return 0;
 }
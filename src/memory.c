@@ -1,7 +1,9 @@
 #include <stdlib.h>
+#include <time.h>
 
 #include "memory.h"
 #include "compiler.h"
+#include "heap.h"
 #include "value.h"
 #include "vm.h"
 #include "repl.h"
@@ -10,7 +12,141 @@
 #include <stdio.h>
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+#define GC_DEFAULT_OVERHEAD 0.10
+#define GC_DEFAULT_MIN_HEAP (1024 * 1024)
+// Bounds on the headroom, as a fraction of the live heap. Measurements are
+// noisy, so don't let a single odd cycle make the heap explode or thrash.
+#define GC_MIN_HEADROOM 0.25
+#define GC_MAX_HEADROOM 8.0
+// Near the soft limit the heap may get tighter than GC_MIN_HEADROOM, but
+// never so tight that the program does nothing but collect.
+#define GC_LIMIT_HEADROOM 0.0625
+// Weight of the newest cycle in the smoothed measurements.
+#define GC_SMOOTHING 0.5
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+size_t env_size(const char *name, size_t fallback) {
+	const char *value = getenv(name);
+	if (value == NULL || value[0] == '\0') {
+		return fallback;
+	}
+	char *end;
+	double size = strtod(value, &end);
+	switch (*end) {
+	case 'k':
+	case 'K':
+		size *= 1024;
+		break;
+	case 'm':
+	case 'M':
+		size *= 1024 * 1024;
+		break;
+	case 'g':
+	case 'G':
+		size *= 1024.0 * 1024 * 1024;
+		break;
+	default:
+		break;
+	}
+	return size > 0 ? (size_t)size : fallback;
+}
+
+void gc_init() {
+	GcPacer *pacer = &vm.gc_pacer;
+	const char *overhead = getenv("CLOX_GC_OVERHEAD");
+	pacer->target_overhead = GC_DEFAULT_OVERHEAD;
+	if (overhead != NULL) {
+		double percent = strtod(overhead, NULL);
+		if (percent > 0 && percent < 100) {
+			pacer->target_overhead = percent / 100;
+		}
+	}
+	pacer->min_heap = env_size("CLOX_GC_MIN_HEAP", GC_DEFAULT_MIN_HEAP);
+	pacer->soft_limit = env_size("CLOX_GC_LIMIT", 0);
+
+	const char *compact = getenv("CLOX_GC_COMPACT");
+	pacer->compact_threshold = compact != NULL && compact[0] != '\0'
+	                           ? strtod(compact, NULL) / 100 : -1;
+	pacer->compact_pending = false;
+
+	// Hand what sweeping frees, and empty pages, to a background thread.
+	const char *reclaimer = getenv("CLOX_GC_RECLAIMER");
+	if (reclaimer != NULL && reclaimer[0] != '\0' && reclaimer[0] != '0') {
+		heap_start_reclaimer(&vm.heap);
+	}
+
+	pacer->alloc_rate = 0;
+	pacer->mark_ns = 0;
+	pacer->last_end_ns = now_ns();
+	pacer->live_after_last = 0;
+
+	vm.next_gc = pacer->min_heap;
+	vm.gc_stats = (GcStats){ 0 };
+}
+
+void gc_never_compact() {
+	vm.gc_pacer.compact_threshold = -1;
+	vm.gc_pacer.compact_pending = false;
+}
+
+void gc_after_fork() {
+	heap_after_fork(&vm.heap);
+	// Moving an object writes to the page it leaves and every page that
+	// points to it.
+	gc_never_compact();
+	// The collection before the fork left the pacer's threshold where it
+	// should be. Deferring the child's first collection wouldn't keep more
+	// pages shared: marking only writes to page descriptors, and sweeping
+	// skips the inherited pages.
+	vm.gc_pacer.last_end_ns = now_ns();
+}
+
+// With the program allocating `a` bytes per ns and marking taking `c` ns,
+// headroom `h` buys h / a ns of mutator time per c ns of marking, so the
+// target overhead t is met with h = a * c * (1 - t) / t.
+//
+// Only marking is paced. Sweeping costs the same per dead object however
+// rarely it runs, so a bigger heap can't buy it down; it only spreads the
+// program's allocations over more memory.
+static size_t next_threshold(size_t live, uint64_t start, uint64_t mark_ns, uint64_t end, size_t before) {
+	GcPacer *pacer = &vm.gc_pacer;
+
+	uint64_t mutator_ns = start - pacer->last_end_ns;
+	size_t allocated = before > pacer->live_after_last ? before - pacer->live_after_last : 0;
+	double rate = mutator_ns > 0 ? (double)allocated / mutator_ns : 0;
+	if (pacer->mark_ns == 0) {
+		pacer->alloc_rate = rate;
+		pacer->mark_ns = (double)mark_ns;
+	} else {
+		pacer->alloc_rate += GC_SMOOTHING * (rate - pacer->alloc_rate);
+		pacer->mark_ns += GC_SMOOTHING * ((double)mark_ns - pacer->mark_ns);
+	}
+	pacer->last_end_ns = end;
+	pacer->live_after_last = live;
+
+	double t = pacer->target_overhead;
+	double headroom = pacer->alloc_rate * pacer->mark_ns * (1 - t) / t;
+	if (headroom < live * GC_MIN_HEADROOM) {
+		headroom = live * GC_MIN_HEADROOM;
+	} else if (headroom > live * GC_MAX_HEADROOM) {
+		headroom = live * GC_MAX_HEADROOM;
+	}
+
+	size_t next = live + (size_t)headroom;
+	if (pacer->soft_limit != 0 && next > pacer->soft_limit) {
+		size_t tightest = live + (size_t)(live * GC_LIMIT_HEADROOM);
+		next = pacer->soft_limit > tightest ? pacer->soft_limit : tightest;
+	}
+	if (next < pacer->min_heap) {
+		next = pacer->min_heap;
+	}
+	return next;
+}
 
 void *reallocate(void *ptr, size_t old_size, size_t new_size) {
 	vm.bytes_allocated += new_size - old_size;
@@ -20,26 +156,39 @@ void *reallocate(void *ptr, size_t old_size, size_t new_size) {
 		collect_garbage();
 	}
 #else
-	if (vm.bytes_allocated > vm.next_gc) {
+	// Only collect when growing: sweeping frees through here as well.
+	if (new_size > old_size && vm.bytes_allocated > vm.next_gc) {
 		collect_garbage();
 	}
 #endif
 
 	if (new_size == 0) {
-		free(ptr);
+		heap_release(&vm.heap, ptr, old_size);
 		return NULL;
 	}
-	void *rv = realloc(ptr, new_size);
-	if (rv == NULL) {
-		exit(1);
-	}
-	return rv;
+	return heap_realloc(&vm.heap, ptr, old_size, new_size);
 }
 
-static void free_object(Object *obj) {
-	if (obj == NULL) {
-		return;
+void *allocate_object_memory(size_t size) {
+	vm.bytes_allocated += size;
+
+#ifdef DEBUG_STRESS_GC
+	collect_garbage();
+#else
+	if (vm.bytes_allocated > vm.next_gc) {
+		collect_garbage();
 	}
+#endif
+
+	return heap_alloc_object(&vm.heap, size);
+}
+
+// The heap reclaims the object's slot itself once this returns, so only the
+// memory hanging off the object is freed here.
+#define FREE_OBJECT(type, pointer) (vm.bytes_allocated -= sizeof(type))
+
+static void free_object(void *ptr) {
+	Object *obj = (Object *)ptr;
 #ifdef DEBUG_LOG_GC
 	printf("%p free type %s\n", (void *)obj, object_type_name(object_type(obj)));
 #endif
@@ -50,53 +199,69 @@ static void free_object(Object *obj) {
 		if (object_is_owned(obj)) {
 			FREE_ARRAY(char, str->chars, str->length + 1);
 		}
-		FREE(String, obj);
+		FREE_OBJECT(String, obj);
 		break;
 	}
 	case OBJ_COROUTINE: {
-		Coroutine *coro = (Coroutine *)obj;
-		FREE_ARRAY(Value, coro->stack, coro->stack_size);
-		FREE_ARRAY(CallFrame, coro->frames, coro->frame_capacity);
-		FREE(Coroutine, obj);
+		coroutine_free((Coroutine *)obj);
+		FREE_OBJECT(Coroutine, obj);
+		break;
+	}
+	case OBJ_CHANNEL: {
+		Channel *channel = (Channel *)obj;
+		FREE_ARRAY(Value, channel->values, channel->capacity);
+		wait_queue_free(&channel->senders);
+		wait_queue_free(&channel->receivers);
+		FREE_OBJECT(Channel, obj);
 		break;
 	}
 	case OBJ_CLOSURE: {
 		Closure *closure = (Closure*)obj;
 		FREE_ARRAY(Upvalue*, closure->upvalues, closure->upvalue_count);
-		FREE(Closure, obj);
+		FREE_OBJECT(Closure, obj);
 		break;
 	}
 	case OBJ_FUNCTION: {
 		Function *fn = (Function *)obj;
 		chunk_free(&fn->chunk);
-		FREE(Function, obj);
+		compile_body_free(fn);
+		FREE_OBJECT(Function, obj);
 		break;
 	}
 	case OBJ_UPVALUE: {
-		FREE(Upvalue,obj);
+		FREE_OBJECT(Upvalue, obj);
 		break;
 	}
 	case OBJ_NATIVE: {
-		FREE(NativeFunction, obj);
+		FREE_OBJECT(NativeFunction, obj);
 		break;
 	}
 	case OBJ_LIST: {
 		List *list = (List *)obj;
 		value_array_free(&list->values);
-		FREE(List, obj);
+		FREE_OBJECT(List, obj);
 		break;
 	}
 	case OBJ_DICT: {
 		Dictionary *dict = (Dictionary *)obj;
 		table_free(&dict->table);
-		FREE(Dictionary, obj);
+		FREE_OBJECT(Dictionary, obj);
 		break;
 	}
 	}
 }
 
 void mark_object(Object *obj) {
-	if (obj == NULL || object_is_marked(obj) == vm.mark_value) {
+	if (obj == NULL) {
+		return;
+	}
+	if (heap_is_shared(obj)) {
+		// Frozen objects only point at each other, so there's nothing to
+		// trace; just note the segment is still in use.
+		segment_mark(&vm.segments, obj);
+		return;
+	}
+	if (heap_mark(obj)) {
 		return;
 	}
 
@@ -104,11 +269,6 @@ void mark_object(Object *obj) {
 	printf("%p mark ", (void *)obj);
 	value_println(OBJ_VAL(obj));
 #endif
-	if (vm.mark_value) {
-		object_mark(obj);
-	} else {
-		object_unmark(obj);
-	}
 
 	if (vm.gray_capacity < vm.gray_count + 1) {
 		vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
@@ -131,14 +291,23 @@ void mark_value(Value value) {
 static void mark_roots() {
 	mark_object((Object *)vm.running);
 
-	for (Upvalue *upvalue = vm.open_upvalues; upvalue!= NULL; upvalue = upvalue->next) {
-		mark_object((Object *)upvalue);
-	}
-
 	table_mark(&vm.globals);
 
 	compiler_mark_roots();
 	repl_mark_roots();
+	loop_mark_roots(&vm.loop);
+	mark_object((Object *)vm.resume_base);
+	for (size_t i = 0; i < vm.resume_nesting; i++) {
+		mark_object((Object *)vm.resume_bases[i]);
+	}
+}
+
+static void mark_wait_queue(WaitQueue *queue) {
+	for (size_t i = 0; i < queue->count; i++) {
+		ChannelWaiter *waiter = &queue->waiters[(queue->head + i) & (queue->capacity - 1)];
+		mark_object((Object *)waiter->task);
+		mark_value(waiter->value);
+	}
 }
 
 static void mark_array(ValueArray *array) {
@@ -147,6 +316,42 @@ static void mark_array(ValueArray *array) {
 	}
 }
 
+// Marks the slots of `frame` up to `end`, except for the locals its stack
+// map says are dead. Returns whether any of those still refer to an object,
+// which this collection may free (see clear_stale_slots).
+static bool mark_frame(CallFrame *frame, Value *end) {
+	Chunk *chunk = &frame->closure->function->chunk;
+	uint32_t local_count = 0;
+	const uint64_t *live = stack_maps_find(&chunk->stack_maps,
+	                                       (uint32_t)(frame->ip - chunk->code), &local_count);
+	Value *slot = frame->slots;
+	bool stale = false;
+	if (live != NULL) {
+		for (uint32_t i = 0; i < local_count && slot < end; i++, slot++) {
+			if (live[i / 64] & ((uint64_t)1 << (i % 64))) {
+				mark_value(*slot);
+			} else if (IS_OBJ(*slot)) {
+				stale = true;
+			}
+		}
+	}
+	for (; slot < end; slot++) {
+		mark_value(*slot);
+	}
+	return stale;
+}
+
+static void add_stale_stack(Coroutine *coroutine) {
+	if (vm.stale_capacity < vm.stale_count + 1) {
+		vm.stale_capacity = GROW_CAPACITY(vm.stale_capacity);
+		vm.stale_stacks = (Coroutine **)realloc(vm.stale_stacks, sizeof(Coroutine *) * vm.stale_capacity);
+		if (vm.stale_stacks == NULL) {
+			exit(1);
+		}
+	}
+	vm.stale_stacks[vm.stale_count++] = coroutine;
+}
+
 static void blacken_object(Object *obj) {
 #ifdef DEBUG_LOG_GC
 	printf("%p blacken ", (void *)obj);
@@ -173,12 +378,35 @@ static void blacken_object(Object *obj) {
 		if (coroutine->parent != NULL) {
 			mark_object((Object *)coroutine->parent);
 		}
+		if (coroutine->closure != NULL) {
+			mark_object((Object *)coroutine->closure);
+		}
+		for (Upvalue *upvalue = coroutine->open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+			mark_object((Object *)upvalue);
+		}
+		Value *slot = coroutine->stack;
+		bool stale = false;
 		for (size_t i = 0; i < coroutine->frame_count; i++) {
 			mark_object((Object *)coroutine->frames[i].closure);
+			if (coroutine->frames[i].generator != NULL) {
+				mark_object((Object *)coroutine->frames[i].generator);
+			}
+			Value *end = i + 1 < coroutine->frame_count
+			             ? coroutine->frames[i + 1].slots : coroutine->stack_top;
+			for (; slot < coroutine->frames[i].slots; slot++) {
+				mark_value(*slot);
+			}
+			if (slot < end) {
+				stale |= mark_frame(&coroutine->frames[i], end);
+				slot = end;
+			}
 		}
-		for (Value *slot = coroutine->stack; slot < coroutine->stack_top; slot++) {
+		for (; slot < coroutine->stack_top; slot++) {
 			mark_value(*slot);
 		}
+		if (stale) {
+			add_stale_stack(coroutine);
+		}
 		break;
 	}
 	case OBJ_UPVALUE:
@@ -190,6 +418,15 @@ static void blacken_object(Object *obj) {
 	case OBJ_DICT:
 		table_mark(&((Dictionary *)obj)->table);
 		break;
+	case OBJ_CHANNEL: {
+		Channel *channel = (Channel *)obj;
+		for (size_t i = 0; i < channel->count; i++) {
+			mark_value(channel->values[(channel->head + i) & (channel->capacity - 1)]);
+		}
+		mark_wait_queue(&channel->senders);
+		mark_wait_queue(&channel->receivers);
+		break;
+	}
 	case OBJ_STRING:
 	case OBJ_NATIVE:
 		break;
@@ -203,26 +440,72 @@ static void trace_references() {
 	}
 }
 
-static void sweep() {
-	Object *prev = NULL;
-	Object *obj = vm.objects;
-	while (obj != NULL) {
-		if (object_is_marked(obj) == vm.mark_value) {
-			prev = obj;
-			obj = object_next(obj);
-		} else {
-			Object *unreached = obj;
-			obj = object_next(obj);
+// Whether sweeping is about to free `obj`, or let go of the segment it's
+// frozen in. It leaves the objects of pages a forked child inherited where
+// they are.
+static bool is_dying(Object *obj) {
+	HeapPage *page = heap_page_of(obj);
+	if (page->shared) {
+		return !segment_is_seen(&vm.segments, obj);
+	}
+	return !page->inherited && !heap_is_marked(obj);
+}
 
-			if (prev != NULL) {
-				object_set_next(prev, obj);
-			} else {
-				vm.objects = obj;
-			}
+// Clears the dead locals of `frame` that refer to objects this collection
+// frees, and no others.
+static void clear_stale_frame(CallFrame *frame, Value *end) {
+	Chunk *chunk = &frame->closure->function->chunk;
+	uint32_t local_count = 0;
+	const uint64_t *live = stack_maps_find(&chunk->stack_maps,
+	                                       (uint32_t)(frame->ip - chunk->code), &local_count);
+	if (live == NULL) {
+		return;
+	}
+	Value *slot = frame->slots;
+	for (uint32_t i = 0; i < local_count && slot < end; i++, slot++) {
+		if (!(live[i / 64] & ((uint64_t)1 << (i % 64))) && IS_OBJ(*slot) && is_dying(AS_OBJ(*slot))) {
+			*slot = NIL_VAL;
+		}
+	}
+}
 
-			free_object(unreached);
+// Dead locals aren't marked, so once their objects are freed nothing that
+// walks the stacks afterwards (compaction, suspending a stackless coroutine,
+// the trace output) may run into them. Marking doesn't write to the heap,
+// so this is done after it, and only where an object is about to go: stacks
+// inherited by fork_workers children stay shared.
+static void clear_stale_slots() {
+	for (size_t n = 0; n < vm.stale_count; n++) {
+		Coroutine *coroutine = vm.stale_stacks[n];
+		for (size_t i = 0; i < coroutine->frame_count; i++) {
+			Value *end = i + 1 < coroutine->frame_count
+			             ? coroutine->frames[i + 1].slots : coroutine->stack_top;
+			clear_stale_frame(&coroutine->frames[i], end);
 		}
 	}
+	vm.stale_count = 0;
+}
+
+static void sweep() {
+	heap_sweep(&vm.heap, free_object);
+}
+
+static void record_pause(uint64_t pause_ns, uint64_t mark_ns, size_t freed) {
+	GcStats *stats = &vm.gc_stats;
+	stats->collections++;
+	stats->pause_total_ns += pause_ns;
+	stats->mark_total_ns += mark_ns;
+	if (pause_ns > stats->pause_max_ns) {
+		stats->pause_max_ns = pause_ns;
+	}
+	stats->bytes_freed += freed;
+
+	uint64_t us = pause_ns / 1000;
+	size_t bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+	if (bucket >= GC_PAUSE_BUCKETS) {
+		bucket = GC_PAUSE_BUCKETS - 1;
+	}
+	stats->pause_histogram[bucket]++;
 }
 
 void collect_garbage() {
@@ -230,18 +513,28 @@ void collect_garbage() {
 	printf("-- gc begin\n");
 #endif
 	size_t before = vm.bytes_allocated;
+	uint64_t start = now_ns();
 
 	mark_roots();
 	trace_references();
+	uint64_t marked = now_ns();
+	clear_stale_slots();
 	table_remove_white(&vm.strings);
+	coroutine_pool_trim(&vm.coroutine_pool);
 	sweep();
+	segment_sweep(&vm.segments);
 
-	// Don't increase the threshold if no memory was freed.
-	if (vm.bytes_allocated < before) {
-		vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
-	}
+	uint64_t end = now_ns();
+	record_pause(end - start, marked - start, before - vm.bytes_allocated);
+	vm.next_gc = next_threshold(vm.bytes_allocated, start, marked - start, end, before);
 
-	vm.mark_value = !vm.mark_value;
+	if (vm.gc_pacer.compact_threshold >= 0) {
+		size_t holes;
+		double fragmentation = heap_fragmentation(&vm.heap, &holes);
+		// Moving everything to win back less than a page isn't worth it.
+		vm.gc_pacer.compact_pending = fragmentation > vm.gc_pacer.compact_threshold
+		                              && holes >= HEAP_PAGE_SIZE;
+	}
 
 #ifdef DEBUG_LOG_GC
 	printf("-- gc end\n");
@@ -252,13 +545,237 @@ void collect_garbage() {
 #endif
 }
 
-void free_objects() {
-	Object *obj = vm.objects;
-	while (obj) {
-		Object *next = object_next(obj);
-		free_object(obj);
-		obj = next;
+Object *gc_forward(Object *obj) {
+	if (obj == NULL) {
+		return NULL;
+	}
+	return (Object *)heap_forward(obj);
+}
+
+void gc_forward_value(Value *value) {
+	if (IS_OBJ(*value)) {
+		*value = OBJ_VAL(gc_forward(AS_OBJ(*value)));
+	}
+}
+
+static void forward_wait_queue(WaitQueue *queue) {
+	for (size_t i = 0; i < queue->count; i++) {
+		ChannelWaiter *waiter = &queue->waiters[(queue->head + i) & (queue->capacity - 1)];
+		waiter->task = (Coroutine *)gc_forward((Object *)waiter->task);
+		gc_forward_value(&waiter->value);
 	}
-	vm.objects = NULL;
+}
+
+static void forward_array(ValueArray *array) {
+	for (size_t i = 0; i < array->count; i++) {
+		gc_forward_value(&array->values[i]);
+	}
+}
+
+// Points every reference held by the object at the new copies.
+static void forward_references(void *ptr, void *ctx) {
+	Object *obj = (Object *)ptr;
+	switch (object_type(obj)) {
+	case OBJ_FUNCTION: {
+		Function *fn = (Function *)obj;
+		fn->name = (String *)gc_forward((Object *)fn->name);
+		forward_array(&fn->chunk.constants);
+		break;
+	}
+	case OBJ_CLOSURE: {
+		Closure *closure = (Closure *)obj;
+		closure->function = (Function *)gc_forward((Object *)closure->function);
+		for (size_t i = 0; i < closure->upvalue_count; i++) {
+			closure->upvalues[i] = (Upvalue *)gc_forward((Object *)closure->upvalues[i]);
+		}
+		break;
+	}
+	case OBJ_COROUTINE: {
+		Coroutine *coroutine = (Coroutine *)obj;
+		coroutine->parent = (Coroutine *)gc_forward((Object *)coroutine->parent);
+		coroutine->closure = (Closure *)gc_forward((Object *)coroutine->closure);
+		coroutine->open_upvalues = (Upvalue *)gc_forward((Object *)coroutine->open_upvalues);
+		for (size_t i = 0; i < coroutine->frame_count; i++) {
+			CallFrame *frame = &coroutine->frames[i];
+			frame->closure = (Closure *)gc_forward((Object *)frame->closure);
+			frame->generator = (Coroutine *)gc_forward((Object *)frame->generator);
+		}
+		for (Value *slot = coroutine->stack; slot < coroutine->stack_top; slot++) {
+			gc_forward_value(slot);
+		}
+		break;
+	}
+	case OBJ_UPVALUE: {
+		Upvalue *upvalue = (Upvalue *)obj;
+		gc_forward_value(&upvalue->closed);
+		upvalue->next = (Upvalue *)gc_forward((Object *)upvalue->next);
+		break;
+	}
+	case OBJ_LIST:
+		forward_array(&((List *)obj)->values);
+		break;
+	case OBJ_DICT:
+		table_forward(&((Dictionary *)obj)->table);
+		break;
+	case OBJ_CHANNEL: {
+		Channel *channel = (Channel *)obj;
+		for (size_t i = 0; i < channel->count; i++) {
+			gc_forward_value(&channel->values[(channel->head + i) & (channel->capacity - 1)]);
+		}
+		forward_wait_queue(&channel->senders);
+		forward_wait_queue(&channel->receivers);
+		break;
+	}
+	case OBJ_STRING:
+	case OBJ_NATIVE:
+		break;
+	}
+}
+
+static void object_moved(void *from, void *to) {
+	Object *obj = (Object *)to;
+	if (object_type(obj) == OBJ_UPVALUE) {
+		// A closed upvalue points at its own `closed` field.
+		Upvalue *upvalue = (Upvalue *)to;
+		if (upvalue->location == &((Upvalue *)from)->closed) {
+			upvalue->location = &upvalue->closed;
+		}
+	} else if (object_type(obj) == OBJ_COROUTINE) {
+		// So can a suspended stackless coroutine's stack.
+		Coroutine *coroutine = (Coroutine *)to;
+		Value *old = ((Coroutine *)from)->inline_slots;
+		if (coroutine->stack == old) {
+			coroutine->stack = coroutine->inline_slots;
+			coroutine->stack_top = coroutine->inline_slots + (coroutine->stack_top - old);
+		}
+	}
+	vm.gc_stats.bytes_moved += heap_page_of(to)->slot_size;
+}
+
+// Moves the objects off the sparsest pages and unmaps them. Must only be
+// called at a safepoint: every pointer to an object has to be reachable
+// from the roots below, none may be sitting in a C local.
+void gc_compact() {
+	vm.gc_pacer.compact_pending = false;
+	if (heap_evacuate(&vm.heap, object_moved) == 0) {
+		return;
+	}
+
+	vm.running = (Coroutine *)gc_forward((Object *)vm.running);
+	vm.main = (Coroutine *)gc_forward((Object *)vm.main);
+	vm.resume_base = (Coroutine *)gc_forward((Object *)vm.resume_base);
+	for (size_t i = 0; i < vm.resume_nesting; i++) {
+		vm.resume_bases[i] = (Coroutine *)gc_forward((Object *)vm.resume_bases[i]);
+	}
+	table_forward(&vm.globals);
+	table_forward(&vm.strings);
+	compiler_forward_roots();
+	repl_forward_roots();
+	loop_forward_roots(&vm.loop);
+
+	heap_each_object(&vm.heap, forward_references, NULL);
+	heap_release_evacuated(&vm.heap);
+	vm.gc_stats.compactions++;
+}
+
+static void finalize_object(void *ptr, void *ctx) {
+	free_object(ptr);
+}
+
+void free_objects() {
+	heap_each_object(&vm.heap, finalize_object, NULL);
 	free(vm.gray_stack);
+	free(vm.stale_stacks);
+}
+
+// Bytes held by an object, including the buffers it owns.
+static size_t object_size(Object *obj) {
+	switch (object_type(obj)) {
+	case OBJ_STRING: {
+		String *str = (String *)obj;
+		return sizeof(String) + (object_is_owned(obj) ? str->length + 1 : 0);
+	}
+	case OBJ_FUNCTION: {
+		Chunk *chunk = &((Function *)obj)->chunk;
+		return sizeof(Function) + chunk->capacity
+		       + chunk->constants.capacity * sizeof(Value)
+		       + chunk->lines.capacity
+		       + chunk->lines.checkpoint_capacity * sizeof(LineCheckpoint);
+	}
+	case OBJ_CLOSURE:
+		return sizeof(Closure) + ((Closure *)obj)->upvalue_count * sizeof(Upvalue *);
+	case OBJ_UPVALUE:
+		return sizeof(Upvalue);
+	case OBJ_NATIVE:
+		return sizeof(NativeFunction);
+	case OBJ_LIST:
+		return sizeof(List) + ((List *)obj)->values.capacity * sizeof(Value);
+	case OBJ_DICT:
+		return sizeof(Dictionary) + ((Dictionary *)obj)->table.capacity * sizeof(Entry);
+	case OBJ_COROUTINE: {
+		Coroutine *coro = (Coroutine *)obj;
+		return sizeof(Coroutine) + coro->stack_size * sizeof(Value)
+		       + coro->frame_capacity * sizeof(CallFrame);
+	}
+	case OBJ_CHANNEL: {
+		Channel *channel = (Channel *)obj;
+		return sizeof(Channel) + channel->capacity * sizeof(Value)
+		       + (channel->senders.capacity + channel->receivers.capacity) * sizeof(ChannelWaiter);
+	}
+	}
+	return 0;
+}
+
+static void count_object(void *ptr, void *ctx) {
+	GcObjectStats *stats = (GcObjectStats *)ctx;
+	Object *obj = (Object *)ptr;
+	stats->count[object_type(obj)]++;
+	stats->bytes[object_type(obj)] += object_size(obj);
+}
+
+void gc_object_stats(GcObjectStats *stats) {
+	for (size_t i = 0; i < OBJ_TYPE_COUNT; i++) {
+		stats->count[i] = 0;
+		stats->bytes[i] = 0;
+	}
+	heap_each_object(&vm.heap, count_object, stats);
+}
+
+void gc_print_stats(FILE *out) {
+	GcStats *stats = &vm.gc_stats;
+	fprintf(out, "-- gc stats\n");
+	fprintf(out, "   collections: %zu\n", stats->collections);
+	fprintf(out, "   pause total: %.3fms (marking %.3fms), max: %.3fms\n",
+	        stats->pause_total_ns / 1e6, stats->mark_total_ns / 1e6,
+	        stats->pause_max_ns / 1e6);
+	fprintf(out, "   allocated: %zu bytes, freed: %zu bytes, live: %zu bytes\n",
+	        stats->bytes_freed + vm.bytes_allocated, stats->bytes_freed,
+	        vm.bytes_allocated);
+	fprintf(out, "   compactions: %zu, moved: %zu bytes\n", stats->compactions,
+	        stats->bytes_moved);
+	fprintf(out, "   next gc: %zu, mapped: %zu bytes, reclaiming: %zu bytes\n",
+	        vm.next_gc, vm.heap.mapped_bytes, heap_reclaim_pending(&vm.heap));
+
+	for (size_t i = 0; i < GC_PAUSE_BUCKETS; i++) {
+		if (stats->pause_histogram[i] == 0) {
+			continue;
+		}
+		if (i == GC_PAUSE_BUCKETS - 1) {
+			fprintf(out, "   pause >= %8lluus: %zu\n",
+			        1ULL << (GC_PAUSE_BUCKETS - 2), stats->pause_histogram[i]);
+		} else {
+			fprintf(out, "   pause <  %8lluus: %zu\n", 1ULL << i,
+			        stats->pause_histogram[i]);
+		}
+	}
+
+	GcObjectStats objects;
+	gc_object_stats(&objects);
+	for (size_t i = 0; i < OBJ_TYPE_COUNT; i++) {
+		if (objects.count[i] == 0) {
+			continue;
+		}
+		fprintf(out, "   %-10s %8zu objects %10zu bytes\n",
+		        object_type_name((ObjectType)i), objects.count[i], objects.bytes[i]);
+	}
 }
@@ -15,11 +15,79 @@
 #define FREE_ARRAY(type, pointer, count)                                       \
   reallocate(pointer, sizeof(type) * (count), 0)
 
+// Pause histogram bucket i counts collections that took less than 2^i
+// microseconds; the last bucket counts everything longer.
+#define GC_PAUSE_BUCKETS 24
+
+typedef struct {
+  size_t collections;
+  uint64_t pause_total_ns;
+  uint64_t pause_max_ns;
+  uint64_t mark_total_ns;
+  size_t pause_histogram[GC_PAUSE_BUCKETS];
+  // Bytes handed back by sweeping. Together with `vm.bytes_allocated` this
+  // gives the total allocated over the lifetime of the VM.
+  size_t bytes_freed;
+  size_t compactions;
+  size_t bytes_moved;
+} GcStats;
+
+// Decides when the next collection happens. After every collection the
+// headroom above the live heap is sized so that marking takes roughly
+// `target_overhead` of the total run time, given how fast the program has
+// been allocating and how long collections have been taking.
+typedef struct {
+  // Fraction of run time the collector is allowed to use
+  // (CLOX_GC_OVERHEAD, in percent).
+  double target_overhead;
+  // The heap never triggers a collection below this (CLOX_GC_MIN_HEAP).
+  size_t min_heap;
+  // Collect more eagerly as the heap approaches this; 0 means no limit
+  // (CLOX_GC_LIMIT).
+  size_t soft_limit;
+
+  // Smoothed measurements from previous cycles.
+  double alloc_rate; // bytes per nanosecond of mutator time
+  double mark_ns;
+  uint64_t last_end_ns;
+  size_t live_after_last;
+
+  // Compact once more than this fraction of object page memory is holes
+  // (CLOX_GC_COMPACT, in percent); negative disables compaction.
+  double compact_threshold;
+  // Objects can only move while no C code holds on to them, so collections
+  // just set this and `vm_run` compacts at its next safepoint.
+  bool compact_pending;
+} GcPacer;
+
+// Live objects and the bytes they hold, by type. Walks the whole heap, so
+// the cost is only paid by whoever asks.
+typedef struct {
+  size_t count[OBJ_TYPE_COUNT];
+  size_t bytes[OBJ_TYPE_COUNT];
+} GcObjectStats;
+
+void gc_init();
+// Call in the child after a fork(), to keep the heap it shares with its
+// parent shared (see heap_after_fork).
+void gc_after_fork();
+// Turns compaction off for this isolate, whatever CLOX_GC_COMPACT says, so
+// that another isolate can copy out of its heap while it runs.
+void gc_never_compact();
+// Reads a size like "512K", "64M" or "2G" from the environment variable
+// `name`, or returns `fallback` if it isn't set.
+size_t env_size(const char *name, size_t fallback);
 void *reallocate(void *ptr, size_t old_size, size_t new_size);
+void *allocate_object_memory(size_t size);
 void mark_value(Value value);
 void mark_object(Object *object);
 void collect_garbage();
+void gc_compact();
+Object *gc_forward(Object *object);
+void gc_forward_value(Value *value);
 void free_objects();
+void gc_object_stats(GcObjectStats *stats);
+void gc_print_stats(FILE *out);
 
 #define ALLOCATE(type, count) (type *)reallocate(NULL, 0, count * sizeof(type))
 
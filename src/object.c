@@ -11,17 +11,12 @@
 	(type *)allocate_object(sizeof(type), obj_type, owned)
 
 static Object* allocate_object(size_t size, ObjectType type, bool owned) {
+	Object *obj = (Object *)allocate_object_memory(size);
+	obj->header = (uint64_t)owned << 9 | (uint64_t)type;
+
 #ifdef DEBUG_LOG_GC
-	printf("%p allocate %zu for %s\n", (void *)vm.objects, size, object_type_name(type));
+	printf("%p allocate %zu for %s\n", (void *)obj, size, object_type_name(type));
 #endif
-
-	Object *obj = (Object *)reallocate(NULL, 0, size);
-	// obj->header = (uint64_t)vm.objects | (uint64_t)type << 56 | (uint64_t)owned << 57;
-	obj->header = (uint64_t)vm.objects << 16
-	              | (uint64_t)owned << 9
-	              | (uint64_t)vm.mark_value << 8
-	              | (uint64_t)type;
-	vm.objects = obj;
 	return obj;
 }
 
@@ -43,6 +38,8 @@ const char *object_type_name(ObjectType type) {
 		return "upvalue";
 	case OBJ_COROUTINE:
 		return "coroutine";
+	case OBJ_CHANNEL:
+		return "channel";
 	}
 }
 
@@ -148,6 +145,9 @@ void object_fprint_indented(FILE *stream, Value val, int depth) {
 	case OBJ_COROUTINE:
 		printf("<coroutine>");
 		break;
+	case OBJ_CHANNEL:
+		printf("<channel>");
+		break;
 	case OBJ_LIST: {
 		ValueArray *list = &AS_LIST(val)->values;
 		size_t count = list->count;
@@ -212,6 +212,8 @@ Function *function_new() {
 	function->arity = 0;
 	function->name = NULL;
 	function->upvalue_count = 0;
+	function->stackless = false;
+	function->lazy = NULL;
 	chunk_init(&function->chunk);
 	return function;
 }
@@ -343,23 +345,138 @@ void dict_clear(Dictionary *dict) {
 	dict->table.count = 0;
 }
 
-Coroutine *coroutine_new(Closure *closure) {
-	Coroutine *coroutine = ALLOCATE_OBJ(Coroutine, OBJ_COROUTINE, true);
+Channel *channel_new(size_t limit) {
+	Channel *channel = ALLOCATE_OBJ(Channel, OBJ_CHANNEL, true);
+	channel->values = NULL;
+	channel->head = 0;
+	channel->count = 0;
+	channel->capacity = 0;
+	channel->limit = limit;
+	channel->closed = false;
+	channel->senders = (WaitQueue){ NULL, 0, 0, 0 };
+	channel->receivers = (WaitQueue){ NULL, 0, 0, 0 };
+	return channel;
+}
+
+// Both rings grow by allocating a new power-of-two buffer and unwrapping
+// the old contents to its start. The old buffer stays intact until the
+// copy is done, in case allocating collects.
+void channel_push(Channel *channel, Value value) {
+	if (channel->count == channel->capacity) {
+		size_t capacity = GROW_CAPACITY(channel->capacity);
+		Value *values = GROW_ARRAY(Value, NULL, 0, capacity);
+		for (size_t i = 0; i < channel->count; i++) {
+			values[i] = channel->values[(channel->head + i) & (channel->capacity - 1)];
+		}
+		FREE_ARRAY(Value, channel->values, channel->capacity);
+		channel->values = values;
+		channel->head = 0;
+		channel->capacity = capacity;
+	}
+	channel->values[(channel->head + channel->count++) & (channel->capacity - 1)] = value;
+}
 
-	coroutine->stack = NULL;
-	coroutine->stack = GROW_ARRAY(Value, coroutine->stack, 0, STACK_INITIAL);
-	coroutine->stack_size = STACK_INITIAL;
-	coroutine->stack_top = coroutine->stack;
+Value channel_shift(Channel *channel) {
+	if (channel->count == 0) {
+		return NIL_VAL;
+	}
+	Value value = channel->values[channel->head];
+	channel->head = (channel->head + 1) & (channel->capacity - 1);
+	channel->count--;
+	return value;
+}
+
+void wait_queue_push(WaitQueue *queue, Coroutine *task, Value value) {
+	if (queue->count == queue->capacity) {
+		size_t capacity = GROW_CAPACITY(queue->capacity);
+		ChannelWaiter *waiters = GROW_ARRAY(ChannelWaiter, NULL, 0, capacity);
+		for (size_t i = 0; i < queue->count; i++) {
+			waiters[i] = queue->waiters[(queue->head + i) & (queue->capacity - 1)];
+		}
+		FREE_ARRAY(ChannelWaiter, queue->waiters, queue->capacity);
+		queue->waiters = waiters;
+		queue->head = 0;
+		queue->capacity = capacity;
+	}
+	ChannelWaiter *waiter = &queue->waiters[(queue->head + queue->count++) & (queue->capacity - 1)];
+	waiter->task = task;
+	waiter->value = value;
+}
+
+ChannelWaiter wait_queue_shift(WaitQueue *queue) {
+	ChannelWaiter waiter = queue->waiters[queue->head];
+	queue->head = (queue->head + 1) & (queue->capacity - 1);
+	queue->count--;
+	return waiter;
+}
+
+void wait_queue_free(WaitQueue *queue) {
+	FREE_ARRAY(ChannelWaiter, queue->waiters, queue->capacity);
+	*queue = (WaitQueue){ NULL, 0, 0, 0 };
+}
 
-	coroutine->frames = NULL;
-	coroutine->frames = GROW_ARRAY(CallFrame, coroutine->frames, 0, FRAMES_INITIAL);
-	coroutine->frame_capacity = FRAMES_INITIAL;
+void coroutine_pool_init(CoroutinePool *pool) {
+	pool->stack_count = 0;
+	pool->frame_count = 0;
+	pool->stack_low = 0;
+	pool->frame_low = 0;
+}
+
+void coroutine_pool_trim(CoroutinePool *pool) {
+	// The first `low` buffers weren't touched since the last trim.
+	for (size_t i = 0; i < pool->stack_low; i++) {
+		FREE_ARRAY(Value, pool->stacks[i], STACK_INITIAL);
+	}
+	pool->stack_count -= pool->stack_low;
+	memmove(pool->stacks, pool->stacks + pool->stack_low, pool->stack_count * sizeof(Value *));
 
-	if (closure) {
+	for (size_t i = 0; i < pool->frame_low; i++) {
+		FREE_ARRAY(CallFrame, pool->frames[i], FRAMES_INITIAL);
+	}
+	pool->frame_count -= pool->frame_low;
+	memmove(pool->frames, pool->frames + pool->frame_low, pool->frame_count * sizeof(CallFrame *));
+
+	pool->stack_low = pool->stack_count;
+	pool->frame_low = pool->frame_count;
+}
+
+static Value *pool_take_stack(CoroutinePool *pool) {
+	if (pool->stack_count == 0) {
+		return GROW_ARRAY(Value, NULL, 0, STACK_INITIAL);
+	}
+	Value *stack = pool->stacks[--pool->stack_count];
+	if (pool->stack_count < pool->stack_low) {
+		pool->stack_low = pool->stack_count;
+	}
+	return stack;
+}
+
+static CallFrame *pool_take_frames(CoroutinePool *pool) {
+	if (pool->frame_count == 0) {
+		return GROW_ARRAY(CallFrame, NULL, 0, FRAMES_INITIAL);
+	}
+	CallFrame *frames = pool->frames[--pool->frame_count];
+	if (pool->frame_count < pool->frame_low) {
+		pool->frame_low = pool->frame_count;
+	}
+	return frames;
+}
+
+// Sets up the first frame to run the body from the top. Slot 0 holds the
+// coroutine itself, followed by the arguments.
+static void coroutine_arm(Coroutine *coroutine) {
+	coroutine->stack_top = coroutine->stack;
+	coroutine->generator_frames = 0;
+	if (coroutine->stackless) {
+		coroutine->resume_ip = coroutine->closure->function->chunk.code;
+		coroutine->frame_count = 0;
+		coroutine->current_frame = NULL;
+	} else if (coroutine->closure) {
 		CallFrame *frame = &coroutine->frames[0];
-		frame->closure = closure;
-		frame->ip = closure->function->chunk.code;
-		frame->slots = coroutine->stack_top - closure->function->arity + 1;
+		frame->closure = coroutine->closure;
+		frame->ip = coroutine->closure->function->chunk.code;
+		frame->slots = coroutine->stack;
+		frame->generator = NULL;
 
 		coroutine->frame_count = 1;
 		coroutine->current_frame = frame;
@@ -367,25 +484,155 @@ Coroutine *coroutine_new(Closure *closure) {
 		coroutine->frame_count = 0;
 		coroutine->current_frame = NULL;
 	}
+	coroutine->state = COROUTINE_READY;
+}
+
+Coroutine *coroutine_new(Closure *closure) {
+	// Stackless coroutines keep their slots inline until they need more.
+	bool stackless = closure != NULL && closure->function->stackless;
+
+	// Take the buffers first, so a collection triggered by allocating the
+	// object can't see a half-initialized coroutine.
+	Value *stack = stackless ? NULL : pool_take_stack(&vm.coroutine_pool);
+	CallFrame *frames = stackless ? NULL : pool_take_frames(&vm.coroutine_pool);
+
+	Coroutine *coroutine = ALLOCATE_OBJ(Coroutine, OBJ_COROUTINE, true);
+
+	coroutine->closure = closure;
+	coroutine->stackless = stackless;
+
+	coroutine->stack = stackless ? coroutine->inline_slots : stack;
+	coroutine->stack_size = stackless ? COROUTINE_INLINE_SLOTS : STACK_INITIAL;
+
+	coroutine->frames = frames;
+	coroutine->frame_capacity = stackless ? 0 : FRAMES_INITIAL;
+
+	coroutine->open_upvalues = NULL;
 
 	// parent will be set when the coroutine is started / resumed
 	coroutine->parent = NULL;
 
-	coroutine->state = COROUTINE_READY;
+	coroutine_arm(coroutine);
 
 	return coroutine;
 }
 
-void coroutine_push(Coroutine *coroutine, Value value) {
-	if (coroutine->stack_top - coroutine->stack >= coroutine->stack_size) {
-		size_t old_size = coroutine->stack_size;
-		size_t offset = coroutine->stack_top - coroutine->stack;
-		coroutine->stack_size = GROW_CAPACITY(old_size);
-		coroutine->stack = GROW_ARRAY(Value, coroutine->stack, old_size, coroutine->stack_size);
-		coroutine->stack_top = coroutine->stack + offset;
+static void release_stack(Coroutine *coroutine) {
+	CoroutinePool *pool = &vm.coroutine_pool;
+	if (coroutine->stack == coroutine->inline_slots) {
+		return;
+	}
+	if (coroutine->stack_size == STACK_INITIAL && pool->stack_count < COROUTINE_POOL_SIZE) {
+		pool->stacks[pool->stack_count++] = coroutine->stack;
+	} else {
+		FREE_ARRAY(Value, coroutine->stack, coroutine->stack_size);
+	}
+}
+
+static void release_frames(Coroutine *coroutine) {
+	CoroutinePool *pool = &vm.coroutine_pool;
+	if (coroutine->frame_capacity == FRAMES_INITIAL && pool->frame_count < COROUTINE_POOL_SIZE) {
+		pool->frames[pool->frame_count++] = coroutine->frames;
+	} else {
+		FREE_ARRAY(CallFrame, coroutine->frames, coroutine->frame_capacity);
 	}
+}
+
+void coroutine_free(Coroutine *coroutine) {
+	release_stack(coroutine);
+	release_frames(coroutine);
+}
+
+static size_t buffer_size(size_t initial, size_t needed) {
+	size_t size = initial;
+	while (size < needed) {
+		size = GROW_CAPACITY(size);
+	}
+	return size;
+}
+
+// Makes room for `size` values in an empty stack.
+static void reserve_stack(Coroutine *coroutine, size_t size) {
+	if (coroutine->stack_size >= size) {
+		return;
+	}
+	size_t new_size = buffer_size(STACK_INITIAL, size);
+	Value *stack = new_size == STACK_INITIAL ? pool_take_stack(&vm.coroutine_pool)
+	                                         : GROW_ARRAY(Value, NULL, 0, new_size);
+	release_stack(coroutine);
+	coroutine->stack = stack;
+	coroutine->stack_size = new_size;
+	coroutine->stack_top = stack;
+}
+
+static void reserve_frames(Coroutine *coroutine, size_t count) {
+	if (coroutine->frame_capacity >= count) {
+		return;
+	}
+	size_t new_capacity = buffer_size(FRAMES_INITIAL, count);
+	CallFrame *frames = new_capacity == FRAMES_INITIAL ? pool_take_frames(&vm.coroutine_pool)
+	                                                   : GROW_ARRAY(CallFrame, NULL, 0, new_capacity);
+	release_frames(coroutine);
+	coroutine->frames = frames;
+	coroutine->frame_capacity = new_capacity;
+}
+
+void coroutine_save(Coroutine *coroutine, Value *slots, size_t count, uint8_t *ip) {
+	// The slots are still on the caller's stack, so they stay rooted if this
+	// collects.
+	reserve_stack(coroutine, count);
+	for (size_t i = 0; i < count; i++) {
+		coroutine->stack[i] = slots[i];
+	}
+	coroutine->stack_top = coroutine->stack + count;
+	coroutine->resume_ip = ip;
+}
+
+void coroutine_make_stackful(Coroutine *coroutine, size_t values, size_t frames) {
+	// Leave the free slot coroutine_push relies on, and a spare frame.
+	reserve_stack(coroutine, values + 1);
+	reserve_frames(coroutine, frames + 1);
+	coroutine->stackless = false;
+}
+
+static void coroutine_grow_stack(Coroutine *coroutine) {
+	size_t old_size = coroutine->stack_size;
+	size_t new_size = GROW_CAPACITY(old_size);
+	// The old stack stays in place until everything pointing into it has been
+	// moved over; a collection triggered here still sees it.
+	Value *stack = GROW_ARRAY(Value, NULL, 0, new_size);
+	Value *old = coroutine->stack;
+	memcpy(stack, old, sizeof(Value) * old_size);
+
+	ptrdiff_t delta = stack - old;
+	for (size_t i = 0; i < coroutine->frame_count; i++) {
+		coroutine->frames[i].slots += delta;
+	}
+	for (Upvalue *upvalue = coroutine->open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+		upvalue->location += delta;
+	}
+
+	coroutine->stack = stack;
+	coroutine->stack_size = new_size;
+	coroutine->stack_top += delta;
+	FREE_ARRAY(Value, old, old_size);
+}
+
+void coroutine_reserve(Coroutine *coroutine, size_t count) {
+	// Keep the free slot above the reserved ones.
+	while (coroutine->stack_top + count >= coroutine->stack + coroutine->stack_size) {
+		coroutine_grow_stack(coroutine);
+	}
+}
+
+void coroutine_push(Coroutine *coroutine, Value value) {
+	// Store first and grow after, so the value is already rooted if growing
+	// triggers a collection.
 	*coroutine->stack_top = value;
 	coroutine->stack_top++;
+	if (coroutine->stack_top == coroutine->stack + coroutine->stack_size) {
+		coroutine_grow_stack(coroutine);
+	}
 }
 
 Value coroutine_pop(Coroutine *coroutine) {
@@ -398,9 +645,13 @@ Value coroutine_peek(Coroutine *coroutine, size_t distance) {
 }
 
 void coroutine_reset(Coroutine *coroutine) {
-	coroutine->stack_top = coroutine->stack;
-
-	coroutine->frame_count = 0;
-
-	coroutine->state = COROUTINE_READY;
+	// Closures that captured the old locals keep their last values.
+	while (coroutine->open_upvalues != NULL) {
+		Upvalue *upvalue = coroutine->open_upvalues;
+		upvalue->closed = *upvalue->location;
+		upvalue->location = &upvalue->closed;
+		coroutine->open_upvalues = upvalue->next;
+	}
+	coroutine->parent = NULL;
+	coroutine_arm(coroutine);
 }
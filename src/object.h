@@ -7,16 +7,21 @@
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_INITIAL 64
-#define STACK_INITIAL (FRAMES_INITIAL * UINT8_COUNT)
+// Coroutines start small and grow geometrically, so that short generators
+// cost a few hundred bytes each.
+#define FRAMES_INITIAL 4
+#define STACK_INITIAL 16
+// Most coroutines never outgrow their initial buffers, so dead ones hand
+// them back to a pool for the next coroutine_new instead of freeing them.
+#define COROUTINE_POOL_SIZE 256
+// Slots a suspended stackless coroutine keeps inside the object itself.
+#define COROUTINE_INLINE_SLOTS 4
 
 #define FRAMES_MAX (UINT8_COUNT)
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 
 typedef struct Object {
   // Header "contains" the following fields:
-  // struct Object *next;
-  // bool marked;
   // // Whether the object's underlying memory is owned by the VM.
   // // Heap allocations from Object are always owned by the VM and
   // // should be GC'd, but data referenced internally by the object may
@@ -31,21 +36,15 @@ typedef struct Object {
   // bool owned;
   // ObjectType type;
   //
-  // 01111111 11010110 01001111 01010000 00000000 01100000 00000000 00000000
-  // Bit position:
-  // 44444444 33333333 33222222 22221111 11111100 00000000 66665555 55555544
-  // 76543210 98765432 10987654 32109876 54321098 76543210 32109876 54321098
-  //
-  // Bits needed for pointer:
-  // ........ ........ |------- -------- -------- ------- --------- ----|...
-  //
   // Packing everything in:
-  // NNNNNNNN NNNNNNNN NNNNNNNN NNNNNNNN NNNNNNNN NNNNNNNN ......OM .....TTT
+  // ........ ........ ........ ........ ........ ........ ......O. .....TTT
   //
   // T = type enum,
-  // M = mark bit,
-  // O = owned bit,
-  // N = next pointer.
+  // O = owned bit.
+  //
+  // Objects are not linked together and carry no mark bit: the heap keeps
+  // both in bitmaps next to the pages objects live on (see heap.h), so the
+  // collector never writes to the objects it visits.
   uint64_t header;
 } Object;
 
@@ -61,23 +60,6 @@ static inline bool object_is_type(Object *obj, ObjectType type) {
   return object_type(obj) == type;
 }
 
-static inline void object_set_next(Object *obj, Object *next) {
-  obj->header = (obj->header & 0x00000000000000ff) | ((uint64_t)next << 16);
-}
-
-static inline bool object_is_marked(Object *obj) {
-  return (bool)((obj->header >> 8) & 0x01);
-}
-
-static inline void object_mark(Object *obj) {
-  // STOP PUTTING THIS ON ONE LINE, UNCRUSTIFY
-  obj->header |= (uint64_t)1 << 8;
-}
-
-static inline void object_unmark(Object *obj) {
-  obj->header &= ~((uint64_t)1 << 8);
-}
-
 static inline bool object_is_owned(Object *obj) {
   return (bool)((obj->header >> 9) & 0x01);
 }
@@ -90,10 +72,6 @@ static inline void object_set_non_owned(Object *obj) {
   obj->header &= ~((uint64_t)1 << 9);
 }
 
-static inline Object *object_next(Object *obj) {
-  return (Object *)(obj->header >> 16);
-}
-
 // TODO: use [flexible array
 // members](https://en.wikipedia.org/wiki/Flexible_array_member) to reduce
 // indirection.
@@ -119,6 +97,7 @@ static inline bool is_obj_type(Value value, ObjectType type) {
 #define IS_LIST(value) is_obj_type(value, OBJ_LIST)
 #define IS_DICT(value) is_obj_type(value, OBJ_DICT)
 #define IS_COROUTINE(value) is_obj_type(value, OBJ_COROUTINE)
+#define IS_CHANNEL(value) is_obj_type(value, OBJ_CHANNEL)
 
 #define AS_STRING(value) ((String *)AS_OBJ(value))
 #define AS_CSTRING(value) (((String *)AS_OBJ(value))->chars)
@@ -130,6 +109,7 @@ static inline bool is_obj_type(Value value, ObjectType type) {
 #define AS_LIST(value) ((List *)AS_OBJ(value))
 #define AS_DICT(value) ((Dictionary *)AS_OBJ(value))
 #define AS_COROUTINE(value) ((Coroutine *)AS_OBJ(value))
+#define AS_CHANNEL(value) ((Channel *)AS_OBJ(value))
 
 typedef struct {
   Object object;
@@ -137,6 +117,10 @@ typedef struct {
   String *name;
   uint8_t upvalue_count;
   uint8_t arity; // I don't think anyone will use more than 255 args ever.
+  // Coroutines over this function can run on their caller's stack.
+  bool stackless;
+  // Where to compile the body from, or NULL once it's compiled.
+  struct LazyBody *lazy;
   // TODO: do I want to support multiple return values an varargs?
 } Function;
 
@@ -179,6 +163,9 @@ typedef enum {
   COROUTINE_READY,
   // The coroutine has yielded and is waiting to be resumed.
   COROUTINE_PAUSED,
+  // The coroutine is suspended in an await, and expects to be resumed with
+  // the value the await evaluates to.
+  COROUTINE_AWAITING,
   // The coroutine is currently running, and is either the current coroutine
   // or one of its ancestors.
   COROUTINE_RUNNING,
@@ -192,11 +179,28 @@ typedef struct {
   Closure *closure;
   uint8_t *ip;
   Value *slots;
+  // Set if this frame is a stackless coroutine running on its caller's
+  // stack; slot 0 then holds the coroutine.
+  struct Coroutine *generator;
 } CallFrame;
 
 typedef struct Coroutine {
   Object obj;
   struct Coroutine *parent;
+  // The body, kept so a finished coroutine can be restarted. NULL for the
+  // main coroutine.
+  Closure *closure;
+
+  // A stackless coroutine has no frames of its own. While running, its body
+  // is a frame on the resuming coroutine's stack; while suspended, `stack`
+  // holds just the slots of that frame and `resume_ip` where it left off.
+  // If something it calls yields, it is turned into a regular coroutine.
+  bool stackless;
+  uint8_t *resume_ip;
+  // `stack` points here until the saved slots outgrow it.
+  Value inline_slots[COROUTINE_INLINE_SLOTS];
+  // Stackless coroutines currently running on this coroutine's stack.
+  size_t generator_frames;
 
   // This exists so that we can iterate over all coroutines during
   // garbage collection without needing do maintain a list of valid
@@ -212,18 +216,83 @@ typedef struct Coroutine {
   // The current frame is frames[frame_count - 1].
   CallFrame *current_frame;
 
+  // Growing the stack moves it, so nothing may hold a pointer into it across
+  // a push except the frames and open upvalues, which are relocated. There
+  // is always at least one free slot above `stack_top`.
   Value *stack;
   // We *must* ensure that this never exceeds some maximum
   // to avoid memory leaks on infinite recursion.
   size_t stack_size;
   Value *stack_top;
 
+  // Upvalues still pointing into `stack`, sorted by location, highest first.
+  // Each coroutine keeps its own, since the stacks can sit anywhere in
+  // memory relative to each other.
+  Upvalue *open_upvalues;
+
   CoroutineState state;
 } Coroutine;
 
+// Initial-size buffers from collected coroutines. Whatever sat in the pool
+// unused for a whole GC cycle is freed at the next collection, so the pool
+// only holds on to memory while coroutines are actually being churned.
+typedef struct {
+  Value *stacks[COROUTINE_POOL_SIZE];
+  CallFrame *frames[COROUTINE_POOL_SIZE];
+  size_t stack_count;
+  size_t frame_count;
+  // The fewest buffers the pool held since the last trim.
+  size_t stack_low;
+  size_t frame_low;
+} CoroutinePool;
+
+// A coroutine parked on a channel, and for a sender the value it is sending.
+typedef struct {
+  Coroutine *task;
+  Value value;
+} ChannelWaiter;
+
+// FIFO of parked coroutines. `capacity` is a power of two.
+typedef struct {
+  ChannelWaiter *waiters;
+  size_t head;
+  size_t count;
+  size_t capacity;
+} WaitQueue;
+
+typedef struct {
+  Object obj;
+  // Ring buffer of values sent but not yet received. `capacity` is a power
+  // of two, so wrapping around is a mask.
+  Value *values;
+  size_t head;
+  size_t count;
+  size_t capacity;
+  // The most values the channel buffers before senders park. 0 if unbounded.
+  size_t limit;
+  bool closed;
+  // Senders wait only while the buffer is full, receivers only while it is
+  // empty, so at most one of these is non-empty.
+  WaitQueue senders;
+  WaitQueue receivers;
+} Channel;
+
+void coroutine_pool_init(CoroutinePool *pool);
+void coroutine_pool_trim(CoroutinePool *pool);
+
 Coroutine *coroutine_new(Closure *closure);
+// Puts the coroutine back in its initial state, ready to run its body from
+// the start, without reallocating anything.
 void coroutine_reset(Coroutine *coroutine);
+// Releases the coroutine's stack and frames (to the pool if possible).
 void coroutine_free(Coroutine *coroutine);
+// Copies the slots of a suspending stackless coroutine into it.
+void coroutine_save(Coroutine *coroutine, Value *slots, size_t count, uint8_t *ip);
+// Gives a stackless coroutine buffers for `values` values and `frames`
+// frames, so it can take over its frames from the caller.
+void coroutine_make_stackful(Coroutine *coroutine, size_t values, size_t frames);
+// Makes room for `count` values above `stack_top`, moving the stack if needed.
+void coroutine_reserve(Coroutine *coroutine, size_t count);
 void coroutine_push(Coroutine *coroutine, Value value);
 Value coroutine_pop(Coroutine *coroutine);
 Value coroutine_peek(Coroutine *coroutine, size_t distance);
@@ -248,6 +317,13 @@ void dict_clear(Dictionary *dict);
 Value dict_remove(Dictionary *dict, String *key);
 Value dict_get(Dictionary *dict, String *key);
 
+Channel *channel_new(size_t limit);
+void channel_push(Channel *channel, Value value);
+Value channel_shift(Channel *channel);
+void wait_queue_push(WaitQueue *queue, Coroutine *task, Value value);
+ChannelWaiter wait_queue_shift(WaitQueue *queue);
+void wait_queue_free(WaitQueue *queue);
+
 // void dict_keys(ObjectDict *dict, ObjectList *list);
 // void dict_values(ObjectDict *dict, ObjectList *list);
 
@@ -0,0 +1,427 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "isolate.h"
+#include "parallel.h"
+#include "vm.h"
+
+typedef struct {
+	pthread_mutex_t lock;
+	size_t begin;
+	size_t end;
+} WorkRange;
+
+struct ParallelJob;
+
+typedef struct {
+	pthread_t thread;
+	struct ParallelJob *job;
+	WorkRange range;
+	bool started;
+	bool failed;
+	// What the worker produced, in its own heap: for a map the result for
+	// each index it did, for a reduce the result of each chunk, keyed by
+	// the chunk's first index.
+	List *results;
+	size_t *indices;
+	size_t count;
+	size_t capacity;
+} Worker;
+
+typedef struct ParallelJob {
+	// These live in the calling isolate, which waits while the workers run.
+	Value function;
+	List *input;
+	Table *globals;
+	bool reduce;
+
+	Worker *workers;
+	size_t worker_count;
+
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	size_t finished;
+	// Set once the caller has copied the results out of the workers' heaps.
+	bool collected;
+} ParallelJob;
+
+// Slots on the worker's stack. Objects can be moved by compaction while a
+// function runs, so the worker keeps them there rather than in C locals.
+#define SLOT_FUNCTION 1
+#define SLOT_RESULTS 2
+
+static size_t worker_count() {
+	const char *env = getenv("CLOX_WORKERS");
+	long count = env != NULL ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (size_t)count : 1;
+}
+
+// Takes the next chunk off the front of the worker's own range.
+static bool take_chunk(Worker *worker, size_t *begin, size_t *end) {
+	WorkRange *range = &worker->range;
+	pthread_mutex_lock(&range->lock);
+	size_t left = range->end - range->begin;
+	size_t size = left >= 4 ? left / 4 : left;
+	*begin = range->begin;
+	*end = range->begin + size;
+	range->begin = *end;
+	pthread_mutex_unlock(&range->lock);
+	return size > 0;
+}
+
+// Moves the back half of the largest range left to the thief's.
+static bool steal(Worker *thief) {
+	ParallelJob *job = thief->job;
+	for (;;) {
+		Worker *victim = NULL;
+		size_t most = 0;
+		for (size_t i = 0; i < job->worker_count; i++) {
+			Worker *worker = &job->workers[i];
+			pthread_mutex_lock(&worker->range.lock);
+			size_t left = worker->range.end - worker->range.begin;
+			pthread_mutex_unlock(&worker->range.lock);
+			if (worker != thief && left > most) {
+				victim = worker;
+				most = left;
+			}
+		}
+		if (victim == NULL) {
+			return false;
+		}
+
+		pthread_mutex_lock(&victim->range.lock);
+		size_t left = victim->range.end - victim->range.begin;
+		size_t half = (left + 1) / 2;
+		victim->range.end -= half;
+		size_t begin = victim->range.end;
+		pthread_mutex_unlock(&victim->range.lock);
+		if (half == 0) {
+			// Someone else got there first.
+			continue;
+		}
+
+		pthread_mutex_lock(&thief->range.lock);
+		thief->range.begin = begin;
+		thief->range.end = begin + half;
+		pthread_mutex_unlock(&thief->range.lock);
+		return true;
+	}
+}
+
+static void push_element(ParallelJob *job, size_t index) {
+	Value element = job->input->values.values[index];
+	if (!IS_OBJ(element)) {
+		vm_push(element);
+		return;
+	}
+	IsolateCopy copy;
+	isolate_copy_init(&copy, NULL);
+	element = isolate_copy(&copy, element);
+	isolate_copy_free(&copy);
+	vm_push(element);
+}
+
+// Moves the value on top of the stack to the worker's results.
+static void add_result(Worker *worker, size_t index) {
+	if (worker->count == worker->capacity) {
+		worker->capacity = GROW_CAPACITY(worker->capacity);
+		worker->indices = (size_t *)realloc(worker->indices, sizeof(size_t) * worker->capacity);
+		if (worker->indices == NULL) {
+			exit(1);
+		}
+	}
+	worker->indices[worker->count++] = index;
+	list_push(AS_LIST(vm.running->stack[SLOT_RESULTS]), vm_peek(0));
+	vm_pop();
+}
+
+// Calls the function with the value on top of the stack and the element at
+// `index`, and replaces that value with the result.
+static bool reduce_step(ParallelJob *job, size_t index) {
+	vm_push(vm.running->stack[SLOT_FUNCTION]);
+	vm_push(vm_peek(1));
+	push_element(job, index);
+	if (!vm_invoke(2)) {
+		return false;
+	}
+	vm.running->stack_top[-2] = vm.running->stack_top[-1];
+	vm_pop();
+	return true;
+}
+
+static bool worker_run(Worker *worker) {
+	ParallelJob *job = worker->job;
+
+	// Calls made from native code return to the frame they were made from,
+	// so the worker sits in an empty script while it calls the function.
+	Function *script = compile("");
+	if (script == NULL) {
+		return false;
+	}
+	vm_push(OBJ_VAL(script));
+	Closure *closure = closure_new(script);
+	vm_pop();
+	vm_push(OBJ_VAL(closure));
+	vm_call(closure, 0);
+
+	IsolateCopy copy;
+	isolate_copy_init(&copy, job->globals);
+	Value function = isolate_copy(&copy, job->function);
+	isolate_copy_free(&copy);
+	vm_push(function);
+	vm_push(OBJ_VAL(list_new()));
+
+	size_t begin;
+	size_t end;
+	while (take_chunk(worker, &begin, &end) || (steal(worker) && take_chunk(worker, &begin, &end))) {
+		if (job->reduce) {
+			push_element(job, begin);
+			for (size_t i = begin + 1; i < end; i++) {
+				if (!reduce_step(job, i)) {
+					return false;
+				}
+			}
+			add_result(worker, begin);
+			continue;
+		}
+		for (size_t i = begin; i < end; i++) {
+			vm_push(vm.running->stack[SLOT_FUNCTION]);
+			push_element(job, i);
+			if (!vm_invoke(1)) {
+				return false;
+			}
+			add_result(worker, i);
+		}
+	}
+	worker->results = AS_LIST(vm.running->stack[SLOT_RESULTS]);
+	return true;
+}
+
+static void *worker_main(void *arg) {
+	Worker *worker = (Worker *)arg;
+	ParallelJob *job = worker->job;
+	char *err = vm_init();
+	worker->failed = err != NULL || !worker_run(worker);
+
+	// The results stay in this heap until the caller has copied them.
+	pthread_mutex_lock(&job->lock);
+	job->finished++;
+	pthread_cond_broadcast(&job->changed);
+	while (!job->collected) {
+		pthread_cond_wait(&job->changed, &job->lock);
+	}
+	pthread_mutex_unlock(&job->lock);
+
+	if (err == NULL) {
+		vm_free();
+	}
+	return NULL;
+}
+
+// Runs the job on its workers. Returns false if none could be started.
+static bool start_job(ParallelJob *job) {
+	size_t length = job->input->values.count;
+	job->worker_count = worker_count();
+	if (job->worker_count > length) {
+		job->worker_count = length;
+	}
+	job->workers = (Worker *)calloc(job->worker_count, sizeof(Worker));
+	if (job->workers == NULL) {
+		return false;
+	}
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->changed, NULL);
+	job->finished = 0;
+	job->collected = false;
+
+	for (size_t i = 0; i < job->worker_count; i++) {
+		Worker *worker = &job->workers[i];
+		worker->job = job;
+		pthread_mutex_init(&worker->range.lock, NULL);
+		worker->range.begin = i * length / job->worker_count;
+		worker->range.end = (i + 1) * length / job->worker_count;
+	}
+	size_t started = 0;
+	for (size_t i = 0; i < job->worker_count; i++) {
+		Worker *worker = &job->workers[i];
+		// A worker that didn't start leaves its range to be stolen.
+		worker->started = pthread_create(&worker->thread, NULL, worker_main, worker) == 0;
+		started += worker->started;
+	}
+
+	pthread_mutex_lock(&job->lock);
+	while (job->finished < started) {
+		pthread_cond_wait(&job->changed, &job->lock);
+	}
+	pthread_mutex_unlock(&job->lock);
+	return started > 0;
+}
+
+// Lets the workers free their heaps, and waits for them.
+static void end_job(ParallelJob *job) {
+	pthread_mutex_lock(&job->lock);
+	job->collected = true;
+	pthread_cond_broadcast(&job->changed);
+	pthread_mutex_unlock(&job->lock);
+
+	for (size_t i = 0; i < job->worker_count; i++) {
+		Worker *worker = &job->workers[i];
+		if (worker->started) {
+			pthread_join(worker->thread, NULL);
+		}
+		pthread_mutex_destroy(&worker->range.lock);
+		free(worker->indices);
+	}
+	pthread_cond_destroy(&job->changed);
+	pthread_mutex_destroy(&job->lock);
+	free(job->workers);
+}
+
+static bool job_failed(ParallelJob *job) {
+	for (size_t i = 0; i < job->worker_count; i++) {
+		Worker *worker = &job->workers[i];
+		if (!worker->started) {
+			continue;
+		}
+		if (worker->failed) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// parallel_map(list, fn) returns a new list of fn(element) for each
+// element, or nil if a call failed. fn runs in the workers on copies of the
+// elements and of itself: changes it makes to captured variables, globals
+// or its arguments aren't seen by the caller.
+Value parallel_map_native(uint8_t argc, Value *args) {
+	if (!IS_LIST(args[0])) {
+		return NIL_VAL;
+	}
+	ParallelJob job;
+	job.function = args[1];
+	job.input = AS_LIST(args[0]);
+	job.globals = &vm.globals;
+	job.reduce = false;
+	size_t length = job.input->values.count;
+
+	List *results = list_new();
+	vm_push(OBJ_VAL(results));
+	if (length == 0) {
+		return vm_pop();
+	}
+	if (!start_job(&job)) {
+		vm_pop();
+		return NIL_VAL;
+	}
+	bool failed = job_failed(&job);
+	if (!failed) {
+		for (size_t i = 0; i < length; i++) {
+			list_push(results, NIL_VAL);
+		}
+		IsolateCopy copy;
+		isolate_copy_init(&copy, NULL);
+		for (size_t i = 0; i < job.worker_count; i++) {
+			Worker *worker = &job.workers[i];
+			for (size_t k = 0; k < worker->count; k++) {
+				Value value = isolate_copy(&copy, worker->results->values.values[k]);
+				results->values.values[worker->indices[k]] = value;
+			}
+		}
+		isolate_copy_free(&copy);
+	}
+	end_job(&job);
+	vm_pop();
+	return failed ? NIL_VAL : OBJ_VAL(results);
+}
+
+typedef struct {
+	size_t index;
+	Worker *worker;
+	size_t k;
+} Partial;
+
+static int compare_partials(const void *a, const void *b) {
+	size_t x = ((const Partial *)a)->index;
+	size_t y = ((const Partial *)b)->index;
+	return x < y ? -1 : x > y;
+}
+
+// parallel_reduce(list, fn, initial) folds the list with fn, starting from
+// initial, or returns nil if a call failed. The workers fold chunks of the
+// list and the caller folds their results in order, so fn has to be
+// associative; unlike a serial fold, `initial` is only combined once.
+Value parallel_reduce_native(uint8_t argc, Value *args) {
+	if (!IS_LIST(args[0])) {
+		return NIL_VAL;
+	}
+	ParallelJob job;
+	job.function = args[1];
+	job.input = AS_LIST(args[0]);
+	job.globals = &vm.globals;
+	job.reduce = true;
+	if (job.input->values.count == 0) {
+		return args[2];
+	}
+	// The arguments stay on the stack, but it can move when it grows.
+	size_t args_at = args - vm.running->stack;
+
+	List *partials = list_new();
+	vm_push(OBJ_VAL(partials));
+	if (!start_job(&job)) {
+		vm_pop();
+		return NIL_VAL;
+	}
+	bool failed = job_failed(&job);
+	if (!failed) {
+		size_t count = 0;
+		for (size_t i = 0; i < job.worker_count; i++) {
+			count += job.workers[i].count;
+		}
+		Partial *order = (Partial *)malloc(sizeof(Partial) * count);
+		if (order == NULL) {
+			exit(1);
+		}
+		count = 0;
+		for (size_t i = 0; i < job.worker_count; i++) {
+			for (size_t k = 0; k < job.workers[i].count; k++) {
+				order[count++] = (Partial){ job.workers[i].indices[k], &job.workers[i], k };
+			}
+		}
+		qsort(order, count, sizeof(Partial), compare_partials);
+
+		IsolateCopy copy;
+		isolate_copy_init(&copy, NULL);
+		for (size_t i = 0; i < count; i++) {
+			Value value = order[i].worker->results->values.values[order[i].k];
+			list_push(partials, isolate_copy(&copy, value));
+		}
+		isolate_copy_free(&copy);
+		free(order);
+	}
+	end_job(&job);
+	if (failed) {
+		vm_pop();
+		return NIL_VAL;
+	}
+
+	// Now fold the partial results here: initial, then each in order.
+	vm_push(vm.running->stack[args_at + 2]);
+	for (size_t i = 0; i < partials->values.count; i++) {
+		vm_push(vm.running->stack[args_at + 1]);
+		vm_push(vm_peek(1));
+		vm_push(AS_LIST(vm_peek(3))->values.values[i]);
+		if (!vm_invoke(2)) {
+			vm.native_error = true;
+			return NIL_VAL;
+		}
+		vm.running->stack_top[-2] = vm.running->stack_top[-1];
+		vm_pop();
+		partials = AS_LIST(vm_peek(1));
+	}
+	Value result = vm_pop();
+	vm_pop();
+	return result;
+}
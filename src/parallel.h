@@ -0,0 +1,20 @@
+#ifndef clox_parallel_h
+#define clox_parallel_h
+
+#include "common.h"
+#include "value.h"
+
+// parallel_map and parallel_reduce split a list over a pool of worker
+// threads, each running an isolate with its own copy of the function (see
+// isolate.h). Every worker starts with an even share of the indices and
+// takes chunks off the front of it, a quarter of what is left each time,
+// so chunks shrink as the work runs out. A worker that runs dry steals the
+// back half of the largest share left.
+//
+// CLOX_WORKERS sets the number of workers; it defaults to the number of
+// online CPUs.
+
+Value parallel_map_native(uint8_t argc, Value *args);
+Value parallel_reduce_native(uint8_t argc, Value *args);
+
+#endif
@@ -0,0 +1,262 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "compiler.h"
+#include "isolate.h"
+#include "memory.h"
+#include "pipeline.h"
+#include "vm.h"
+
+// Once the compiler thread is done, it's woken to collect what has been
+// copied out of its heap only this many results at a time.
+#define PIPELINE_RELEASE_BATCH 64
+
+typedef enum {
+	JOB_QUEUED,
+	JOB_COMPILING,
+	JOB_READY,
+	JOB_FAILED,
+	// Copied out, or left to the main thread to compile.
+	JOB_TAKEN,
+} JobState;
+
+// What the compiler thread needs of a body, outside either heap: the
+// function it belongs to may be freed or moved meanwhile.
+typedef struct PipelineJob {
+	char *start;
+	Linenr line;
+	Token *upvalues;
+	uint32_t upvalue_count;
+	JobState state;
+	// In the compiler thread's heap, once the job is ready.
+	Function *result;
+} PipelineJob;
+
+typedef struct {
+	PipelineJob *jobs;
+	size_t count;
+	pthread_t thread;
+	// Whether the compiler thread is there to finish what it started.
+	bool running;
+	bool stopping;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	// Jobs whose results have been copied out, for the compiler thread to
+	// let go of. Each job is released at most once.
+	size_t *released;
+	size_t released_count;
+} Pipeline;
+
+static Pipeline pipeline;
+
+// Compiles the body and the functions nested in it, which were skimmed.
+static bool compile_all(Function *function) {
+	if (!compile_body(function)) {
+		return false;
+	}
+	ValueArray *constants = &function->chunk.constants;
+	for (size_t i = 0; i < constants->count; i++) {
+		Value constant = constants->values[i];
+		if (IS_FUNCTION(constant) && !compile_all(AS_FUNCTION(constant))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static Function *compile_job(PipelineJob *job, List *results, size_t index) {
+	Function *function = function_new();
+	results->values.values[index] = OBJ_VAL(function);
+	function->upvalue_count = job->upvalue_count;
+	LazyBody *lazy = ALLOCATE(LazyBody, 1);
+	lazy->start = job->start;
+	lazy->line = job->line;
+	lazy->upvalues = ALLOCATE(Token, job->upvalue_count);
+	for (uint32_t i = 0; i < job->upvalue_count; i++) {
+		lazy->upvalues[i] = job->upvalues[i];
+	}
+	lazy->job = NULL;
+	function->lazy = lazy;
+	if (!compile_all(function)) {
+		results->values.values[index] = NIL_VAL;
+		return NULL;
+	}
+	return function;
+}
+
+// Called with the lock held.
+static bool release_taken(List *results) {
+	bool released = pipeline.released_count > 0;
+	while (pipeline.released_count > 0) {
+		results->values.values[pipeline.released[--pipeline.released_count]] = NIL_VAL;
+	}
+	return released;
+}
+
+static void *compiler_main(void *arg) {
+	(void)arg;
+	char *err = vm_init();
+	pthread_mutex_lock(&pipeline.lock);
+	if (err != NULL) {
+		pipeline.running = false;
+		pthread_cond_broadcast(&pipeline.changed);
+		pthread_mutex_unlock(&pipeline.lock);
+		return NULL;
+	}
+	pthread_mutex_unlock(&pipeline.lock);
+
+	// The main thread copies results out while this one keeps going.
+	gc_never_compact();
+	// Errors are reported by the main thread compiling the body again.
+	quiet_errors = true;
+	List *results = list_new();
+	vm_push(OBJ_VAL(results));
+	for (size_t i = 0; i < pipeline.count; i++) {
+		list_push(results, NIL_VAL);
+	}
+
+	pthread_mutex_lock(&pipeline.lock);
+	for (size_t i = 0; i < pipeline.count && !pipeline.stopping; i++) {
+		release_taken(results);
+		PipelineJob *job = &pipeline.jobs[i];
+		if (job->state != JOB_QUEUED) {
+			continue;
+		}
+		job->state = JOB_COMPILING;
+		pthread_mutex_unlock(&pipeline.lock);
+
+		Function *result = compile_job(job, results, i);
+
+		pthread_mutex_lock(&pipeline.lock);
+		job->result = result;
+		job->state = result != NULL ? JOB_READY : JOB_FAILED;
+		pthread_cond_broadcast(&pipeline.changed);
+	}
+	// The results stay in this heap until they've been copied out, or the
+	// script is done.
+	while (!pipeline.stopping) {
+		if (pipeline.released_count >= PIPELINE_RELEASE_BATCH && release_taken(results)) {
+			pthread_mutex_unlock(&pipeline.lock);
+			collect_garbage();
+			pthread_mutex_lock(&pipeline.lock);
+		} else {
+			pthread_cond_wait(&pipeline.changed, &pipeline.lock);
+		}
+	}
+	pthread_mutex_unlock(&pipeline.lock);
+
+	vm_free();
+	return NULL;
+}
+
+void pipeline_start(Function *script) {
+	ValueArray *constants = &script->chunk.constants;
+	size_t count = 0;
+	for (size_t i = 0; i < constants->count; i++) {
+		if (IS_FUNCTION(constants->values[i]) && AS_FUNCTION(constants->values[i])->lazy != NULL) {
+			count++;
+		}
+	}
+	if (count == 0) {
+		return;
+	}
+	pipeline.jobs = (PipelineJob *)calloc(count, sizeof(PipelineJob));
+	pipeline.released = (size_t *)malloc(count * sizeof(size_t));
+	if (pipeline.jobs == NULL || pipeline.released == NULL) {
+		exit(1);
+	}
+	for (size_t i = 0; i < constants->count; i++) {
+		if (!IS_FUNCTION(constants->values[i]) || AS_FUNCTION(constants->values[i])->lazy == NULL) {
+			continue;
+		}
+		Function *function = AS_FUNCTION(constants->values[i]);
+		PipelineJob *job = &pipeline.jobs[pipeline.count++];
+		job->start = function->lazy->start;
+		job->line = function->lazy->line;
+		job->upvalue_count = function->upvalue_count;
+		job->upvalues = (Token *)malloc(sizeof(Token) * (job->upvalue_count > 0 ? job->upvalue_count : 1));
+		if (job->upvalues == NULL) {
+			exit(1);
+		}
+		for (uint32_t j = 0; j < job->upvalue_count; j++) {
+			job->upvalues[j] = function->lazy->upvalues[j];
+		}
+		job->state = JOB_QUEUED;
+		function->lazy->job = job;
+	}
+	pthread_mutex_init(&pipeline.lock, NULL);
+	pthread_cond_init(&pipeline.changed, NULL);
+	pipeline.running = true;
+	if (pthread_create(&pipeline.thread, NULL, compiler_main, NULL) != 0) {
+		pipeline.running = false;
+	}
+}
+
+void pipeline_stop() {
+	if (pipeline.jobs == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&pipeline.lock);
+	pipeline.stopping = true;
+	pthread_cond_broadcast(&pipeline.changed);
+	bool running = pipeline.running;
+	pthread_mutex_unlock(&pipeline.lock);
+	if (running) {
+		pthread_join(pipeline.thread, NULL);
+	}
+	for (size_t i = 0; i < pipeline.count; i++) {
+		free(pipeline.jobs[i].upvalues);
+	}
+	free(pipeline.jobs);
+	free(pipeline.released);
+	pthread_mutex_destroy(&pipeline.lock);
+	pthread_cond_destroy(&pipeline.changed);
+	pipeline = (Pipeline){ 0 };
+}
+
+bool pipeline_install(Function *function) {
+	PipelineJob *job = function->lazy->job;
+	// Whatever happens next, the body is the main thread's from now on.
+	function->lazy->job = NULL;
+
+	pthread_mutex_lock(&pipeline.lock);
+	while (pipeline.running && job->state == JOB_COMPILING) {
+		pthread_cond_wait(&pipeline.changed, &pipeline.lock);
+	}
+	if (job->state != JOB_READY) {
+		job->state = JOB_TAKEN;
+		pthread_mutex_unlock(&pipeline.lock);
+		return false;
+	}
+	pthread_mutex_unlock(&pipeline.lock);
+
+	// A ready result isn't touched by the compiler thread again until it's
+	// released, and its collector neither frees nor moves it meanwhile.
+	IsolateCopy copy;
+	isolate_copy_init(&copy, NULL);
+	Function *compiled = AS_FUNCTION(isolate_copy(&copy, OBJ_VAL(job->result)));
+	function->chunk = compiled->chunk;
+	function->stackless = compiled->stackless;
+	chunk_init(&compiled->chunk);
+	isolate_copy_free(&copy);
+	compile_body_free(function);
+
+	pthread_mutex_lock(&pipeline.lock);
+	job->state = JOB_TAKEN;
+	pipeline.released[pipeline.released_count++] = (size_t)(job - pipeline.jobs);
+	if (pipeline.released_count >= PIPELINE_RELEASE_BATCH) {
+		pthread_cond_broadcast(&pipeline.changed);
+	}
+	pthread_mutex_unlock(&pipeline.lock);
+	return true;
+}
+
+void pipeline_after_fork() {
+	if (pipeline.jobs == NULL) {
+		return;
+	}
+	// The lock may have been held by the compiler thread, which isn't here.
+	pthread_mutex_init(&pipeline.lock, NULL);
+	pthread_cond_init(&pipeline.changed, NULL);
+	pipeline.running = false;
+}
@@ -0,0 +1,33 @@
+#ifndef clox_pipeline_h
+#define clox_pipeline_h
+
+#include "common.h"
+#include "object.h"
+
+// Compiles a script's functions on a background thread while it runs, for
+// `clox --pipeline`. The script is compiled with its function bodies
+// skimmed (see compile_lazy), so the top level starts running as soon as
+// it's compiled, and the skimmed bodies are queued, in the order they
+// appear, to a compiler thread. That thread is an isolate of its own (see
+// isolate.h): it compiles each body, and the functions nested in it, into
+// its own heap, and the first call to the function copies the code over.
+// A call only waits if it reaches a body while it's being compiled. One
+// the thread hasn't got to yet is compiled on the spot, and so is one that
+// failed to compile there, which is where its errors are reported.
+
+// Queues the bodies of the functions in `script`, which was compiled by
+// compile_lazy, and starts the compiler thread. If it can't be started,
+// the bodies are compiled when they're called, as they would be anyway.
+void pipeline_start(Function *script);
+// Stops the compiler thread and frees its heap. Nothing may be called
+// afterwards, and the source may be freed.
+void pipeline_stop();
+// Called by compile_body for a function queued by pipeline_start. Gives
+// the function the code compiled for it, waiting for it if need be, and
+// returns true, or returns false if the caller has to compile it itself.
+bool pipeline_install(Function *function);
+// In a forked child, which has no compiler thread, only bodies that were
+// ready when it forked are taken from it.
+void pipeline_after_fork();
+
+#endif
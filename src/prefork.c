@@ -0,0 +1,112 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "loop.h"
+#include "memory.h"
+#include "pipeline.h"
+#include "prefork.h"
+#include "vm.h"
+
+typedef struct {
+	pid_t pid;
+	int restarts;
+	bool exited;
+	// The exit code, or minus the signal that killed it.
+	int status;
+} Child;
+
+static void child_main(Value function, size_t index) {
+	gc_after_fork();
+	loop_after_fork(&vm.loop);
+	pipeline_after_fork();
+
+	vm_push(function);
+	vm_push(NUMBER_VAL((double)index));
+	int status = 1;
+	if (vm_invoke(1)) {
+		Value result = vm_pop();
+		status = IS_NUMBER(result) ? (int)(int64_t)AS_NUMBER(result) & 0xff : 0;
+	}
+	fflush(NULL);
+	// Leaves the heap and everything else as it is: tearing it down would
+	// only write to the pages shared with the parent.
+	_exit(status);
+}
+
+static pid_t spawn(Value function, size_t index) {
+	// Otherwise output buffered so far would be written by every child too.
+	fflush(NULL);
+	pid_t pid = fork();
+	if (pid == 0) {
+		child_main(function, index);
+	}
+	return pid;
+}
+
+static Child *find_child(Child *children, size_t count, pid_t pid) {
+	for (size_t i = 0; i < count; i++) {
+		if (children[i].pid == pid) {
+			return &children[i];
+		}
+	}
+	return NULL;
+}
+
+Value prefork_workers_native(uint8_t argc, Value *args) {
+	if (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 1 || !IS_OBJ(args[1])) {
+		return NIL_VAL;
+	}
+	size_t count = (size_t)AS_NUMBER(args[0]);
+	Value function = args[1];
+
+	// Children never free what they inherit, so don't hand them garbage.
+	// Nothing moves until this native returns.
+	collect_garbage();
+
+	Child *children = (Child *)calloc(count, sizeof(Child));
+	if (children == NULL) {
+		exit(1);
+	}
+	size_t running = 0;
+	for (size_t i = 0; i < count; i++) {
+		children[i].pid = spawn(function, i);
+		running += children[i].pid > 0;
+	}
+
+	while (running > 0) {
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		Child *child = find_child(children, count, pid);
+		if (child == NULL) {
+			continue;
+		}
+		running--;
+		if (WIFSIGNALED(status) && child->restarts < PREFORK_RESTARTS_MAX) {
+			child->restarts++;
+			child->pid = spawn(function, (size_t)(child - children));
+			running += child->pid > 0;
+			continue;
+		}
+		child->pid = 0;
+		child->exited = true;
+		child->status = WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status);
+	}
+
+	List *codes = list_new();
+	vm_push(OBJ_VAL(codes));
+	for (size_t i = 0; i < count; i++) {
+		list_push(codes, children[i].exited ? NUMBER_VAL(children[i].status) : NIL_VAL);
+	}
+	vm_pop();
+	free(children);
+	return OBJ_VAL(codes);
+}
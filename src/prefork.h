@@ -0,0 +1,27 @@
+#ifndef clox_prefork_h
+#define clox_prefork_h
+
+#include "common.h"
+#include "value.h"
+
+// fork_workers(n, fn) forks n child processes and calls fn(i) in the i-th.
+// Each child starts from a copy of the parent's heap as it is at the call,
+// so whatever the program built before then (tables, parsed config, loaded
+// data) is there in every child without being rebuilt or copied. The kernel
+// shares the pages copy-on-write, and the child's collector keeps them
+// shared: it allocates on pages of its own, never frees or moves anything
+// it inherited, and keeps its mark bits outside the pages (see
+// heap_after_fork).
+//
+// The parent waits for the children. A child's exit code is what fn
+// returned, if that was a number (taken modulo 256), 0 if it was anything
+// else, and 1 if fn raised an error. A child killed by a signal is forked
+// again, up to PREFORK_RESTARTS_MAX times for the same index. The call
+// returns the list of exit codes by index, with -signal for a child that
+// kept crashing, and nil for one that couldn't be forked.
+
+#define PREFORK_RESTARTS_MAX 5
+
+Value prefork_workers_native(uint8_t argc, Value *args);
+
+#endif
@@ -48,11 +48,11 @@ static bool repl_do_cmd(char *line, size_t length) {
 	return false;
 }
 
-ValueArray lines;
-Table seen;
-Compiler compiler;
-Function *f = NULL;
-char line[1024];
+THREAD_LOCAL ValueArray lines;
+THREAD_LOCAL Table seen;
+THREAD_LOCAL Compiler compiler;
+THREAD_LOCAL Function *f = NULL;
+THREAD_LOCAL char line[1024];
 
 void repl() {
 	value_array_init(&lines);
@@ -128,6 +128,18 @@ void repl() {
 	value_array_free(&lines);
 }
 
+void repl_forward_roots() {
+	for (size_t i = 0; i < lines.count; i++) {
+		gc_forward_value(&lines.values[i]);
+	}
+	if (f) {
+		f = (Function *)gc_forward((Object *)f);
+	}
+	if (compiler.function) {
+		compiler.function = (Function *)gc_forward((Object *)compiler.function);
+	}
+}
+
 void repl_mark_roots() {
 	for (size_t i = 0; i < lines.count; i++) {
 		mark_value(lines.values[i]);
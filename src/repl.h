@@ -1,3 +1,4 @@
 
 void repl();
 void repl_mark_roots();
+void repl_forward_roots();
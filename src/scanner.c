@@ -1,8 +1,13 @@
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "scanner.h"
 #include "chunk.h"
 #include "object.h"
@@ -14,7 +19,7 @@ typedef struct {
 	size_t offset;
 } Scanner;
 
-Scanner scanner;
+THREAD_LOCAL Scanner scanner;
 
 static Token token(TokenType type) {
 	Token token;
@@ -60,34 +65,138 @@ static bool match(char expected) {
 	return true;
 }
 
+static bool is_blank(char c) {
+	return c == ' ' || c == '\r' || c == '\t';
+}
+
+// Runs of blanks, comments, string contents and identifier characters are
+// skipped 16 bytes at a time where SSE2 is available. A 16-byte load that
+// stays within one page can't fault, even where it reads past the NUL that
+// ends the source, so the source needs no padding. Nothing past the NUL is
+// used: every kind of run stops at the NUL at the latest. Loads that would
+// cross into the next page fall back to a byte at a time.
+//
+// Blanks between tokens and most identifiers are too short for a load to
+// pay off, so those are only skipped by blocks once the run is long enough.
+#define RUN_IDENTIFIER_HEAD 8
+
+typedef enum {
+	RUN_BLANKS,
+	RUN_COMMENT,
+	RUN_STRING,
+	RUN_IDENTIFIER,
+} RunKind;
+
+#ifdef __SSE2__
+
+#define SIMD_WIDTH 16
+// The smallest page size of the platforms clox runs on.
+#define SIMD_PAGE_SIZE 4096
+
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define SIMD_NO_SANITIZE __attribute__((no_sanitize_address))
+#endif
+#endif
+#if !defined(SIMD_NO_SANITIZE) && defined(__SANITIZE_ADDRESS__)
+#define SIMD_NO_SANITIZE __attribute__((no_sanitize_address))
+#endif
+#ifndef SIMD_NO_SANITIZE
+#define SIMD_NO_SANITIZE
+#endif
+
+static __m128i in_range(__m128i bytes, char low, char high) {
+	// Bytes past 0x7f compare as negative, so they're never in an ASCII range.
+	return _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8((char)(low - 1))),
+	                     _mm_cmplt_epi8(bytes, _mm_set1_epi8((char)(high + 1))));
+}
+
+static __m128i equal(__m128i bytes, char c) {
+	return _mm_cmpeq_epi8(bytes, _mm_set1_epi8(c));
+}
+
+// How many of the 16 bytes at `p` continue a run of `kind`.
+SIMD_NO_SANITIZE static unsigned run_bytes(const char *p, RunKind kind) {
+	__m128i bytes = _mm_loadu_si128((const __m128i *)p);
+	__m128i run;
+	switch (kind) {
+	case RUN_BLANKS:
+		run = _mm_or_si128(_mm_or_si128(equal(bytes, ' '), equal(bytes, '\t')), equal(bytes, '\r'));
+		break;
+	case RUN_COMMENT:
+		run = _mm_andnot_si128(_mm_or_si128(equal(bytes, '\n'), equal(bytes, '\0')),
+		                       _mm_set1_epi8((char)0xff));
+		break;
+	case RUN_STRING:
+		run = _mm_andnot_si128(_mm_or_si128(_mm_or_si128(equal(bytes, '"'), equal(bytes, '\n')),
+		                                    equal(bytes, '\0')),
+		                       _mm_set1_epi8((char)0xff));
+		break;
+	case RUN_IDENTIFIER:
+	default:
+		run = _mm_or_si128(_mm_or_si128(in_range(_mm_or_si128(bytes, _mm_set1_epi8(0x20)), 'a', 'z'),
+		                                in_range(bytes, '0', '9')),
+		                   equal(bytes, '_'));
+		break;
+	}
+	unsigned stops = ~(unsigned)_mm_movemask_epi8(run) & 0xffff;
+	return stops == 0 ? SIMD_WIDTH : (unsigned)__builtin_ctz(stops);
+}
+
+static bool can_load(const char *p) {
+	return ((uintptr_t)p & (SIMD_PAGE_SIZE - 1)) <= SIMD_PAGE_SIZE - SIMD_WIDTH;
+}
+
+// Skips the rest of a run of `kind` a block at a time, as far as blocks go.
+static void skip_run(RunKind kind) {
+	while (can_load(scanner.current)) {
+		unsigned count = run_bytes(scanner.current, kind);
+		scanner.current += count;
+		scanner.offset += count;
+		if (count < SIMD_WIDTH) {
+			return;
+		}
+	}
+}
+
+#else
+
+static void skip_run(RunKind kind) {
+	(void)kind;
+}
+
+#endif
+
 static bool skip_whitespace() {
 	bool newline = false;
 	for (;;) {
-		char c = peek();
-		switch (c) {
+		switch (peek()) {
 		case ' ':
 		case '\r':
 		case '\t':
 			advance();
+			if (is_blank(peek())) {
+				skip_run(RUN_BLANKS);
+				while (is_blank(peek())) advance();
+			}
 			break;
-		case '\n': {
+		case '\n':
 			scanner.line++;
 			advance();
 			newline = true;
 			break;
-		}
-		case '/': {
-			if (peek_next() == '/') {
-				while (peek() != '\n' && !is_at_end()) advance();
-			} else {
+		case '/':
+			if (peek_next() != '/') {
 				return newline;
 			}
-		}
+			// The newline that ends the comment is left to end the line.
+			skip_run(RUN_COMMENT);
+			while (peek() != '\n' && !is_at_end()) advance();
+			break;
 		default:
 			return newline;
 		}
 	}
-	return newline;
 }
 
 static Token error_token(const char* format, ...) {
@@ -108,7 +217,11 @@ static Token error_token(const char* format, ...) {
 }
 
 static Token string() {
-	while (peek() != '"' && !is_at_end()) {
+	for (;;) {
+		skip_run(RUN_STRING);
+		if (peek() == '"' || is_at_end()) {
+			break;
+		}
 		if (peek() == '\n') scanner.line++;
 		advance();
 	}
@@ -131,91 +244,70 @@ static Token number() {
 	return token(TOKEN_NUMBER);
 }
 
-static TokenType check_keyword(size_t start, size_t length, const char* rest, TokenType type) {
-	if (scanner.current - scanner.start == start + length &&
-	    memcmp(scanner.start + start, rest, length) == 0) {
-		return type;
-	}
-	return TOKEN_IDENTIFIER;
-}
+// Keywords are found by a perfect hash of their length and first and last
+// characters, into a table the compiler lays out. Two keywords in one slot
+// would be an initializer overriding another (-Woverride-init).
+#define KEYWORD_SLOTS 32
+#define KEYWORD_HASH(first, last, length)                                       \
+	(((length) + ((first) + (last)) * 27) & (KEYWORD_SLOTS - 1))
+#define KEYWORD(first, last, name, type)                                        \
+	[KEYWORD_HASH(first, last, sizeof(name) - 1)] = { name, sizeof(name) - 1, type }
 
-static TokenType ident_type() {
-	switch (*scanner.start) {
-	case 'a': {
-		switch (scanner.start[1]) {
-		case 'n':
-			return check_keyword(1, 3, "and", TOKEN_AND);
-		case 'w':
-			return check_keyword(1, 4, "wait", TOKEN_AWAIT);
-		default:
-			break;
-		}
-		break;
-	};
-	// case 'c': return check_keyword(1, 4, "lass", TOKEN_CLASS);
-	case 'b': return check_keyword(1, 4, "reak", TOKEN_BREAK);
-	case 'c': {
-		if (scanner.current - scanner.start > 1) {
-			TokenType type = check_keyword(1, 7, "ontinue", TOKEN_CONTINUE);
-			if (check_keyword(1, 7, "ontinue", TOKEN_CONTINUE) == TOKEN_CONTINUE) {
-				return TOKEN_CONTINUE;
-			}
+typedef struct {
+	const char *name;
+	size_t length;
+	TokenType type;
+} Keyword;
+
+static const Keyword keywords[KEYWORD_SLOTS] = {
+	KEYWORD('a', 'd', "and", TOKEN_AND),
+	KEYWORD('a', 't', "await", TOKEN_AWAIT),
+	KEYWORD('b', 'k', "break", TOKEN_BREAK),
+	KEYWORD('c', 'o', "co", TOKEN_COROUTINE),
+	KEYWORD('c', 'e', "continue", TOKEN_CONTINUE),
+	KEYWORD('e', 'e', "else", TOKEN_ELSE),
+	KEYWORD('f', 'e', "false", TOKEN_FALSE),
+	KEYWORD('f', 'r', "for", TOKEN_FOR),
+	KEYWORD('f', 'n', "fun", TOKEN_FUN),
+	KEYWORD('i', 'f', "if", TOKEN_IF),
+	KEYWORD('i', 'n', "in", TOKEN_IN),
+	KEYWORD('n', 'l', "nil", TOKEN_NIL),
+	KEYWORD('o', 'r', "or", TOKEN_OR),
+	KEYWORD('r', 'n', "return", TOKEN_RETURN),
+	KEYWORD('t', 'e', "true", TOKEN_TRUE),
+	KEYWORD('v', 'r', "var", TOKEN_VAR),
+	KEYWORD('w', 'e', "while", TOKEN_WHILE),
+	KEYWORD('y', 'd', "yield", TOKEN_YIELD),
+};
 
-			return check_keyword(1, 1, "o", TOKEN_COROUTINE);
-		}
-		break;
-	}
-	case 'e': return check_keyword(1, 3, "lse", TOKEN_ELSE);
-	case 'f': {
-		if (scanner.current - scanner.start > 1) {
-			switch(scanner.start[1]) {
-			case 'a': return check_keyword(2, 3, "lse", TOKEN_FALSE);
-			case 'o': return check_keyword(2, 1, "r", TOKEN_FOR);
-			case 'u': return check_keyword(2, 1, "n", TOKEN_FUN);
-			}
-		}
-		break;
-	}
-	case 'i': {
-		if (scanner.current - scanner.start > 1) {
-			switch (scanner.start[1]) {
-			case 'f': return check_keyword(1, 1, "f", TOKEN_IF);
-			case 'n': return check_keyword(1, 1, "n", TOKEN_IN);
-			}
-		}
-		break;
-	}
-	case 'n': return check_keyword(1, 2, "il", TOKEN_NIL);
-	case 'o': return check_keyword(1, 1, "r", TOKEN_OR);
-	// case 'p': return check_keyword(1, 4, "rint", TOKEN_PRINT);
-	case 'r': return check_keyword(1, 5, "eturn", TOKEN_RETURN);
-	// case 's': return check_keyword(1, 4, "uper", TOKEN_SUPER);
-	case 't': {
-		if (scanner.current - scanner.start > 1) {
-			switch (scanner.start[1]) {
-			// case 'h': return check_keyword(2, 2, "is", TOKEN_THIS);
-			case 'r': return check_keyword(2, 2, "ue", TOKEN_TRUE);
-			}
-		}
-		break;
-	}
-	case 'v': return check_keyword(1, 2, "ar", TOKEN_VAR);
-	case 'w': return check_keyword(1, 4, "hile", TOKEN_WHILE);
-	case 'y': return check_keyword(1, 4, "ield", TOKEN_YIELD);
+static TokenType ident_type() {
+	size_t length = (size_t)(scanner.current - scanner.start);
+	const Keyword *keyword = &keywords[KEYWORD_HASH((unsigned char)scanner.start[0],
+	                                                (unsigned char)scanner.current[-1], length)];
+	if (keyword->length == length && memcmp(scanner.start, keyword->name, length) == 0) {
+		return keyword->type;
 	}
-
 	return TOKEN_IDENTIFIER;
 }
 
 static Token ident() {
-	while (is_alpha(peek()) || is_digit(peek())) advance();
+	while (is_alpha(peek()) || is_digit(peek())) {
+		advance();
+		if (scanner.current - scanner.start == RUN_IDENTIFIER_HEAD) {
+			skip_run(RUN_IDENTIFIER);
+		}
+	}
 	return token(ident_type());
 }
 
 void scanner_init(char* source) {
+	scanner_resume(source, 1);
+}
+
+void scanner_resume(char *source, Linenr line) {
 	scanner.start = source;
 	scanner.current = source;
-	scanner.line = 1;
+	scanner.line = line;
 	scanner.offset = 0;
 }
 
@@ -78,6 +78,8 @@ typedef struct {
 } Token;
 
 void scanner_init(char *source);
+// Scans on from `source`, somewhere in the middle of a script, at `line`.
+void scanner_resume(char *source, Linenr line);
 Token scanner_next_token();
 
 #endif
@@ -0,0 +1,279 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "segment.h"
+#include "vm.h"
+
+// Buffers bigger than this get a block of their own.
+#define SEGMENT_BUFFER_MAX (HEAP_PAGE_SIZE / 4)
+
+static Segment *segment_new() {
+	Segment *segment = (Segment *)calloc(1, sizeof(Segment));
+	if (segment == NULL) {
+		exit(1);
+	}
+	segment->page.shared = true;
+	atomic_init(&segment->refs, 0);
+	table_init(&segment->strings);
+	return segment;
+}
+
+static void segment_free(Segment *segment) {
+	for (size_t i = 0; i < segment->block_count; i++) {
+		free(segment->blocks[i]);
+	}
+	free(segment->blocks);
+	free(segment->strings.entries);
+	free(segment);
+}
+
+static void segment_release(Segment *segment) {
+	if (atomic_fetch_sub(&segment->refs, 1) == 1) {
+		segment_free(segment);
+	}
+}
+
+static void add_block(Segment *segment, char *block) {
+	if (block == NULL) {
+		exit(1);
+	}
+	if (segment->block_count == segment->block_capacity) {
+		segment->block_capacity = GROW_CAPACITY(segment->block_capacity);
+		segment->blocks = (char **)realloc(segment->blocks, sizeof(char *) * segment->block_capacity);
+		if (segment->blocks == NULL) {
+			exit(1);
+		}
+	}
+	segment->blocks[segment->block_count++] = block;
+}
+
+static void *segment_alloc(Segment *segment, size_t size) {
+	size = (size + 7) & ~(size_t)7;
+	if (size > SEGMENT_BUFFER_MAX) {
+		// Only buffers get this big, and nothing looks for their descriptor.
+		char *buffer = (char *)malloc(size);
+		add_block(segment, buffer);
+		return buffer;
+	}
+	if (segment->bump == NULL || size > (size_t)(segment->limit - segment->bump)) {
+		char *block = (char *)aligned_alloc(HEAP_PAGE_SIZE, HEAP_PAGE_SIZE);
+		add_block(segment, block);
+		*(HeapPage **)block = &segment->page;
+		segment->bump = block + HEAP_PAGE_HEADER;
+		segment->limit = block + HEAP_PAGE_SIZE;
+	}
+	void *ptr = segment->bump;
+	segment->bump += size;
+	return ptr;
+}
+
+static String *segment_intern(Segment *segment, String *source) {
+	Table *strings = &segment->strings;
+	String *str = table_find_string(strings, source->chars, source->length, source->hash);
+	if (str != NULL) {
+		return str;
+	}
+
+	str = (String *)segment_alloc(segment, sizeof(String));
+	str->object.header = (uint64_t)OBJ_STRING;
+	str->length = source->length;
+	str->hash = source->hash;
+	str->chars = (char *)segment_alloc(segment, source->length + 1);
+	memcpy(str->chars, source->chars, source->length);
+	str->chars[source->length] = '\0';
+
+	size_t capacity = table_capacity_for(strings->count + 1);
+	if (capacity > strings->capacity) {
+		Table grown;
+		Entry *entries = (Entry *)malloc(sizeof(Entry) * capacity);
+		if (entries == NULL) {
+			exit(1);
+		}
+		table_init_fixed(&grown, entries, capacity);
+		table_add_all(strings, &grown);
+		free(strings->entries);
+		*strings = grown;
+	}
+	table_set(strings, str, NIL_VAL);
+	return str;
+}
+
+typedef struct {
+	Segment *segment;
+	// From objects in the heap to their frozen copies.
+	ObjectMap frozen;
+} Freezer;
+
+static bool freeze_value(Freezer *freezer, Value value, Value *out);
+
+static bool freeze_object(Freezer *freezer, Object *obj, Value *out) {
+	Value *frozen = object_map_get(&freezer->frozen, obj);
+	if (frozen != NULL) {
+		*out = *frozen;
+		return true;
+	}
+
+	switch (object_type(obj)) {
+	case OBJ_STRING:
+		*out = OBJ_VAL(segment_intern(freezer->segment, (String *)obj));
+		return true;
+	case OBJ_LIST: {
+		ValueArray *from = &((List *)obj)->values;
+		List *list = (List *)segment_alloc(freezer->segment, sizeof(List));
+		list->obj.header = (uint64_t)OBJ_LIST;
+		list->values.count = from->count;
+		list->values.capacity = from->count;
+		list->values.values = (Value *)segment_alloc(freezer->segment, sizeof(Value) * from->count);
+		*out = OBJ_VAL(list);
+		object_map_set(&freezer->frozen, obj, *out);
+		for (size_t i = 0; i < from->count; i++) {
+			if (!freeze_value(freezer, from->values[i], &list->values.values[i])) {
+				return false;
+			}
+		}
+		return true;
+	}
+	case OBJ_DICT: {
+		Table *from = &((Dictionary *)obj)->table;
+		size_t count = 0;
+		for (size_t i = 0; i < from->capacity; i++) {
+			count += from->entries[i].key != NULL && !IS_NIL(from->entries[i].value);
+		}
+		Dictionary *dict = (Dictionary *)segment_alloc(freezer->segment, sizeof(Dictionary));
+		dict->obj.header = (uint64_t)OBJ_DICT;
+		size_t capacity = table_capacity_for(count);
+		Entry *entries = (Entry *)segment_alloc(freezer->segment, sizeof(Entry) * capacity);
+		table_init_fixed(&dict->table, entries, capacity);
+		*out = OBJ_VAL(dict);
+		object_map_set(&freezer->frozen, obj, *out);
+		for (size_t i = 0; i < from->capacity; i++) {
+			Entry *entry = &from->entries[i];
+			if (entry->key == NULL || IS_NIL(entry->value)) {
+				continue;
+			}
+			Value value;
+			if (!freeze_value(freezer, entry->value, &value)) {
+				return false;
+			}
+			table_set(&dict->table, segment_intern(freezer->segment, entry->key), value);
+		}
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+static bool freeze_value(Freezer *freezer, Value value, Value *out) {
+	if (!IS_OBJ(value)) {
+		*out = value;
+		return true;
+	}
+	return freeze_object(freezer, AS_OBJ(value), out);
+}
+
+void segment_set_init(SegmentSet *set) {
+	set->refs = NULL;
+	set->count = 0;
+	set->capacity = 0;
+	set->last = 0;
+}
+
+void segment_set_free(SegmentSet *set) {
+	for (size_t i = 0; i < set->count; i++) {
+		segment_release(set->refs[i].segment);
+	}
+	free(set->refs);
+	segment_set_init(set);
+}
+
+static SegmentRef *find_ref(SegmentSet *set, Segment *segment) {
+	if (set->last < set->count && set->refs[set->last].segment == segment) {
+		return &set->refs[set->last];
+	}
+	for (size_t i = 0; i < set->count; i++) {
+		if (set->refs[i].segment == segment) {
+			set->last = i;
+			return &set->refs[i];
+		}
+	}
+	return NULL;
+}
+
+void segment_attach(SegmentSet *set, Segment *segment) {
+	SegmentRef *ref = find_ref(set, segment);
+	if (ref == NULL) {
+		if (set->count == set->capacity) {
+			set->capacity = GROW_CAPACITY(set->capacity);
+			set->refs = (SegmentRef *)realloc(set->refs, sizeof(SegmentRef) * set->capacity);
+			if (set->refs == NULL) {
+				exit(1);
+			}
+		}
+		atomic_fetch_add(&segment->refs, 1);
+		ref = &set->refs[set->count++];
+		ref->segment = segment;
+	}
+	ref->seen = true;
+}
+
+void segment_mark(SegmentSet *set, Object *obj) {
+	SegmentRef *ref = find_ref(set, segment_of(obj));
+	if (ref != NULL) {
+		ref->seen = true;
+	}
+}
+
+bool segment_is_seen(SegmentSet *set, Object *obj) {
+	SegmentRef *ref = find_ref(set, segment_of(obj));
+	return ref != NULL && ref->seen;
+}
+
+void segment_sweep(SegmentSet *set) {
+	size_t kept = 0;
+	for (size_t i = 0; i < set->count; i++) {
+		SegmentRef ref = set->refs[i];
+		if (!ref.seen) {
+			segment_release(ref.segment);
+			continue;
+		}
+		ref.seen = false;
+		set->refs[kept++] = ref;
+	}
+	set->count = kept;
+	set->last = 0;
+}
+
+String *segment_key(Object *container, String *key) {
+	bool frozen = heap_is_shared(container);
+	if (heap_is_shared(key) == frozen
+	    && (!frozen || segment_of((Object *)key) == segment_of(container))) {
+		return key;
+	}
+	Table *strings = frozen ? &segment_of(container)->strings : &vm.strings;
+	return table_find_string(strings, key->chars, key->length, key->hash);
+}
+
+// freeze(value) returns a frozen copy of value and everything it contains,
+// or nil if it contains anything but lists, dicts, strings, numbers,
+// booleans and nil. Values that aren't objects, or are frozen already, are
+// returned as they are.
+Value segment_freeze_native(uint8_t argc, Value *args) {
+	Value value = args[0];
+	if (!IS_OBJ(value) || heap_is_shared(AS_OBJ(value))) {
+		return value;
+	}
+	// Nothing here allocates on the heap, so the graph stays put.
+	Freezer freezer;
+	freezer.segment = segment_new();
+	object_map_init(&freezer.frozen);
+	Value frozen;
+	bool ok = freeze_value(&freezer, value, &frozen);
+	object_map_free(&freezer.frozen);
+	if (!ok) {
+		segment_free(freezer.segment);
+		return NIL_VAL;
+	}
+	segment_attach(&vm.segments, freezer.segment);
+	return frozen;
+}
@@ -0,0 +1,86 @@
+#ifndef clox_segment_h
+#define clox_segment_h
+
+#include <stdatomic.h>
+
+#include "common.h"
+#include "heap.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+
+// A shared segment holds an object graph frozen by freeze(): lists, dicts
+// and strings copied out of an isolate's heap into memory of their own, which
+// any number of isolates can then reference at once. Nothing in a segment is
+// written after freeze() returns, so no isolate needs a lock to read it.
+// Collectors skip it, compaction leaves it in place, and setting a field of a
+// frozen list or dict is a runtime error.
+//
+// Objects sit in blocks aligned like heap pages, each starting with a
+// pointer to the segment's page descriptor, which is marked `shared`. So
+// heap_is_shared tells frozen objects apart from an isolate's own without
+// touching them.
+//
+// A segment keeps one copy of each string, in a table of its own, so strings
+// within it compare by pointer. A string from an isolate's heap with the same
+// contents is a different object: value_equal compares the two by content,
+// and dict lookups translate keys with segment_key.
+
+typedef struct {
+  // Must come first: blocks point at it as their page descriptor.
+  HeapPage page;
+  // Isolates holding the segment.
+  atomic_size_t refs;
+  // Blocks of objects, and buffers too big for a block.
+  char **blocks;
+  size_t block_count;
+  size_t block_capacity;
+  char *bump;
+  char *limit;
+  // The segment's strings, with entries allocated outside any heap.
+  Table strings;
+} Segment;
+
+typedef struct {
+  Segment *segment;
+  // Whether anything referenced the segment since the last collection.
+  bool seen;
+} SegmentRef;
+
+// The segments an isolate holds a reference to. After every collection it
+// lets go of the ones its heap no longer points into.
+typedef struct {
+  SegmentRef *refs;
+  size_t count;
+  size_t capacity;
+  // Index of the last segment marked, which most marks hit again.
+  size_t last;
+} SegmentSet;
+
+static inline Segment *segment_of(Object *obj) {
+  return (Segment *)heap_page_of(obj);
+}
+
+void segment_set_init(SegmentSet *set);
+// Drops every reference the isolate holds.
+void segment_set_free(SegmentSet *set);
+// Takes a reference on `segment` for the isolate, unless it holds one
+// already. Call it for every frozen object that comes in from elsewhere, so
+// the segment can't be released while the object only sits in a C local.
+void segment_attach(SegmentSet *set, Segment *segment);
+// For the collector, on reaching a frozen object.
+void segment_mark(SegmentSet *set, Object *obj);
+// Whether `segment_mark` reached the segment of `obj` since the last sweep.
+bool segment_is_seen(SegmentSet *set, Object *obj);
+// Releases the segments nothing was seen referencing since the last call.
+void segment_sweep(SegmentSet *set);
+
+// The string with the contents of `key` that keys a dict next to
+// `container`: one from the same segment if the dict is frozen, otherwise
+// one interned in this isolate. NULL if there is none, in which case the key
+// can't be in the dict either.
+String *segment_key(Object *container, String *key);
+
+Value segment_freeze_native(uint8_t argc, Value *args);
+
+#endif
@@ -0,0 +1,541 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "serialize.h"
+#include "vm.h"
+
+#define SERIALIZE_MAGIC "LOXV"
+#define SERIALIZE_MAGIC_LENGTH 4
+// Bytes buffered between writes to, or reads from, a file.
+#define SERIALIZE_BLOCK (64 * 1024)
+// How deeply lists and dicts may nest, so that neither side runs out of C
+// stack on a deep (or malicious) input.
+#define SERIALIZE_DEPTH_MAX 10000
+
+typedef enum {
+	SERIAL_NIL,
+	SERIAL_FALSE,
+	SERIAL_TRUE,
+	SERIAL_INTEGER,
+	SERIAL_NUMBER,
+	SERIAL_STRING,
+	SERIAL_LIST,
+	SERIAL_DICT,
+	SERIAL_REFERENCE,
+} SerialTag;
+
+void serializer_init(Serializer *serializer, FILE *file) {
+	serializer->file = file;
+	serializer->length = 0;
+	serializer->capacity = file != NULL ? SERIALIZE_BLOCK : 0;
+	serializer->bytes = file != NULL ? (char *)malloc(SERIALIZE_BLOCK) : NULL;
+	if (file != NULL && serializer->bytes == NULL) {
+		exit(1);
+	}
+	serializer->failed = false;
+	object_map_init(&serializer->ids);
+	serializer->next_id = 0;
+}
+
+void serializer_free(Serializer *serializer) {
+	free(serializer->bytes);
+	object_map_free(&serializer->ids);
+}
+
+static void flush(Serializer *serializer) {
+	if (serializer->length > 0
+	    && fwrite(serializer->bytes, 1, serializer->length, serializer->file) != serializer->length) {
+		serializer->failed = true;
+	}
+	serializer->length = 0;
+}
+
+// Makes room for `count` more bytes.
+static void reserve(Serializer *serializer, size_t count) {
+	if (serializer->length + count <= serializer->capacity) {
+		return;
+	}
+	if (serializer->file != NULL) {
+		flush(serializer);
+		return;
+	}
+	size_t capacity = serializer->capacity < 64 ? 64 : serializer->capacity;
+	while (capacity < serializer->length + count) {
+		capacity *= 2;
+	}
+	serializer->bytes = (char *)realloc(serializer->bytes, capacity);
+	if (serializer->bytes == NULL) {
+		exit(1);
+	}
+	serializer->capacity = capacity;
+}
+
+static void write_byte(Serializer *serializer, uint8_t byte) {
+	reserve(serializer, 1);
+	serializer->bytes[serializer->length++] = (char)byte;
+}
+
+static void write_bytes(Serializer *serializer, const char *bytes, size_t count) {
+	if (serializer->file != NULL && count > serializer->capacity) {
+		flush(serializer);
+		if (fwrite(bytes, 1, count, serializer->file) != count) {
+			serializer->failed = true;
+		}
+		return;
+	}
+	reserve(serializer, count);
+	memcpy(serializer->bytes + serializer->length, bytes, count);
+	serializer->length += count;
+}
+
+static void write_varint(Serializer *serializer, uint64_t n) {
+	reserve(serializer, 10);
+	char *bytes = serializer->bytes;
+	while (n >= 0x80) {
+		bytes[serializer->length++] = (char)((n & 0x7f) | 0x80);
+		n >>= 7;
+	}
+	bytes[serializer->length++] = (char)n;
+}
+
+// Whether the number survives a round trip through an integer. Negative
+// zero doesn't, and neither does anything past 2^53.
+static bool as_integer(double number, int64_t *integer) {
+	if (!(number >= -9007199254740992.0 && number <= 9007199254740992.0)) {
+		return false;
+	}
+	*integer = (int64_t)number;
+	if ((double)*integer != number) {
+		return false;
+	}
+	uint64_t bits;
+	memcpy(&bits, &number, sizeof(bits));
+	return *integer != 0 || bits == 0;
+}
+
+static bool write_value(Serializer *serializer, Value value, size_t depth);
+
+static bool write_object(Serializer *serializer, Object *obj, size_t depth) {
+	Value *id = object_map_get(&serializer->ids, obj);
+	if (id != NULL) {
+		write_byte(serializer, SERIAL_REFERENCE);
+		write_varint(serializer, (uint64_t)AS_NUMBER(*id));
+		return true;
+	}
+	if (depth > SERIALIZE_DEPTH_MAX) {
+		return false;
+	}
+
+	switch (object_type(obj)) {
+	case OBJ_STRING: {
+		String *str = (String *)obj;
+		object_map_set(&serializer->ids, obj, NUMBER_VAL((double)serializer->next_id++));
+		write_byte(serializer, SERIAL_STRING);
+		write_varint(serializer, str->length);
+		write_bytes(serializer, str->chars, str->length);
+		return true;
+	}
+	case OBJ_LIST: {
+		ValueArray *values = &((List *)obj)->values;
+		object_map_set(&serializer->ids, obj, NUMBER_VAL((double)serializer->next_id++));
+		write_byte(serializer, SERIAL_LIST);
+		write_varint(serializer, values->count);
+		for (size_t i = 0; i < values->count; i++) {
+			if (!write_value(serializer, values->values[i], depth + 1)) {
+				return false;
+			}
+		}
+		return true;
+	}
+	case OBJ_DICT: {
+		Table *table = &((Dictionary *)obj)->table;
+		size_t count = 0;
+		for (size_t i = 0; i < table->capacity; i++) {
+			count += table->entries[i].key != NULL && !IS_NIL(table->entries[i].value);
+		}
+		object_map_set(&serializer->ids, obj, NUMBER_VAL((double)serializer->next_id++));
+		write_byte(serializer, SERIAL_DICT);
+		write_varint(serializer, count);
+		for (size_t i = 0; i < table->capacity; i++) {
+			Entry *entry = &table->entries[i];
+			if (entry->key == NULL || IS_NIL(entry->value)) {
+				continue;
+			}
+			if (!write_object(serializer, (Object *)entry->key, depth + 1)
+			    || !write_value(serializer, entry->value, depth + 1)) {
+				return false;
+			}
+		}
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+static bool write_value(Serializer *serializer, Value value, size_t depth) {
+	if (IS_NIL(value)) {
+		write_byte(serializer, SERIAL_NIL);
+	} else if (IS_BOOL(value)) {
+		write_byte(serializer, AS_BOOL(value) ? SERIAL_TRUE : SERIAL_FALSE);
+	} else if (IS_NUMBER(value)) {
+		double number = AS_NUMBER(value);
+		int64_t integer;
+		if (as_integer(number, &integer)) {
+			write_byte(serializer, SERIAL_INTEGER);
+			write_varint(serializer, ((uint64_t)integer << 1) ^ (uint64_t)(integer >> 63));
+		} else {
+			uint64_t bits;
+			memcpy(&bits, &number, sizeof(bits));
+			char bytes[8];
+			for (int i = 0; i < 8; i++) {
+				bytes[i] = (char)(bits >> (8 * i));
+			}
+			write_byte(serializer, SERIAL_NUMBER);
+			write_bytes(serializer, bytes, 8);
+		}
+	} else {
+		return write_object(serializer, AS_OBJ(value), depth);
+	}
+	return true;
+}
+
+bool serialize(Serializer *serializer, Value value) {
+	write_bytes(serializer, SERIALIZE_MAGIC, SERIALIZE_MAGIC_LENGTH);
+	write_byte(serializer, SERIALIZE_VERSION);
+	bool ok = write_value(serializer, value, 0);
+	if (serializer->file != NULL) {
+		flush(serializer);
+	}
+	return ok && !serializer->failed;
+}
+
+typedef struct {
+	// In memory the whole input, from a file the part read so far that
+	// hasn't been decoded.
+	const char *bytes;
+	size_t length;
+	size_t position;
+	FILE *file;
+	char *buffer;
+	// Strings, lists and dicts decoded so far, in id order. Being on the
+	// stack, it keeps everything decoded reachable.
+	List *objects;
+} Deserializer;
+
+// Makes sure `count` bytes are there to read, refilling the buffer from the
+// file if needed. `count` must fit in the buffer.
+static bool fill(Deserializer *deserializer, size_t count) {
+	size_t available = deserializer->length - deserializer->position;
+	if (available >= count) {
+		return true;
+	}
+	if (deserializer->file == NULL) {
+		return false;
+	}
+	memmove(deserializer->buffer, deserializer->buffer + deserializer->position, available);
+	deserializer->position = 0;
+	deserializer->length = available;
+	while (deserializer->length < count) {
+		size_t read = fread(deserializer->buffer + deserializer->length, 1,
+		                    SERIALIZE_BLOCK - deserializer->length, deserializer->file);
+		if (read == 0) {
+			return false;
+		}
+		deserializer->length += read;
+	}
+	return true;
+}
+
+static bool read_byte(Deserializer *deserializer, uint8_t *byte) {
+	if (!fill(deserializer, 1)) {
+		return false;
+	}
+	*byte = (uint8_t)deserializer->bytes[deserializer->position++];
+	return true;
+}
+
+static bool read_varint(Deserializer *deserializer, uint64_t *n) {
+	*n = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		uint8_t byte;
+		if (!read_byte(deserializer, &byte)) {
+			return false;
+		}
+		*n |= (uint64_t)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// An upper bound for how many values a list or dict can hold that still
+// leaves room to decode them, so a bogus count can't make us preallocate
+// more than the input could fill.
+static size_t plausible_count(Deserializer *deserializer, uint64_t count) {
+	size_t limit = deserializer->file != NULL
+	               ? SERIALIZE_BLOCK : deserializer->length - deserializer->position;
+	return count < limit ? (size_t)count : limit;
+}
+
+static void record(Deserializer *deserializer, Value value) {
+	// Growing the list can collect, and nothing else holds the value yet.
+	vm_push(value);
+	list_push(deserializer->objects, value);
+	vm_pop();
+}
+
+static bool read_string(Deserializer *deserializer, Value *value) {
+	uint64_t length;
+	if (!read_varint(deserializer, &length)) {
+		return false;
+	}
+	if (deserializer->file == NULL) {
+		if (length > deserializer->length - deserializer->position) {
+			return false;
+		}
+		*value = OBJ_VAL(copy_string(deserializer->bytes + deserializer->position, length));
+		deserializer->position += length;
+		record(deserializer, *value);
+		return true;
+	}
+
+	// Read it a block at a time, so a bogus length fails at the end of the
+	// file rather than allocating all of it up front.
+	char *chars = NULL;
+	size_t done = 0;
+	while (done < length) {
+		if (!fill(deserializer, 1)) {
+			free(chars);
+			return false;
+		}
+		size_t count = deserializer->length - deserializer->position;
+		if (count > length - done) {
+			count = length - done;
+		}
+		chars = (char *)realloc(chars, done + count + 1);
+		if (chars == NULL) {
+			exit(1);
+		}
+		memcpy(chars + done, deserializer->bytes + deserializer->position, count);
+		deserializer->position += count;
+		done += count;
+	}
+	*value = OBJ_VAL(copy_string(chars != NULL ? chars : "", length));
+	free(chars);
+	record(deserializer, *value);
+	return true;
+}
+
+static bool read_value(Deserializer *deserializer, Value *value, size_t depth) {
+	uint8_t tag;
+	if (!read_byte(deserializer, &tag)) {
+		return false;
+	}
+
+	switch (tag) {
+	case SERIAL_NIL:
+		*value = NIL_VAL;
+		return true;
+	case SERIAL_FALSE:
+		*value = FALSE_VAL;
+		return true;
+	case SERIAL_TRUE:
+		*value = TRUE_VAL;
+		return true;
+	case SERIAL_INTEGER: {
+		uint64_t n;
+		if (!read_varint(deserializer, &n)) {
+			return false;
+		}
+		*value = NUMBER_VAL((double)(int64_t)((n >> 1) ^ (~(n & 1) + 1)));
+		return true;
+	}
+	case SERIAL_NUMBER: {
+		if (!fill(deserializer, 8)) {
+			return false;
+		}
+		uint64_t bits = 0;
+		for (int i = 0; i < 8; i++) {
+			bits |= (uint64_t)(uint8_t)deserializer->bytes[deserializer->position++] << (8 * i);
+		}
+		double number;
+		memcpy(&number, &bits, sizeof(number));
+		if (number != number) {
+			// Any other NaN could pass for a boxed value.
+			bits = 0x7ff8000000000000;
+			memcpy(&number, &bits, sizeof(number));
+		}
+		*value = NUMBER_VAL(number);
+		return true;
+	}
+	case SERIAL_STRING:
+		return read_string(deserializer, value);
+	case SERIAL_LIST: {
+		uint64_t count;
+		if (depth > SERIALIZE_DEPTH_MAX || !read_varint(deserializer, &count)) {
+			return false;
+		}
+		List *list = list_new();
+		*value = OBJ_VAL(list);
+		record(deserializer, *value);
+		size_t capacity = plausible_count(deserializer, count);
+		if (capacity > 0) {
+			Value *values = GROW_ARRAY(Value, NULL, 0, capacity);
+			list->values.values = values;
+			list->values.capacity = capacity;
+		}
+		for (uint64_t i = 0; i < count; i++) {
+			Value element;
+			if (!read_value(deserializer, &element, depth + 1)) {
+				return false;
+			}
+			list_push(list, element);
+		}
+		return true;
+	}
+	case SERIAL_DICT: {
+		uint64_t count;
+		if (depth > SERIALIZE_DEPTH_MAX || !read_varint(deserializer, &count)) {
+			return false;
+		}
+		Dictionary *dict = dict_new();
+		*value = OBJ_VAL(dict);
+		record(deserializer, *value);
+		size_t capacity = table_capacity_for(plausible_count(deserializer, count));
+		Entry *entries = ALLOCATE(Entry, capacity);
+		table_init_fixed(&dict->table, entries, capacity);
+		for (uint64_t i = 0; i < count; i++) {
+			Value key;
+			Value element;
+			if (!read_value(deserializer, &key, depth + 1) || !IS_STRING(key)
+			    || !read_value(deserializer, &element, depth + 1)) {
+				return false;
+			}
+			dict_set(dict, AS_STRING(key), element);
+		}
+		return true;
+	}
+	case SERIAL_REFERENCE: {
+		uint64_t id;
+		if (!read_varint(deserializer, &id) || id >= deserializer->objects->values.count) {
+			return false;
+		}
+		*value = deserializer->objects->values.values[id];
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+static bool read_root(Deserializer *deserializer, Value *value) {
+	if (!fill(deserializer, SERIALIZE_MAGIC_LENGTH + 1)
+	    || memcmp(deserializer->bytes + deserializer->position, SERIALIZE_MAGIC, SERIALIZE_MAGIC_LENGTH) != 0
+	    || deserializer->bytes[deserializer->position + SERIALIZE_MAGIC_LENGTH] != SERIALIZE_VERSION) {
+		return false;
+	}
+	deserializer->position += SERIALIZE_MAGIC_LENGTH + 1;
+
+	deserializer->objects = list_new();
+	vm_push(OBJ_VAL(deserializer->objects));
+	bool ok = read_value(deserializer, value, 0);
+	vm_pop();
+	return ok;
+}
+
+bool deserialize(const char *bytes, size_t length, Value *value) {
+	Deserializer deserializer;
+	deserializer.bytes = bytes;
+	deserializer.length = length;
+	deserializer.position = 0;
+	deserializer.file = NULL;
+	deserializer.buffer = NULL;
+	return read_root(&deserializer, value) && deserializer.position == length;
+}
+
+bool deserialize_file(FILE *file, Value *value) {
+	Deserializer deserializer;
+	deserializer.buffer = (char *)malloc(SERIALIZE_BLOCK);
+	if (deserializer.buffer == NULL) {
+		exit(1);
+	}
+	deserializer.bytes = deserializer.buffer;
+	deserializer.length = 0;
+	deserializer.position = 0;
+	deserializer.file = file;
+	bool ok = read_root(&deserializer, value);
+	free(deserializer.buffer);
+	return ok;
+}
+
+// serialize(value) returns the encoding of value as a string, or nil if it
+// holds something that can't be encoded.
+Value serialize_native(uint8_t argc, Value *args) {
+	Serializer serializer;
+	serializer_init(&serializer, NULL);
+	Value result = NIL_VAL;
+	if (serialize(&serializer, args[0])) {
+		result = OBJ_VAL(copy_string(serializer.bytes, serializer.length));
+	}
+	serializer_free(&serializer);
+	return result;
+}
+
+// deserialize(bytes) decodes a string made by serialize(), or returns nil
+// if it isn't one.
+Value deserialize_native(uint8_t argc, Value *args) {
+	if (!IS_STRING(args[0])) {
+		return NIL_VAL;
+	}
+	String *bytes = AS_STRING(args[0]);
+	Value value;
+	return deserialize(bytes->chars, bytes->length, &value) ? value : NIL_VAL;
+}
+
+// Strings aren't necessarily null-terminated.
+static FILE *open_path(Value path, const char *mode) {
+	if (!IS_STRING(path)) {
+		return NULL;
+	}
+	String *str = AS_STRING(path);
+	char *name = (char *)malloc(str->length + 1);
+	if (name == NULL) {
+		exit(1);
+	}
+	memcpy(name, str->chars, str->length);
+	name[str->length] = '\0';
+	FILE *file = fopen(name, mode);
+	free(name);
+	return file;
+}
+
+// save(path, value) writes the encoding of value to a file, and returns
+// whether that worked.
+Value serialize_save_native(uint8_t argc, Value *args) {
+	FILE *file = open_path(args[0], "wb");
+	if (file == NULL) {
+		return FALSE_VAL;
+	}
+	Serializer serializer;
+	serializer_init(&serializer, file);
+	bool ok = serialize(&serializer, args[1]);
+	serializer_free(&serializer);
+	ok = fclose(file) == 0 && ok;
+	return BOOL_VAL(ok);
+}
+
+// load(path) decodes a file written by save(), or returns nil if it can't.
+Value serialize_load_native(uint8_t argc, Value *args) {
+	FILE *file = open_path(args[0], "rb");
+	if (file == NULL) {
+		return NIL_VAL;
+	}
+	Value value;
+	bool ok = deserialize_file(file, &value);
+	fclose(file);
+	return ok ? value : NIL_VAL;
+}
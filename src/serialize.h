@@ -0,0 +1,61 @@
+#ifndef clox_serialize_h
+#define clox_serialize_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "table.h"
+#include "value.h"
+
+// A binary encoding of nil, booleans, numbers, strings, lists and dicts.
+// The bytes start with "LOXV" and a version byte, followed by one value:
+//
+//   nil, false, true   a tag byte
+//   integer            tag, zigzag varint (integral numbers up to 2^53)
+//   number             tag, 8 bytes, the double's bits little-endian
+//   string             tag, varint length, bytes
+//   list               tag, varint count, that many values
+//   dict               tag, varint count, that many key and value pairs
+//   reference          tag, varint id
+//
+// Every string, list and dict is given the next id, counting from 0, when
+// it's first written, and is written as a reference after that. So a key
+// that repeats is written once, and shared lists and cycles come back as
+// they were. Functions, coroutines and channels can't be encoded.
+//
+// The encoder and decoder keep their state outside the heap and the bytes
+// in malloc'd memory, so values can be encoded in one isolate and decoded
+// in another, whatever either is doing in the meantime.
+
+#define SERIALIZE_VERSION 1
+
+typedef struct {
+  char *bytes;
+  size_t length;
+  size_t capacity;
+  // Where to flush `bytes` as they fill up, or NULL to keep them all.
+  FILE *file;
+  bool failed;
+  // Objects written so far, to their ids.
+  ObjectMap ids;
+  size_t next_id;
+} Serializer;
+
+// Writes to `file` if it isn't NULL, and to memory otherwise.
+void serializer_init(Serializer *serializer, FILE *file);
+void serializer_free(Serializer *serializer);
+// Encodes `value`. Returns false if it holds something that can't be
+// encoded, or the file couldn't be written.
+bool serialize(Serializer *serializer, Value value);
+
+// Decodes a value from `length` bytes, into this isolate's heap.
+bool deserialize(const char *bytes, size_t length, Value *value);
+// Decodes a value from the rest of `file`, reading it a block at a time.
+bool deserialize_file(FILE *file, Value *value);
+
+Value serialize_native(uint8_t argc, Value *args);
+Value deserialize_native(uint8_t argc, Value *args);
+Value serialize_save_native(uint8_t argc, Value *args);
+Value serialize_load_native(uint8_t argc, Value *args);
+
+#endif
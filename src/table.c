@@ -15,6 +15,24 @@ void table_init(Table *table) {
 	table->entries = NULL;
 }
 
+void table_init_fixed(Table *table, Entry *entries, size_t capacity) {
+	for (size_t i = 0; i < capacity; i++) {
+		entries[i].key = NULL;
+		entries[i].value = NIL_VAL;
+	}
+	table->count = 0;
+	table->capacity = capacity;
+	table->entries = entries;
+}
+
+size_t table_capacity_for(size_t count) {
+	size_t capacity = GROW_CAPACITY(0);
+	while (count > capacity * TABLE_MAX_LOAD) {
+		capacity = GROW_CAPACITY(capacity);
+	}
+	return capacity;
+}
+
 void table_free(Table *table) {
 	FREE_ARRAY(Entry, table->entries, table->capacity);
 	table_init(table);
@@ -172,6 +190,71 @@ String* table_find_string(Table *table, const char *chars, size_t length, uint32
 	}
 }
 
+void object_map_init(ObjectMap *map) {
+	map->keys = NULL;
+	map->values = NULL;
+	map->count = 0;
+	map->capacity = 0;
+}
+
+void object_map_free(ObjectMap *map) {
+	free(map->keys);
+	free(map->values);
+	object_map_init(map);
+}
+
+static size_t pointer_hash(Object *obj, size_t capacity) {
+	return (size_t)(((uintptr_t)obj >> 4) * 11400714819323198485ull) & (capacity - 1);
+}
+
+Value *object_map_get(ObjectMap *map, Object *key) {
+	if (map->count == 0) {
+		return NULL;
+	}
+	for (size_t i = pointer_hash(key, map->capacity);; i = (i + 1) & (map->capacity - 1)) {
+		if (map->keys[i] == key) {
+			return &map->values[i];
+		}
+		if (map->keys[i] == NULL) {
+			return NULL;
+		}
+	}
+}
+
+void object_map_set(ObjectMap *map, Object *key, Value value) {
+	if (map->count + 1 > map->capacity / 2) {
+		size_t capacity = map->capacity < 16 ? 16 : map->capacity * 2;
+		Object **keys = (Object **)calloc(capacity, sizeof(Object *));
+		Value *values = (Value *)malloc(capacity * sizeof(Value));
+		if (keys == NULL || values == NULL) {
+			exit(1);
+		}
+		for (size_t i = 0; i < map->capacity; i++) {
+			if (map->keys[i] == NULL) {
+				continue;
+			}
+			size_t j = pointer_hash(map->keys[i], capacity);
+			while (keys[j] != NULL) {
+				j = (j + 1) & (capacity - 1);
+			}
+			keys[j] = map->keys[i];
+			values[j] = map->values[i];
+		}
+		free(map->keys);
+		free(map->values);
+		map->keys = keys;
+		map->values = values;
+		map->capacity = capacity;
+	}
+	size_t i = pointer_hash(key, map->capacity);
+	while (map->keys[i] != NULL) {
+		i = (i + 1) & (map->capacity - 1);
+	}
+	map->keys[i] = key;
+	map->values[i] = value;
+	map->count++;
+}
+
 void table_print(Table *table, char *name) {
 	if (name) {
 		printf("%s: {", name);
@@ -204,11 +287,19 @@ void table_mark(Table *table) {
 	}
 }
 
+// Keys keep their hash when they move, so entries stay in their buckets.
+void table_forward(Table *table) {
+	for (size_t i = 0; i < table->capacity; i++) {
+		Entry *entry = &table->entries[i];
+		entry->key = (String *)gc_forward((Object *)entry->key);
+		gc_forward_value(&entry->value);
+	}
+}
+
 void table_remove_white(Table *table) {
 	for (size_t i = 0; i < table->capacity; i++) {
 		Entry *entry = &table->entries[i];
-		if (entry->key != NULL
-		    && object_is_marked(&entry->key->object) != vm.mark_value) {
+		if (entry->key != NULL && !heap_is_marked(entry->key)) {
 			table_delete(table, entry->key);
 		}
 	}
@@ -15,7 +15,21 @@ typedef struct {
   Entry *entries;
 } Table;
 
+// Maps objects to values by identity. Lives outside the heap, for copying
+// object graphs while each object is copied once.
+typedef struct {
+  Object **keys;
+  Value *values;
+  size_t count;
+  size_t capacity;
+} ObjectMap;
+
 void table_init(Table *table);
+// Makes `table` use `entries`, which the caller allocated and frees. It
+// must not be grown: see table_capacity_for.
+void table_init_fixed(Table *table, Entry *entries, size_t capacity);
+// The capacity a table needs to hold `count` entries without growing.
+size_t table_capacity_for(size_t count);
 void table_free(Table *table);
 void table_add_all(Table *from, Table *to);
 bool table_has_key(Table *table, String *key);
@@ -29,6 +43,13 @@ String *table_find_string(Table *table, const char *chars, size_t length,
 
 void table_print(Table *table, char *name);
 
+void object_map_init(ObjectMap *map);
+void object_map_free(ObjectMap *map);
+Value *object_map_get(ObjectMap *map, Object *key);
+// `key` must not be in the map yet.
+void object_map_set(ObjectMap *map, Object *key, Value value);
+
 void table_mark(Table *table);
+void table_forward(Table *table);
 
 #endif
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "heap.h"
 #include "memory.h"
 #include "object.h"
 #include "value.h"
@@ -73,9 +74,22 @@ void value_println(Value value) {
 	value_fprintln(stdout, value);
 }
 
+// Strings are interned, so equal strings are the same object, except when
+// one of them is frozen (see segment.h).
+static bool frozen_strings_equal(Value a, Value b) {
+	if (!IS_STRING(a) || !IS_STRING(b)) {
+		return false;
+	}
+	String *x = AS_STRING(a);
+	String *y = AS_STRING(b);
+	return (heap_is_shared(x) || heap_is_shared(y))
+	       && x->length == y->length && x->hash == y->hash
+	       && memcmp(x->chars, y->chars, x->length) == 0;
+}
+
 bool value_equal(Value a, Value b) {
 #ifdef NAN_BOXING
-	return a == b;
+	return a == b || frozen_strings_equal(a, b);
 #else
 	if (a.type != b.type){
 		return false;
@@ -87,7 +101,7 @@ bool value_equal(Value a, Value b) {
 	case VAL_BOOL:
 		return AS_BOOL(a) == AS_BOOL(b);
 	case VAL_OBJ:
-		return AS_OBJ(a) == AS_OBJ(b);
+		return AS_OBJ(a) == AS_OBJ(b) || frozen_strings_equal(a, b);
 	case VAL_NIL:
 		return true;
 	default:
@@ -142,6 +156,8 @@ const ConstStr value_type_name(Value value) {
 			return CONST_STR(dict);
 		case OBJ_COROUTINE:
 			return CONST_STR(coroutine);
+		case OBJ_CHANNEL:
+			return CONST_STR(channel);
 		}
 	}
 }
@@ -13,8 +13,11 @@ typedef enum {
   OBJ_LIST,
   OBJ_DICT,
   OBJ_COROUTINE,
+  OBJ_CHANNEL,
 } ObjectType;
 
+#define OBJ_TYPE_COUNT (OBJ_CHANNEL + 1)
+
 typedef enum ValueType {
   VAL_BOOL,
   VAL_NIL,
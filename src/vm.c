@@ -4,8 +4,16 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "bytecode.h"
+#include "channel.h"
 #include "chunk.h"
+#include "compiler.h"
+#include "isolate.h"
 #include "memory.h"
+#include "parallel.h"
+#include "prefork.h"
+#include "segment.h"
+#include "serialize.h"
 #include "vm.h"
 #include "object.h"
 #include "value.h"
@@ -14,7 +22,7 @@
 #include "debug.h"
 #endif
 
-VM vm;
+THREAD_LOCAL VM vm;
 
 static Value clock_native(uint8_t argc, Value *args) {
 	return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
@@ -40,10 +48,68 @@ static Value coro_reset_native(uint8_t argc, Value *args) {
 		return NIL_VAL;
 	}
 	Coroutine *co = AS_COROUTINE(args[0]);
-	coroutine_reset(co);
+	// A running coroutine's frames are still in use.
+	if (co->state != COROUTINE_RUNNING) {
+		coroutine_reset(co);
+	}
 	return NIL_VAL;
 }
 
+static void set_stat(Dictionary *dict, const char *name, Value value) {
+	vm_push(OBJ_VAL(copy_string(name, strlen(name))));
+	dict_set(dict, AS_STRING(vm_peek(0)), value);
+	vm_pop();
+}
+
+// gc_stats() returns a snapshot of what the collector has done so far. Times
+// are in seconds. "pause_histogram"[i] counts pauses shorter than 2^i
+// microseconds, with the last entry taking everything longer.
+static Value gc_stats_native(uint8_t argc, Value *args) {
+	GcStats *stats = &vm.gc_stats;
+	Dictionary *dict = dict_new();
+	vm_push(OBJ_VAL(dict));
+
+	set_stat(dict, "collections", NUMBER_VAL((double)stats->collections));
+	set_stat(dict, "pause_total", NUMBER_VAL(stats->pause_total_ns / 1e9));
+	set_stat(dict, "pause_max", NUMBER_VAL(stats->pause_max_ns / 1e9));
+	set_stat(dict, "mark_total", NUMBER_VAL(stats->mark_total_ns / 1e9));
+	set_stat(dict, "bytes_allocated",
+	         NUMBER_VAL((double)(stats->bytes_freed + vm.bytes_allocated)));
+	set_stat(dict, "bytes_freed", NUMBER_VAL((double)stats->bytes_freed));
+	set_stat(dict, "live_bytes", NUMBER_VAL((double)vm.bytes_allocated));
+	set_stat(dict, "next_gc", NUMBER_VAL((double)vm.next_gc));
+	set_stat(dict, "compactions", NUMBER_VAL((double)stats->compactions));
+	set_stat(dict, "bytes_moved", NUMBER_VAL((double)stats->bytes_moved));
+
+	List *histogram = list_new();
+	vm_push(OBJ_VAL(histogram));
+	for (size_t i = 0; i < GC_PAUSE_BUCKETS; i++) {
+		list_push(histogram, NUMBER_VAL((double)stats->pause_histogram[i]));
+	}
+	set_stat(dict, "pause_histogram", OBJ_VAL(histogram));
+	vm_pop();
+
+	// Count before allocating the per-type dicts so they don't show up.
+	GcObjectStats objects;
+	gc_object_stats(&objects);
+
+	Dictionary *by_type = dict_new();
+	vm_push(OBJ_VAL(by_type));
+	for (size_t i = 0; i < OBJ_TYPE_COUNT; i++) {
+		Dictionary *entry = dict_new();
+		vm_push(OBJ_VAL(entry));
+		set_stat(entry, "count", NUMBER_VAL((double)objects.count[i]));
+		set_stat(entry, "bytes", NUMBER_VAL((double)objects.bytes[i]));
+		set_stat(by_type, object_type_name((ObjectType)i), OBJ_VAL(entry));
+		vm_pop();
+	}
+	set_stat(dict, "objects", OBJ_VAL(by_type));
+	vm_pop();
+
+	vm_pop();
+	return OBJ_VAL(dict);
+}
+
 static Value type_native(uint8_t argc, Value *args) {
 	const ConstStr type = value_type_name(args[0]);
 	String *string = copy_string(type.chars, type.length);
@@ -128,17 +194,25 @@ static void define_native(const char *name, NativeFnPtr function, uint8_t arity)
 }
 
 char *vm_init() {
-	vm.objects = NULL;
-	vm.open_upvalues = NULL;
+	heap_init(&vm.heap);
 
 	vm.bytes_allocated = 0;
-	vm.next_gc = 1024 * 1024;
-
-	vm.mark_value = true;
+	gc_init();
+	coroutine_pool_init(&vm.coroutine_pool);
+	segment_set_init(&vm.segments);
+	loop_init(&vm.loop);
+	vm.resume_base = NULL;
+	vm.resume_depth = 0;
+	vm.resume_nesting = 0;
+	vm.native_error = false;
+	vm.native_parked = false;
 
 	vm.gray_count = 0;
 	vm.gray_capacity = 0;
 	vm.gray_stack = NULL;
+	vm.stale_count = 0;
+	vm.stale_capacity = 0;
+	vm.stale_stacks = NULL;
 
 	vm.main = NULL;
 	vm.running = NULL;
@@ -153,14 +227,41 @@ char *vm_init() {
 	define_native("type", type_native, 1);
 	define_native("is", is_type_native, 2);
 	define_native("reset", coro_reset_native, 1);
+	define_native("gc_stats", gc_stats_native, 0);
+	define_native("spawn", loop_spawn_native, 1);
+	define_native("run", loop_run_native, 0);
+	define_native("sleep", loop_sleep_native, 1);
+	define_native("readable", loop_readable_native, 1);
+	define_native("writable", loop_writable_native, 1);
+	define_native("pipe", loop_pipe_native, 0);
+	define_native("socketpair", loop_socketpair_native, 0);
+	define_native("read", loop_read_native, 2);
+	define_native("write", loop_write_native, 2);
+	define_native("close", loop_close_native, 1);
+	define_native("channel", channel_native, 1);
+	define_native("send", channel_send_native, 2);
+	define_native("recv", channel_recv_native, 1);
+	define_native("isolates", isolate_run_native, 1);
+	define_native("parallel_map", parallel_map_native, 2);
+	define_native("parallel_reduce", parallel_reduce_native, 3);
+	define_native("fork_workers", prefork_workers_native, 2);
+	define_native("freeze", segment_freeze_native, 1);
+	define_native("serialize", serialize_native, 1);
+	define_native("deserialize", deserialize_native, 1);
+	define_native("save", serialize_save_native, 2);
+	define_native("load", serialize_load_native, 1);
+	define_native("snapshot", bytecode_snapshot_native, 2);
 
 	return NULL;
 }
 
 void vm_free() {
+	loop_free(&vm.loop);
 	table_free(&vm.globals);
 	table_free(&vm.strings);
 	free_objects();
+	segment_set_free(&vm.segments);
+	heap_free(&vm.heap);
 }
 
 void vm_push(Value value) {
@@ -269,7 +370,7 @@ static void concatonate() {
 static Upvalue* upvalue_capture(Value *local) {
 	Upvalue *prev_upvalue = NULL;
 
-	Upvalue *upvalue = vm.open_upvalues;
+	Upvalue *upvalue = vm.running->open_upvalues;
 	while (upvalue != NULL && upvalue->location > local) {
 		prev_upvalue = upvalue;
 		upvalue = upvalue->next;
@@ -283,7 +384,7 @@ static Upvalue* upvalue_capture(Value *local) {
 	created->next = upvalue;
 
 	if (prev_upvalue == NULL) {
-		vm.open_upvalues = created;
+		vm.running->open_upvalues = created;
 	} else {
 		prev_upvalue->next = created;
 	}
@@ -292,15 +393,21 @@ static Upvalue* upvalue_capture(Value *local) {
 }
 
 static void close_upvalues(Value *last) {
-	while (vm.open_upvalues != NULL && vm.open_upvalues->location >= last) {
-		Upvalue *upvalue = vm.open_upvalues;
+	Coroutine *co = vm.running;
+	while (co->open_upvalues != NULL && co->open_upvalues->location >= last) {
+		Upvalue *upvalue = co->open_upvalues;
 		upvalue->closed = *upvalue->location;
 		upvalue->location = &upvalue->closed;
-		vm.open_upvalues = upvalue->next;
+		co->open_upvalues = upvalue->next;
 	}
 }
 
 static bool set_field(Value container, Value key, Value value) {
+	if (IS_OBJ(container) && heap_is_shared(AS_OBJ(container))) {
+		ConstStr type = value_type_name(container);
+		runtime_error("Attempted to mutate a frozen %.*s value.", type.length, type.chars);
+		return false;
+	}
 	if (IS_LIST(container)) {
 #ifdef DYNAMIC_TYPE_CHECKING
 		if (!IS_NUMBER(key)) {
@@ -323,7 +430,13 @@ static bool set_field(Value container, Value key, Value value) {
 			return false;
 		}
 #endif
-		dict_set(AS_DICT(container), AS_STRING(key), value);
+		String *name = AS_STRING(key);
+		if (heap_is_shared(name)) {
+			// Keys here have to be this isolate's strings. The container
+			// and value are still on the stack.
+			name = copy_string(name->chars, name->length);
+		}
+		dict_set(AS_DICT(container), name, value);
 		return true;
 	}
 	ConstStr type = value_type_name(container);
@@ -355,7 +468,8 @@ static bool get_field(Value container, Value key) {
 		}
 #endif
 
-		vm_push(dict_get(AS_DICT(container), AS_STRING(key)));
+		String *name = segment_key(AS_OBJ(container), AS_STRING(key));
+		vm_push(name != NULL ? dict_get(AS_DICT(container), name) : NIL_VAL);
 		return true;
 	}
 	ConstStr type = value_type_name(container);
@@ -363,15 +477,33 @@ static bool get_field(Value container, Value key) {
 	return false;
 }
 
-bool vm_call(Closure *closure, uint8_t argc) {
-#ifdef DYNAMIC_TYPE_CHECKING
-	if (argc != closure->function->arity) {
-		runtime_error("Expected %d arguments but got %d.", closure->function->arity, argc);
-		return false;
+// The container is kept on the stack while it is filled, since growing it can
+// trigger a collection.
+static void build_list(uint32_t count) {
+	List *list = list_new();
+	vm_push(OBJ_VAL(list));
+	for (uint32_t i = 0; i < count; i++) {
+		list_push(list, vm_peek(count - i));
 	}
-#endif
-	Coroutine *co = vm.running;
+	vm.running->stack_top -= count + 1;
+	vm_push(OBJ_VAL(list));
+}
 
+static void build_dict(uint32_t count) {
+	Dictionary *dict = dict_new();
+	vm_push(OBJ_VAL(dict));
+	for (uint32_t i = count; i > 0; i--) {
+		// because of the compiler, the key should *always* be a string
+		Value key = vm_peek(i * 2);
+		Value value = vm_peek(i * 2 - 1);
+		dict_set(dict, AS_STRING(key), value);
+	}
+	vm.running->stack_top -= count * 2 + 1;
+	vm_push(OBJ_VAL(dict));
+}
+
+// Makes sure `co` has room for one more frame.
+static bool reserve_frame(Coroutine *co) {
 	if (co->frame_count == FRAMES_MAX) {
 		runtime_error("Stack overflow.");
 		return false;
@@ -383,17 +515,67 @@ bool vm_call(Closure *closure, uint8_t argc) {
 		co->frames = GROW_ARRAY(CallFrame, co->frames, co->frame_capacity, new_capacity);
 		co->frame_capacity = new_capacity;
 	}
+	return true;
+}
+
+bool vm_call(Closure *closure, uint8_t argc) {
+#ifdef DYNAMIC_TYPE_CHECKING
+	if (argc != closure->function->arity) {
+		runtime_error("Expected %d arguments but got %d.", closure->function->arity, argc);
+		return false;
+	}
+#endif
+	if (closure->function->lazy != NULL && !compile_body(closure->function)) {
+		runtime_error("Could not compile the function's body.");
+		return false;
+	}
+	Coroutine *co = vm.running;
+
+	if (!reserve_frame(co)) {
+		return false;
+	}
 
 	CallFrame *frame = &co->frames[co->frame_count++];
 	frame->closure = closure;
 	frame->ip = closure->function->chunk.code;
 	frame->slots = co->stack_top - argc - 1; // -1 to account for reserved stack slot 0
+	frame->generator = NULL;
 
 	co->current_frame = frame;
 
 	return true;
 }
 
+static void promote_generator(CallFrame **fr);
+
+// The coroutine a native would suspend by calling vm_park, or NULL if the
+// running code can't be suspended (it isn't in a coroutine).
+Coroutine *vm_parkable() {
+	Coroutine *co = vm.running;
+	for (size_t i = co->frame_count; co->generator_frames > 0 && i > 0; i--) {
+		if (co->frames[i - 1].generator != NULL) {
+			return co->frames[i - 1].generator;
+		}
+	}
+	return co->parent != NULL ? co : NULL;
+}
+
+// Called by a native to suspend its caller, vm_parkable(), once it returns,
+// like an await would. Whatever resumes it passes the value the native call
+// evaluates to.
+void vm_park() {
+	vm.native_parked = true;
+}
+
+static void park_running() {
+	CallFrame *frame = vm.running->current_frame;
+	if (vm.running->generator_frames > 0) {
+		promote_generator(&frame);
+	}
+	vm.running->state = COROUTINE_AWAITING;
+	vm.running = vm.running->parent;
+}
+
 static bool call_native(NativeFunction *native, uint8_t argc) {
 #ifdef NATIVE_ARITY_CHECKING
 	if (argc != native->arity) {
@@ -403,11 +585,72 @@ static bool call_native(NativeFunction *native, uint8_t argc) {
 #endif
 
 	Value result = native->function(argc, vm.running->stack_top - argc);
+	if (vm.native_error) {
+		// The stack has already been reset.
+		vm.native_error = false;
+		return false;
+	}
 	vm.running->stack_top -= argc + 1;
+	if (vm.native_parked) {
+		vm.native_parked = false;
+		park_running();
+		return true;
+	}
 	vm_push(result);
 	return true;
 }
 
+// Resumes a stackless coroutine as a frame on the running coroutine's stack,
+// which is pretty much an ordinary call.
+static bool resume_generator(Coroutine *gen, uint8_t argc) {
+	Coroutine *co = vm.running;
+	if (!reserve_frame(co)) {
+		return false;
+	}
+
+	// The caller left the coroutine and the arguments on the stack, where the
+	// saved slots go. Slot 0 is the coroutine itself, and the parameters are
+	// rebound to the arguments, as for a regular coroutine (see
+	// rebind_arguments).
+	size_t saved = gen->stack_top - gen->stack;
+	if (saved > 0) {
+		size_t rebound = argc < gen->closure->function->arity ? argc : gen->closure->function->arity;
+		if (saved > (size_t)argc + 1) {
+			coroutine_reserve(co, saved - argc - 1);
+		}
+		Value *slots = co->stack_top - argc - 1;
+		for (size_t i = rebound + 1; i < saved; i++) {
+			slots[i] = gen->stack[i];
+		}
+		co->stack_top = slots + saved;
+	}
+	gen->stack_top = gen->stack;
+
+	CallFrame *frame = &co->frames[co->frame_count++];
+	frame->closure = gen->closure;
+	frame->ip = gen->resume_ip;
+	frame->slots = saved > 0 ? co->stack_top - saved : co->stack_top - argc - 1;
+	frame->generator = gen;
+	co->current_frame = frame;
+	co->generator_frames++;
+
+	gen->state = COROUTINE_RUNNING;
+	return true;
+}
+
+// Resuming a coroutine that yielded passes its parameters again: the
+// arguments replace them, as many as both have, and its other slots are
+// left as they were.
+static void rebind_arguments(Coroutine *co, uint8_t argc) {
+	Value *params = co->frames[0].slots + 1;
+	Value *args = vm.running->stack_top - argc;
+	uint8_t arity = co->frames[0].closure->function->arity;
+	for (uint8_t i = 0; i < argc && i < arity; i++) {
+		params[i] = args[i];
+	}
+	vm.running->stack_top -= argc;
+}
+
 static bool call_coroutine(Coroutine *co, uint8_t argc) {
 	switch(co->state){
 	case COROUTINE_RUNNING:
@@ -419,14 +662,29 @@ static bool call_coroutine(Coroutine *co, uint8_t argc) {
 	case COROUTINE_COMPLETE:
 		coroutine_reset(co);
 	case COROUTINE_READY:
-		coroutine_push(co, OBJ_VAL(co));
+		if (!co->stackless) {
+			coroutine_push(co, OBJ_VAL(co));
+		}
 		break;
 	case COROUTINE_PAUSED:
+	case COROUTINE_AWAITING:
 		break;
 	}
 
-	for (size_t i = 0; i < argc; i++) {
-		coroutine_push(co, vm_pop());
+	if (co->stackless) {
+		return resume_generator(co, argc);
+	}
+
+	if (co->state == COROUTINE_PAUSED) {
+		rebind_arguments(co, argc);
+	} else {
+		// The arguments stay on the caller's stack, where the collector can
+		// see them, until they have all been copied over. Resuming an await
+		// passes the value it evaluates to.
+		for (size_t i = argc; i > 0; i--) {
+			coroutine_push(co, vm_peek(i - 1));
+		}
+		vm.running->stack_top -= argc;
 	}
 
 	co->parent = vm.running;
@@ -453,6 +711,7 @@ static bool call_value(Value callee, uint8_t argc) {
 		case OBJ_UPVALUE:
 		case OBJ_DICT:
 		case OBJ_STRING:
+		case OBJ_CHANNEL:
 			break;
 		}
 	}
@@ -460,14 +719,91 @@ static bool call_value(Value callee, uint8_t argc) {
 	return false;
 }
 
-static bool do_yield(CallFrame **fr) {
+// Suspends the stackless coroutine running in the current frame: its slots
+// are copied out and the frame is popped like a return.
+static void yield_generator(CallFrame **fr) {
 	CallFrame *frame = *fr;
+	Coroutine *co = vm.running;
+	Coroutine *gen = frame->generator;
+
+	// Everything but the value yielded, parameters included: resuming it
+	// rebinds those.
+	Value *end = co->stack_top - 1;
+	coroutine_save(gen, frame->slots, end - frame->slots, frame->ip);
+	gen->state = COROUTINE_PAUSED;
+
+	frame->slots[0] = co->stack_top[-1];
+	co->stack_top = frame->slots + 1;
+	co->frame_count--;
+	co->generator_frames--;
+	*fr = &co->frames[co->frame_count - 1];
+	co->current_frame = *fr;
+}
+
+// Something called by a stackless coroutine is suspending it, so it needs
+// frames of its own after all. Moves the topmost stackless frame and
+// everything above it off the running coroutine into the stackless one, and
+// switches to it as if it had been resumed the regular way.
+static void promote_generator(CallFrame **fr) {
+	Coroutine *co = vm.running;
+	size_t base = co->frame_count - 1;
+	while (co->frames[base].generator == NULL) {
+		base--;
+	}
+	Coroutine *gen = co->frames[base].generator;
+	size_t frame_count = co->frame_count - base;
+	size_t value_count = co->stack_top - co->frames[base].slots;
+	coroutine_make_stackful(gen, value_count, frame_count);
+
+	Value *slots = co->frames[base].slots;
+	memcpy(gen->stack, slots, sizeof(Value) * value_count);
+	gen->stack_top = gen->stack + value_count;
+	for (size_t i = 0; i < frame_count; i++) {
+		gen->frames[i] = co->frames[base + i];
+		gen->frames[i].slots = gen->stack + (gen->frames[i].slots - slots);
+		gen->frames[i].generator = NULL;
+	}
+	gen->frame_count = frame_count;
+	gen->current_frame = &gen->frames[frame_count - 1];
+
+	// Open upvalues are sorted highest first, so the ones into the moved
+	// slots are at the front.
+	Upvalue **tail = &gen->open_upvalues;
+	while (co->open_upvalues != NULL && co->open_upvalues->location >= slots) {
+		Upvalue *upvalue = co->open_upvalues;
+		co->open_upvalues = upvalue->next;
+		upvalue->location = gen->stack + (upvalue->location - slots);
+		*tail = upvalue;
+		tail = &upvalue->next;
+	}
+	*tail = NULL;
+
+	// Leave the coroutine on the caller's stack, where a regular resume
+	// would have left it.
+	co->stack_top = slots + 1;
+	co->frame_count = base;
+	co->current_frame = &co->frames[base - 1];
+	co->generator_frames--;
+
+	gen->parent = co;
+	vm.running = gen;
+	*fr = gen->current_frame;
+}
+
+static bool do_yield(CallFrame **fr) {
+	if ((*fr)->generator != NULL) {
+		yield_generator(fr);
+		return true;
+	}
+	if (vm.running->generator_frames > 0) {
+		promote_generator(fr);
+	}
+
 	Value result = vm_pop();
 
 	if (vm.running->parent) {
+		// The slots stay as they are; resuming it rebinds the parameters.
 		vm.running->state = COROUTINE_PAUSED;
-		// clear the previous arguments so the coroutine can be resumed
-		vm.running->stack_top -= frame->closure->function->arity;
 		// set the parent coroutine to active
 		vm.running = vm.running->parent;
 		*fr = vm.running->current_frame;
@@ -486,11 +822,15 @@ static bool do_yield(CallFrame **fr) {
 }
 
 static bool do_await(CallFrame **fr) {
+	if (vm.running->generator_frames > 0) {
+		promote_generator(fr);
+	}
+
 	CallFrame *frame = *fr;
 	Value result = vm_pop();
 
 	if (vm.running->parent) {
-		vm.running->state = COROUTINE_PAUSED;
+		vm.running->state = COROUTINE_AWAITING;
 		// clear the previous arguments so the coroutine can be resumed
 		vm.running->stack_top -= frame->closure->function->arity;
 		// set the parent coroutine to active
@@ -522,6 +862,8 @@ static bool do_return(CallFrame **fr, bool repl) {
 		vm.running->state = COROUTINE_COMPLETE;
 		if (vm.running->parent) {
 			vm.running = vm.running->parent;
+			// drop the coroutine from the caller's stack
+			vm_pop();
 		} else {
 			if (repl) {
 				co->frame_count++;
@@ -540,6 +882,13 @@ static bool do_return(CallFrame **fr, bool repl) {
 			// vm_reset();
 			return true;
 		}
+	} else {
+		if (frame->generator != NULL) {
+			frame->generator->state = COROUTINE_COMPLETE;
+			vm.running->generator_frames--;
+		}
+		// discard the callee and its arguments
+		vm.running->stack_top = frame->slots;
 	}
 	*fr = &vm.running->frames[vm.running->frame_count - 1];
 	vm.running->current_frame = *fr;
@@ -558,7 +907,21 @@ InterpretResult vm_run(bool repl) {
 	#define READ_DWORD() (frame->ip += 4, (uint32_t)((frame->ip[-4] << 24) | (frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]))
   #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
 	#define READ_CONSTANT_LONG()    \
-		(frame->closure->function->chunk.constants.values[READ_BYTE() | (READ_BYTE() << 8) | (READ_BYTE() << 16)])
+		(frame->ip += 3, frame->closure->function->chunk.constants.values[ \
+			frame->ip[-3] | (frame->ip[-2] << 8) | (frame->ip[-1] << 16)])
+
+	// Objects can only be moved while no C code is holding on to them, so a
+	// collection that wants to compact leaves it to the dispatch loop.
+	#define SAFEPOINT() \
+		do { \
+			if (vm.gc_pacer.compact_pending) { \
+				gc_compact(); \
+			} \
+		} while (false)
+
+	// Whether control just got back to the coroutine that called vm_resume.
+	#define RESUMED() \
+		(vm.running == vm.resume_base && vm.running->frame_count == vm.resume_depth)
 
 	#ifdef DYNAMIC_TYPE_CHECKING
 	#define BINARY_OP(value_type, op) \
@@ -701,21 +1064,30 @@ InterpretResult vm_run(bool repl) {
 		}
 		case OP_CALL: {
 			size_t argc = READ_BYTE();
+			SAFEPOINT();
 			// TODO: better error handling
 			if (!call_value(vm_peek(argc), argc)) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
+			// A native may have parked the task vm_resume started.
+			if (RESUMED()) {
+				return INTERPRET_OK;
+			}
 			frame = &vm.running->frames[vm.running->frame_count - 1];
 			break;
 		}
 		case OP_SET_FIELD: {
-			Value value = vm_pop();
-			Value key = vm_pop();
-			Value container = vm_peek(0);
+			// Leave the key and value on the stack until they're stored: growing
+			// the container can collect.
+			Value value = vm_peek(0);
+			Value key = vm_peek(1);
+			Value container = vm_peek(2);
 
 			if (!set_field(container, key, value)) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
+			vm_pop();
+			vm_pop();
 			break;
 		}
 		case OP_GET_FIELD: {
@@ -728,48 +1100,25 @@ InterpretResult vm_run(bool repl) {
 			break;
 		}
 		case OP_LIST: {
-			List *list = list_new();
-			uint8_t count = READ_BYTE();
-			for (uint8_t i = 0; i < count; i++) {
-				list_push(list, vm_peek(count - i - 1));
-			}
-			vm.running->stack_top -= count;
-			vm_push(OBJ_VAL(list));
+			build_list(READ_BYTE());
 			break;
 		}
 		case OP_LIST_LONG: {
-			List *list = list_new();
 			uint32_t count = READ_BYTE();
 			count |= READ_BYTE() << 8;
 			count |= READ_BYTE() << 16;
-			while (count--) {
-				list_push(list, vm_pop());
-			}
-			vm_push(OBJ_VAL(list));
+			build_list(count);
 			break;
 		}
 		case OP_DICT: {
-			Dictionary *dict = dict_new();
-			uint8_t count = READ_BYTE();
-			while (count--) {
-				Value value = vm_pop();
-				Value key = vm_pop(); // because of the compiler, this should *always* be a string
-				dict_set(dict, AS_STRING(key), value);
-			}
-			vm_push(OBJ_VAL(dict));
+			build_dict(READ_BYTE());
 			break;
 		}
 		case OP_DICT_LONG: {
-			Dictionary *dict = dict_new();
 			uint32_t count = READ_BYTE();
 			count |= READ_BYTE() << 8;
 			count |= READ_BYTE() << 16;
-			while (count--) {
-				Value value = vm_pop();
-				Value key = vm_pop(); // same as above
-				dict_set(dict, AS_STRING(key), value);
-			}
-			vm_push(OBJ_VAL(dict));
+			build_dict(count);
 			break;
 		}
 		case OP_CLOSURE: {
@@ -821,18 +1170,27 @@ InterpretResult vm_run(bool repl) {
 			if (do_return(&frame, repl)) {
 				return INTERPRET_OK;
 			}
+			if (RESUMED()) {
+				return INTERPRET_OK;
+			}
 			break;
 		}
 		case OP_YIELD: {
 			if (!do_yield(&frame)) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
+			if (RESUMED()) {
+				return INTERPRET_OK;
+			}
 			break;
 		}
 		case OP_AWAIT: {
 			if (!do_await(&frame)) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
+			if (RESUMED()) {
+				return INTERPRET_OK;
+			}
 			break;
 		}
 		case OP_POP: {
@@ -904,6 +1262,11 @@ InterpretResult vm_run(bool repl) {
 				runtime_error("Attempted to create a coroutine from a non-function value.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
+			// Whether it can be stackless depends on the body.
+			if (!compile_body(AS_CLOSURE(f)->function)) {
+				runtime_error("Could not compile the function's body.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
 			Coroutine *co = coroutine_new(AS_CLOSURE(f));
 			vm_pop();
 			vm_push(OBJ_VAL(co));
@@ -945,6 +1308,7 @@ InterpretResult vm_run(bool repl) {
 		case OP_LOOP: {
 			uint32_t offset = READ_DWORD();
 			frame->ip -= offset;
+			SAFEPOINT();
 			break;
 		}
 		}
@@ -956,6 +1320,72 @@ InterpretResult vm_run(bool repl) {
   #undef READ_CONSTANT
 	#undef READ_CONSTANT_LONG
 	#undef BINARY_OP
+	#undef SAFEPOINT
+	#undef RESUMED
+}
+
+static bool enter_native_call() {
+	if (vm.resume_nesting == RESUME_NESTING_MAX) {
+		runtime_error("Too many nested calls from native code.");
+		return false;
+	}
+	vm.resume_bases[vm.resume_nesting] = vm.resume_base;
+	vm.resume_depths[vm.resume_nesting] = vm.resume_depth;
+	vm.resume_nesting++;
+	vm.resume_base = vm.running;
+	vm.resume_depth = vm.running->frame_count;
+	return true;
+}
+
+static void leave_native_call() {
+	vm.resume_nesting--;
+	vm.resume_base = vm.resume_bases[vm.resume_nesting];
+	vm.resume_depth = vm.resume_depths[vm.resume_nesting];
+}
+
+// Runs the call set up on top of the stack until control is back where it
+// started.
+static bool finish_native_call(bool called) {
+	if (!called) {
+		return false;
+	}
+	if (vm.running == vm.resume_base && vm.running->frame_count == vm.resume_depth) {
+		// Natives finish right away.
+		return true;
+	}
+	return vm_run(false) == INTERPRET_OK;
+}
+
+// Resumes `co` from native code, passing `value` if `has_value` is set, and
+// runs until it suspends or finishes. Returns false if it failed, after the
+// error has been reported.
+bool vm_resume(Coroutine *co, Value value, bool has_value) {
+	if (!enter_native_call()) {
+		return false;
+	}
+	vm_push(OBJ_VAL(co));
+	if (has_value) {
+		vm_push(value);
+	}
+	bool ok = finish_native_call(call_coroutine(co, has_value ? 1 : 0));
+	if (ok) {
+		// Whatever it yielded or returned.
+		vm_pop();
+	}
+	leave_native_call();
+	return ok;
+}
+
+// Calls the value below the `argc` arguments on top of the stack from
+// native code, and leaves the result in their place. Returns false if it
+// failed, after the error has been reported.
+bool vm_invoke(uint8_t argc) {
+	if (!enter_native_call()) {
+		return false;
+	}
+	bool ok = finish_native_call(call_value(vm_peek(argc), argc));
+	leave_native_call();
+	return ok;
 }
 
 
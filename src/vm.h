@@ -2,10 +2,16 @@
 #define clox_vm_h
 
 #include "chunk.h"
+#include "heap.h"
+#include "loop.h"
 #include "object.h"
+#include "segment.h"
 #include "table.h"
 #include "value.h"
 
+// How deeply natives may call back into the interpreter.
+#define RESUME_NESTING_MAX 64
+
 typedef enum {
   INTERPRET_OK,
   INTERPRET_COMPILE_ERROR,
@@ -15,31 +21,55 @@ typedef enum {
 typedef struct {
   // The active coroutine.
   Coroutine *running;
-  // The toplevel coroutine. This should always be the first
-  // coroutine in the GC linked list, and should always be accessible
-  // from a coroutine object by traversing its ancestors.
+  // The toplevel coroutine. This should always be accessible from a
+  // coroutine object by traversing its ancestors.
   Coroutine *main;
 
+  // Size-class allocator backing `reallocate`, and the object pages the
+  // collector sweeps.
+  Heap heap;
+
   // GC
   size_t gray_count;
   size_t gray_capacity;
   Object **gray_stack;
+  // Coroutines marked with dead locals that still refer to objects, for the
+  // collector to clear the ones it frees.
+  size_t stale_count;
+  size_t stale_capacity;
+  Coroutine **stale_stacks;
   // TODO: add nursery and tenured spaces for generational GC
   size_t bytes_allocated;
   size_t next_gc;
+  GcPacer gc_pacer;
+  GcStats gc_stats;
+  CoroutinePool coroutine_pool;
+  // Shared segments this isolate's heap points into.
+  SegmentSet segments;
 
-  bool mark_value;
+  EventLoop loop;
+  // The innermost vm_resume or vm_invoke: the coroutine it was called from,
+  // and how many frames that had. vm_run hands control back once it is
+  // there again. The ones it is nested in are saved below it.
+  Coroutine *resume_base;
+  size_t resume_depth;
+  Coroutine *resume_bases[RESUME_NESTING_MAX];
+  size_t resume_depths[RESUME_NESTING_MAX];
+  size_t resume_nesting;
+  // Set by a native that ran code which failed. The error has already been
+  // reported and the VM reset.
+  bool native_error;
+  // Set by vm_park.
+  bool native_parked;
 
   // Heap / globals
-  Upvalue *open_upvalues;
-  Object *objects;
   Table strings;
   // TODO: come up with a faster way to look up globals (maybe by index instead
   // of hash?)
   Table globals;
 } VM;
 
-extern VM vm;
+extern THREAD_LOCAL VM vm;
 
 char *vm_init();
 void vm_free();
@@ -49,6 +79,10 @@ Value vm_pop();
 Value vm_peek(size_t distance);
 bool vm_call(Closure *closure, uint8_t argc);
 InterpretResult vm_run(bool repl);
+bool vm_resume(Coroutine *co, Value value, bool has_value);
+bool vm_invoke(uint8_t argc);
+Coroutine *vm_parkable();
+void vm_park();
 
 InterpretResult vm_interpret(Function *function);
 